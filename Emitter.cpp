@@ -0,0 +1,257 @@
+#include "Emitter.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <stdint.h>
+
+using namespace vmath;
+
+// Emitters are only touched by the thread that steps the fluid.
+static std::vector<Emitter> Emitters;
+static bool MemberSplats = true;
+
+Emitter CreateEmitter(EmitterShape shape, Vector3 center, Vector3 extent)
+{
+    Emitter emitter;
+    emitter.Shape = shape;
+    emitter.Center = center;
+    emitter.Extent = extent;
+    emitter.Rate = 1;
+    emitter.Density = ImpulseDensity;
+    emitter.Temperature = ImpulseTemperature;
+    emitter.Velocity = Vector3(0);
+    emitter.VelocityWeight = 0;
+    emitter.Member = AllMembers;
+    emitter.Active = true;
+    return emitter;
+}
+
+int AddEmitter(const Emitter& emitter)
+{
+    Emitters.push_back(emitter);
+    return int(Emitters.size()) - 1;
+}
+
+void ActivateEmitter(int handle, bool active)
+{
+    Emitters[handle].Active = active;
+}
+
+void ClearEmitters()
+{
+    Emitters.clear();
+}
+
+int EmitterCount()
+{
+    return int(Emitters.size());
+}
+
+void EnableMemberSplats(bool enable)
+{
+    MemberSplats = enable;
+}
+
+// Emitters as they are stored in checkpoints, without the padding of vmath's vectors.
+struct EmitterRecord {
+    int32_t Shape;
+    float Center[3];
+    float Extent[3];
+    float Rate;
+    float Density;
+    float Temperature;
+    float Velocity[3];
+    float VelocityWeight;
+    int32_t Member;
+    int32_t Active;
+};
+
+void SaveEmitters(std::vector<unsigned char>* state)
+{
+    int32_t header[2] = { MemberSplats, int32_t(Emitters.size()) };
+    const unsigned char* bytes = (const unsigned char*) header;
+    state->insert(state->end(), bytes, bytes + sizeof(header));
+    for (size_t i = 0; i < Emitters.size(); ++i) {
+        const Emitter& e = Emitters[i];
+        EmitterRecord record = {
+            e.Shape, { e.Center.getX(), e.Center.getY(), e.Center.getZ() },
+            { e.Extent.getX(), e.Extent.getY(), e.Extent.getZ() }, e.Rate, e.Density, e.Temperature,
+            { e.Velocity.getX(), e.Velocity.getY(), e.Velocity.getZ() }, e.VelocityWeight, e.Member, e.Active,
+        };
+        bytes = (const unsigned char*) &record;
+        state->insert(state->end(), bytes, bytes + sizeof(record));
+    }
+}
+
+size_t LoadEmitters(const unsigned char* bytes, size_t size)
+{
+    int32_t header[2];
+    if (size < sizeof(header)) {
+        return 0;
+    }
+    memcpy(header, bytes, sizeof(header));
+    size_t total = sizeof(header) + size_t(header[1]) * sizeof(EmitterRecord);
+    if (header[1] < 0 || size < total) {
+        return 0;
+    }
+
+    MemberSplats = header[0] != 0;
+    Emitters.clear();
+    for (int i = 0; i < header[1]; ++i) {
+        EmitterRecord r;
+        memcpy(&r, bytes + sizeof(header) + i * sizeof(r), sizeof(r));
+        Emitter e = CreateEmitter(EmitterShape(r.Shape), Vector3(r.Center[0], r.Center[1], r.Center[2]),
+                                  Vector3(r.Extent[0], r.Extent[1], r.Extent[2]));
+        e.Rate = r.Rate;
+        e.Density = r.Density;
+        e.Temperature = r.Temperature;
+        e.Velocity = Vector3(r.Velocity[0], r.Velocity[1], r.Velocity[2]);
+        e.VelocityWeight = r.VelocityWeight;
+        e.Member = r.Member;
+        e.Active = r.Active != 0;
+        Emitters.push_back(e);
+    }
+    return total;
+}
+
+static Vector3 MeshPosition(const PezVerts& mesh, const Matrix4& transform, int vertex)
+{
+    const PezAttrib& position = mesh.Attribs[0];
+    const float* p = (const float*) ((const char*) position.Frames + vertex * position.Stride);
+    return (transform * Point3(p[0], p[1], p[2])).getXYZ();
+}
+
+static int MeshIndex(const PezVerts& mesh, int i)
+{
+    if (!mesh.IndexCount) {
+        return i;
+    }
+    switch (mesh.IndexType) {
+    case GL_UNSIGNED_BYTE: return ((const GLubyte*) mesh.Indices)[i];
+    case GL_UNSIGNED_SHORT: return ((const GLushort*) mesh.Indices)[i];
+    default: return ((const GLuint*) mesh.Indices)[i];
+    }
+}
+
+// Triangles are sampled at intervals of half a cell, which finds every cell that they
+// pass through well enough for a smoke source.
+int AddMeshEmitter(const PezVerts& mesh, Matrix4 transform, const Emitter& params)
+{
+    std::vector<int> cells;
+    int indexCount = mesh.IndexCount ? mesh.IndexCount : mesh.VertexCount;
+    for (int i = 0; i + 2 < indexCount; i += 3) {
+        Vector3 a = MeshPosition(mesh, transform, MeshIndex(mesh, i));
+        Vector3 b = MeshPosition(mesh, transform, MeshIndex(mesh, i + 1));
+        Vector3 c = MeshPosition(mesh, transform, MeshIndex(mesh, i + 2));
+        float longest = std::max(length(b - a), std::max(length(c - a), length(c - b)));
+        int steps = std::max(1, int(ceilf(longest * 2)));
+        for (int u = 0; u <= steps; ++u) {
+            for (int v = 0; u + v <= steps; ++v) {
+                Vector3 p = a + (b - a) * (float(u) / steps) + (c - a) * (float(v) / steps);
+                int x = int(floorf(p.getX())), y = int(floorf(p.getY())), z = int(floorf(p.getZ()));
+                if (x >= 0 && x < GridWidth && y >= 0 && y < GridHeight && z >= 0 && z < GridDepth) {
+                    cells.push_back((z * GridHeight + y) * GridWidth + x);
+                }
+            }
+        }
+    }
+    std::sort(cells.begin(), cells.end());
+    cells.erase(std::unique(cells.begin(), cells.end()), cells.end());
+
+    Emitter point = params;
+    point.Shape = EmitterPoint;
+    for (size_t i = 0; i < cells.size(); ++i) {
+        int x = cells[i] % GridWidth;
+        int y = cells[i] / GridWidth % GridHeight;
+        int z = cells[i] / (GridWidth * GridHeight);
+        point.Center = Vector3(x + 0.5f, y + 0.5f, z + 0.5f);
+        Emitters.push_back(point);
+    }
+    return int(cells.size());
+}
+
+static Emitter MemberSplat(int member)
+{
+    Emitter splat = CreateEmitter(EmitterSphere, Members[member].ImpulsePosition, Vector3(SplatRadius));
+    splat.Density = Members[member].ImpulseDensity;
+    splat.Temperature = Members[member].ImpulseTemperature;
+    splat.Member = member;
+    return splat;
+}
+
+// Points cover the cell that contains them.
+static Vector3 HalfSize(const Emitter& emitter)
+{
+    switch (emitter.Shape) {
+    case EmitterPoint: return Vector3(0.5f);
+    case EmitterSphere: return Vector3(emitter.Extent.getX());
+    default: return emitter.Extent;
+    }
+}
+
+static void PackEmitter(const Emitter& emitter, int member, std::vector<float>* texels, int* footprintLayers)
+{
+    float base = float(member * GridDepth);
+    Vector3 half = HalfSize(emitter);
+    float z = emitter.Center.getZ();
+    float texel[16] = {
+        emitter.Center.getX(), emitter.Center.getY(), z + base, float(emitter.Shape),
+        emitter.Extent.getX(), emitter.Extent.getY(), emitter.Extent.getZ(), emitter.Rate,
+        emitter.Density, emitter.Temperature, base, base + GridDepth,
+        emitter.Velocity.getX(), emitter.Velocity.getY(), emitter.Velocity.getZ(), emitter.VelocityWeight,
+    };
+    texels->insert(texels->end(), texel, texel + 16);
+    int layers = int(floorf(z + half.getZ()) - floorf(z - half.getZ())) + 1;
+    *footprintLayers = std::max(*footprintLayers, layers);
+}
+
+int PackEmitters(int memberCount, std::vector<float>* texels, int* footprintLayers)
+{
+    texels->clear();
+    *footprintLayers = 0;
+    int count = 0;
+    for (int member = 0; member < memberCount; ++member) {
+        if (MemberSplats) {
+            PackEmitter(MemberSplat(member), member, texels, footprintLayers);
+            ++count;
+        }
+        for (size_t i = 0; i < Emitters.size(); ++i) {
+            const Emitter& emitter = Emitters[i];
+            if (emitter.Active && (emitter.Member == member || emitter.Member == AllMembers)) {
+                PackEmitter(emitter, member, texels, footprintLayers);
+                ++count;
+            }
+        }
+    }
+    return count;
+}
+
+static void GrowBounds(const Emitter& emitter, int* lo, int* hi)
+{
+    Vector3 half = HalfSize(emitter);
+    for (int axis = 0; axis < 3; ++axis) {
+        lo[axis] = std::min(lo[axis], int(floorf(emitter.Center[axis] - half[axis])));
+        hi[axis] = std::max(hi[axis], int(ceilf(emitter.Center[axis] + half[axis])) + 1);
+    }
+}
+
+bool EmitterBounds(int member, int* lo, int* hi)
+{
+    bool any = false;
+    for (int axis = 0; axis < 3; ++axis) {
+        lo[axis] = 1 << 30;
+        hi[axis] = -(1 << 30);
+    }
+    if (MemberSplats) {
+        GrowBounds(MemberSplat(member), lo, hi);
+        any = true;
+    }
+    for (size_t i = 0; i < Emitters.size(); ++i) {
+        const Emitter& emitter = Emitters[i];
+        if (emitter.Active && (emitter.Member == member || emitter.Member == AllMembers)) {
+            GrowBounds(emitter, lo, hi);
+            any = true;
+        }
+    }
+    return any;
+}
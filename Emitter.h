@@ -0,0 +1,60 @@
+#pragma once
+#include <vector>
+#include "Utility.h"
+
+enum EmitterShape {
+    EmitterPoint,
+    EmitterSphere,
+    EmitterBox,
+};
+
+const int AllMembers = -1;
+
+// A source of smoke, heat and motion, in cells of one member's grid.  Every step, each
+// active emitter pulls the cells it covers toward its Density and Temperature, and
+// toward its Velocity by VelocityWeight.  Rate is how far its core cells move per step,
+// so 1 replaces them; spheres and boxes fade out over their outermost two cells.
+struct Emitter {
+    EmitterShape Shape;
+    vmath::Vector3 Center;
+    vmath::Vector3 Extent;  // The radius in X for spheres, the half size for boxes.
+    float Rate;
+    float Density;
+    float Temperature;
+    vmath::Vector3 Velocity;
+    float VelocityWeight;
+    int Member;             // Or AllMembers.
+    bool Active;
+};
+
+// Emits the default impulse values and leaves the velocity alone.
+Emitter CreateEmitter(EmitterShape shape, vmath::Vector3 center, vmath::Vector3 extent);
+
+// Handles are indices that stay valid until ClearEmitters.
+int AddEmitter(const Emitter& emitter);
+void ActivateEmitter(int handle, bool active);
+void ClearEmitters();
+int EmitterCount();
+
+// Adds a point emitter for every cell that the mesh's surface passes through, so a mesh
+// source costs as much as that many points.  Positions are the first attribute; the
+// transform takes them to cells.  Returns the number of emitters added.
+int AddMeshEmitter(const PezVerts& mesh, vmath::Matrix4 transform, const Emitter& params);
+
+// Every member also emits the sphere described by its MemberParams unless this is off.
+void EnableMemberSplats(bool enable);
+
+// Appends the emitter table and the member splat switch to a checkpoint's state, or
+// replaces them with the ones that start at bytes.  Returns the number of bytes read,
+// or 0 if they are cut short.
+void SaveEmitters(std::vector<unsigned char>* state);
+size_t LoadEmitters(const unsigned char* bytes, size_t size);
+
+// Writes four texels per emitter for Fluid.Inject, with each member's copy of an
+// AllMembers emitter moved to its layers.  FootprintLayers receives the most layers
+// that any emitter covers.  Returns the number of emitters written.
+int PackEmitters(int memberCount, std::vector<float>* texels, int* footprintLayers);
+
+// The cells that a member's emitters can touch, in member coordinates, as half-open
+// ranges.  Returns false if the member has no emitters.
+bool EmitterBounds(int member, int* lo, int* hi);
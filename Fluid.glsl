@@ -1,13 +1,32 @@
 
 -- Vertex
 
+// Layered programs built with VertexLayer set the layer here instead of in PickLayer.
+#ifdef VertexLayer
+#ifdef GL_ARB_shader_viewport_layer_array
+#extension GL_ARB_shader_viewport_layer_array : require
+#else
+#extension GL_AMD_vertex_shader_layer : require
+#endif
+#endif
+
 in vec4 Position;
+uniform int LayerOffset;
+#ifdef VertexLayer
+out float gLayer;
+#else
 out int vInstance;
+#endif
 
 void main()
 {
     gl_Position = Position;
-    vInstance = gl_InstanceID;
+#ifdef VertexLayer
+    gl_Layer = gl_InstanceID + LayerOffset;
+    gLayer = float(gl_Layer) + 0.5;
+#else
+    vInstance = gl_InstanceID + LayerOffset;
+#endif
 }
 
 -- Fill
@@ -49,8 +68,13 @@ uniform sampler3D SourceTexture;
 uniform sampler3D Obstacles;
 
 uniform vec3 InverseSize;
+uniform float Dissipation[MaxEnsembleSize];
+#ifndef TimeStep
 uniform float TimeStep;
-uniform float Dissipation;
+#endif
+#ifndef MemberDepth
+uniform float MemberDepth;
+#endif
 
 in float gLayer;
 
@@ -65,8 +89,11 @@ void main()
 
     vec3 u = texture(VelocityTexture, InverseSize * fragCoord).xyz;
 
-    vec3 coord = InverseSize * (fragCoord - TimeStep * u);
-    FragColor = Dissipation * texture(SourceTexture, coord);
+    // Keep the backtrace inside this ensemble member's slab of layers:
+    vec3 coord = fragCoord - TimeStep * u;
+    float base = floor(gLayer / MemberDepth) * MemberDepth;
+    coord.z = clamp(coord.z, base + 0.5, base + MemberDepth - 0.5);
+    FragColor = Dissipation[int(base / MemberDepth)] * texture(SourceTexture, InverseSize * coord);
 }
 
 -- Jacobi
@@ -77,8 +104,12 @@ uniform sampler3D Pressure;
 uniform sampler3D Divergence;
 uniform sampler3D Obstacles;
 
+#ifndef Alpha
 uniform float Alpha;
+#endif
+#ifndef InverseBeta
 uniform float InverseBeta;
+#endif
 
 in float gLayer;
 
@@ -115,6 +146,69 @@ void main()
     FragColor = (pW + pE + pS + pN + pU + pD + Alpha * bC) * InverseBeta;
 }
 
+-- ClearOutside
+
+out vec4 FragColor;
+
+uniform ivec3 BoxMin[MaxEnsembleSize];
+uniform ivec3 BoxMax[MaxEnsembleSize];
+uniform vec4 Value;
+#ifndef MemberDepth
+uniform float MemberDepth;
+#endif
+
+in float gLayer;
+
+void main()
+{
+    ivec3 T = ivec3(gl_FragCoord.xy, gLayer);
+    int member = int(gLayer / MemberDepth);
+    if (all(greaterThanEqual(T, BoxMin[member])) && all(lessThan(T, BoxMax[member])))
+        discard;
+    FragColor = Value;
+}
+
+-- Residual
+
+out float FragColor;
+
+uniform sampler3D Pressure;
+uniform sampler3D Divergence;
+uniform sampler3D Obstacles;
+
+#ifndef Alpha
+uniform float Alpha;
+#endif
+#ifndef InverseBeta
+uniform float InverseBeta;
+#endif
+
+in float gLayer;
+
+// How far one more Jacobi iteration would move the pressure at this cell.
+void main()
+{
+    ivec3 T = ivec3(gl_FragCoord.xy, gLayer);
+
+    float pN = texelFetchOffset(Pressure, T, 0, ivec3(0, 1, 0)).r;
+    float pS = texelFetchOffset(Pressure, T, 0, ivec3(0, -1, 0)).r;
+    float pE = texelFetchOffset(Pressure, T, 0, ivec3(1, 0, 0)).r;
+    float pW = texelFetchOffset(Pressure, T, 0, ivec3(-1, 0, 0)).r;
+    float pU = texelFetchOffset(Pressure, T, 0, ivec3(0, 0, 1)).r;
+    float pD = texelFetchOffset(Pressure, T, 0, ivec3(0, 0, -1)).r;
+    float pC = texelFetch(Pressure, T, 0).r;
+
+    if (texelFetchOffset(Obstacles, T, 0, ivec3(0, 1, 0)).x > 0) pN = pC;
+    if (texelFetchOffset(Obstacles, T, 0, ivec3(0, -1, 0)).x > 0) pS = pC;
+    if (texelFetchOffset(Obstacles, T, 0, ivec3(1, 0, 0)).x > 0) pE = pC;
+    if (texelFetchOffset(Obstacles, T, 0, ivec3(-1, 0, 0)).x > 0) pW = pC;
+    if (texelFetchOffset(Obstacles, T, 0, ivec3(0, 0, 1)).x > 0) pU = pC;
+    if (texelFetchOffset(Obstacles, T, 0, ivec3(0, 0, -1)).x > 0) pD = pC;
+
+    float bC = texelFetch(Divergence, T, 0).r;
+    FragColor = abs((pW + pE + pS + pN + pU + pD + Alpha * bC) * InverseBeta - pC);
+}
+
 -- SubtractGradient
 
 out vec3 FragColor;
@@ -122,7 +216,9 @@ out vec3 FragColor;
 uniform sampler3D Velocity;
 uniform sampler3D Pressure;
 uniform sampler3D Obstacles;
+#ifndef GradientScale
 uniform float GradientScale;
+#endif
 
 in float gLayer;
 
@@ -177,7 +273,9 @@ out float FragColor;
 
 uniform sampler3D Velocity;
 uniform sampler3D Obstacles;
+#ifndef HalfInverseCellSize
 uniform float HalfInverseCellSize;
+#endif
 
 in float gLayer;
 
@@ -212,26 +310,125 @@ void main()
     FragColor = HalfInverseCellSize * (vE.x - vW.x + vN.y - vS.y + vU.z - vD.z);
 }
 
--- Splat
+-- EmitterVertex
 
-out vec4 FragColor;
+#ifdef VertexLayer
+#ifdef GL_ARB_shader_viewport_layer_array
+#extension GL_ARB_shader_viewport_layer_array : require
+#else
+#extension GL_AMD_vertex_shader_layer : require
+#endif
+#endif
+
+// Emitters are four texels each, as written by PackEmitters: (center, shape),
+// (extent, rate), (density, temperature, first layer, end layer) and (velocity,
+// velocity weight).  Every emitter is drawn as FootprintLayers instances of a quad
+// around its shape, so only the cells near it are shaded.
+
+in vec4 Position;
+#ifdef VertexLayer
+out float gLayer;
+flat out int gEmitter;
+#else
+out int vInstance;
+out int vEmitter;
+#endif
+
+uniform samplerBuffer Emitters;
+uniform int FootprintLayers;
+uniform vec2 InverseSize;
+
+void main()
+{
+    int emitter = gl_InstanceID / FootprintLayers;
+    vec4 center = texelFetch(Emitters, emitter * 4);
+    vec4 extent = texelFetch(Emitters, emitter * 4 + 1);
+    vec4 layers = texelFetch(Emitters, emitter * 4 + 2);
+
+    // Points cover the cell that contains them; spheres keep their radius in X.
+    int shape = int(center.w);
+    vec3 halfSize = shape == 0 ? vec3(0.5) : (shape == 1 ? extent.xxx : extent.xyz);
+    float layer = floor(center.z - halfSize.z) + float(gl_InstanceID % FootprintLayers);
+
+    // Layers past the emitter or outside its member collapse to a point outside the clip volume.
+    vec2 corner = center.xy + Position.xy * (halfSize.xy + 1.0);
+    gl_Position = vec4(corner * 2.0 * InverseSize - 1.0, 0, 1);
+    if (layer > floor(center.z + halfSize.z) || layer < layers.z || layer >= layers.w) {
+        gl_Position = vec4(2, 2, 0, 1);
+    }
+#ifdef VertexLayer
+    gl_Layer = int(layer);
+    gLayer = layer + 0.5;
+    gEmitter = emitter;
+#else
+    vInstance = int(layer);
+    vEmitter = emitter;
+#endif
+}
+
+-- EmitterLayer
 
-uniform vec3 Point;
-uniform float Radius;
-uniform vec3 FillColor;
+layout(triangles) in;
+layout(triangle_strip, max_vertices = 3) out;
+
+in int vInstance[3];
+in int vEmitter[3];
+out float gLayer;
+flat out int gEmitter;
+
+void main()
+{
+    gl_Layer = vInstance[0];
+    gLayer = float(gl_Layer) + 0.5;
+    gEmitter = vEmitter[0];
+    gl_Position = gl_in[0].gl_Position;
+    EmitVertex();
+    gl_Position = gl_in[1].gl_Position;
+    EmitVertex();
+    gl_Position = gl_in[2].gl_Position;
+    EmitVertex();
+    EndPrimitive();
+}
+
+-- Inject
+
+// Blended into density, temperature and velocity at once; the alpha of each output is
+// how far the cell moves toward the emitter's value.
+layout(location = 0) out vec4 DensityColor;
+layout(location = 1) out vec4 TemperatureColor;
+layout(location = 2) out vec4 VelocityColor;
+
+uniform samplerBuffer Emitters;
 
 in float gLayer;
+flat in int gEmitter;
 
 void main()
 {
-    float d = distance(Point, vec3(gl_FragCoord.xy, gLayer));
-    if (d < Radius) {
-        float a = (Radius - d) * 0.5;
-        a = min(a, 1.0);
-        FragColor = vec4(FillColor, a);
+    vec4 center = texelFetch(Emitters, gEmitter * 4);
+    vec4 extent = texelFetch(Emitters, gEmitter * 4 + 1);
+    vec4 values = texelFetch(Emitters, gEmitter * 4 + 2);
+    vec4 velocity = texelFetch(Emitters, gEmitter * 4 + 3);
+    vec3 cell = vec3(gl_FragCoord.xy, gLayer);
+
+    float a;
+    int shape = int(center.w);
+    if (shape == 0) {
+        a = all(equal(floor(cell), floor(center.xyz))) ? 1.0 : 0.0;
+    } else if (shape == 1) {
+        a = (extent.x - distance(center.xyz, cell)) * 0.5;
     } else {
-        FragColor = vec4(0);
+        vec3 inside = extent.xyz - abs(cell - center.xyz);
+        a = min(min(inside.x, inside.y), inside.z) * 0.5;
     }
+    if (a <= 0.0) {
+        discard;
+    }
+    a = min(a, 1.0) * extent.w;
+
+    DensityColor = vec4(vec3(values.x), a);
+    TemperatureColor = vec4(vec3(values.y), a);
+    VelocityColor = vec4(velocity.xyz, a * velocity.w);
 }
 
 -- Buoyancy
@@ -240,16 +437,24 @@ out vec3 FragColor;
 uniform sampler3D Velocity;
 uniform sampler3D Temperature;
 uniform sampler3D Density;
+uniform float Sigma[MaxEnsembleSize];
+uniform float Kappa[MaxEnsembleSize];
+#ifndef AmbientTemperature
 uniform float AmbientTemperature;
+#endif
+#ifndef TimeStep
 uniform float TimeStep;
-uniform float Sigma;
-uniform float Kappa;
+#endif
+#ifndef MemberDepth
+uniform float MemberDepth;
+#endif
 
 in float gLayer;
 
 void main()
 {
     ivec3 TC = ivec3(gl_FragCoord.xy, gLayer);
+    int member = int(gLayer / MemberDepth);
     float T = texelFetch(Temperature, TC, 0).r;
     vec3 V = texelFetch(Velocity, TC, 0).xyz;
 
@@ -257,6 +462,6 @@ void main()
 
     if (T > AmbientTemperature) {
         float D = texelFetch(Density, TC, 0).x;
-        FragColor += (TimeStep * (T - AmbientTemperature) * Sigma - D * Kappa ) * vec3(0, -1, 0);
+        FragColor += (TimeStep * (T - AmbientTemperature) * Sigma[member] - D * Kappa[member] ) * vec3(0, -1, 0);
     }
 }
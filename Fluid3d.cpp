@@ -1,26 +1,53 @@
 #include "Utility.h"
+#include "Emitter.h"
+#include "Hud.h"
+#include "Playback.h"
+#include "Readback.h"
+#include "Recorder.h"
+#include "Reduce.h"
+#include "Sweep.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <cmath>
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <thread>
 
 using namespace vmath;
 using std::string;
 
-#define OpenGLError GL_NO_ERROR == glGetError(),                        \
-        "%s:%d - OpenGL Error - %s", __FILE__, __LINE__, __FUNCTION__   \
+static FluidPod Fluid;
 
+// The blurred density and light cache that one displayed frame raycasts against.
+// Ready is signaled once the simulation thread has filled them, and Released once
+// the renderer is done reading them.
+struct FieldFrame {
+    SurfacePod BlurredDensity;
+    SurfacePod LightCache;
+    GLsync Ready;
+    GLsync Released;
+};
+
+// Triple-buffered handoff: the simulation thread fills Frames[Writing] and swaps it
+// with Pending, and the renderer swaps Pending with Showing whenever Fresh is set.
 static struct {
-    SlabPod Velocity;
-    SlabPod Density;
-    SlabPod Pressure;
-    SlabPod Temperature;
-} Slabs;
+    FieldFrame Frames[3];
+    int Writing;
+    int Pending;
+    int Showing;
+    bool Fresh;
+    std::mutex Mutex;
+} Fields;
 
+// Keys that touch the fields are handled on the simulation thread, between steps.
 static struct {
-    SurfacePod Divergence;
-    SurfacePod Obstacles;
-    SurfacePod LightCache;
-    SurfacePod BlurredDensity;
-} Surfaces;
+    std::deque<char> Pending;
+    std::mutex Mutex;
+} SimulationKeys;
 
 static struct {
     Matrix4 Projection;
@@ -29,6 +56,8 @@ static struct {
     Matrix4 ModelviewProjection;
 } Matrices;
 
+// CubeCenter belongs to the window's context and FullscreenQuad to the simulation's,
+// since vertex arrays aren't shared between contexts.
 static struct {
     GLuint CubeCenter;
     GLuint FullscreenQuad;
@@ -46,7 +75,32 @@ static float ThetaX = DefaultThetaX;
 static float ThetaY = DefaultThetaY;
 static int ViewSamples = GridWidth*2;
 static int LightSamples = GridWidth;
-static float Fips = -4;
+static int DisplayMember = 0;
+static const int ViewerEnsembleSize = 4;
+static bool RecordFluid = false;
+static const char* CacheFile = "fluid.vol";
+static const char* CheckpointFile = "fluid.ckpt";
+static const char* FramePattern = "frame%05d.png";
+static const char* FrameStream = "fluid.y4m";
+static const int CheckpointInterval = 100;
+static std::atomic<bool> DebugOutput(PEZ_GL_DEBUG);
+static std::atomic<bool> ShowHud(false);
+static std::atomic<int> StepCount(0);
+static std::atomic<float> ActiveShare(1);
+static const float HudInterval = 0.25f;
+static const int SolverStatsInterval = 8;
+
+// Scratch field for the pressure residual, reduced along with the density and speed.
+static SurfacePod Residual;
+
+// Written by a reduction on the simulation thread, read by the overlay.
+static struct {
+    float Residual;
+    float Mass;
+    float Courant;
+    bool Valid;
+    std::mutex Mutex;
+} SolverStats;
 
 PezConfig PezGetConfig()
 {
@@ -63,9 +117,16 @@ void PezInitialize()
 {
     PezConfig cfg = PezGetConfig();
 
-    RaycastProgram = LoadProgram("Raycast.VS", "Raycast.GS", "Raycast.FS");
-    LightProgram = LoadProgram("Fluid.Vertex", "Fluid.PickLayer", "Light.Cache");
-    BlurProgram = LoadProgram("Fluid.Vertex", "Fluid.PickLayer", "Light.Blur");
+    InitSlabOps();
+    RaycastProgram = SubmitProgram("Raycast.VS", "Raycast.GS", "Raycast.FS");
+    LightProgram = SubmitLayeredProgram("Fluid.Vertex", "Fluid.PickLayer", "Light.Cache");
+    BlurProgram = SubmitLayeredProgram("Fluid.Vertex", "Fluid.PickLayer", "Light.Blur");
+    InitHud();
+    InitReduce();
+    FinishPrograms();
+    WatchProgram(&RaycastProgram, OwnerRenderer, "Raycast.VS", "Raycast.GS", "Raycast.FS");
+    WatchLayeredProgram(&LightProgram, OwnerSimulation, "Fluid.Vertex", "Fluid.PickLayer", "Light.Cache");
+    WatchLayeredProgram(&BlurProgram, OwnerSimulation, "Fluid.Vertex", "Fluid.PickLayer", "Light.Blur");
 
     glGenVertexArrays(1, &Vaos.CubeCenter);
     glBindVertexArray(Vaos.CubeCenter);
@@ -73,68 +134,138 @@ void PezInitialize()
     glEnableVertexAttribArray(SlotPosition);
     glVertexAttribPointer(SlotPosition, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(float), 0);
 
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    // Textures are shared, so the frames can be sampled here and rendered into there.
+    for (int i = 0; i < 3; ++i) {
+        FieldFrame& frame = Fields.Frames[i];
+        frame.BlurredDensity = CreateVolume(GridWidth, GridHeight, GridDepth, 1);
+        frame.LightCache = CreateVolume(GridWidth, GridHeight, GridDepth, 1);
+        glDeleteFramebuffers(1, &frame.BlurredDensity.FboHandle);
+        glDeleteFramebuffers(1, &frame.LightCache.FboHandle);
+        frame.Ready = 0;
+        frame.Released = 0;
+    }
+    Fields.Writing = 0;
+    Fields.Pending = 1;
+    Fields.Showing = 2;
+    Fields.Fresh = false;
+    InitReadback(3);
+
+    glDisable(GL_DEPTH_TEST);
+    glDisable(GL_CULL_FACE);
+    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+}
+
+void PezInitializeSimulation()
+{
     glGenVertexArrays(1, &Vaos.FullscreenQuad);
     glBindVertexArray(Vaos.FullscreenQuad);
     CreateQuadVbo();
     glEnableVertexAttribArray(SlotPosition);
     glVertexAttribPointer(SlotPosition, 2, GL_SHORT, GL_FALSE, 2 * sizeof(short), 0);
-
     glBindBuffer(GL_ARRAY_BUFFER, 0);
 
-    Slabs.Velocity = CreateSlab(GridWidth, GridHeight, GridDepth, 3);
-    Slabs.Density = CreateSlab(GridWidth, GridHeight, GridDepth, 1);
-    Slabs.Pressure = CreateSlab(GridWidth, GridHeight, GridDepth, 1);
-    Slabs.Temperature = CreateSlab(GridWidth, GridHeight, GridDepth, 1);
-    Surfaces.Divergence = CreateVolume(GridWidth, GridHeight, GridDepth, 3);
-    Surfaces.LightCache = CreateVolume(GridWidth, GridHeight, GridDepth, 1);
-    Surfaces.BlurredDensity = CreateVolume(GridWidth, GridHeight, GridDepth, 1);
-    InitSlabOps();
-    Surfaces.Obstacles = CreateVolume(GridWidth, GridHeight, GridDepth, 3);
-    CreateObstacles(Surfaces.Obstacles);
-    ClearSurface(Slabs.Temperature.Ping, AmbientTemperature);
+    // The frames' framebuffers belong to the window's context, so make new ones here.
+    for (int i = 0; i < 3; ++i) {
+        FieldFrame& frame = Fields.Frames[i];
+        glGenFramebuffers(1, &frame.BlurredDensity.FboHandle);
+        glBindFramebuffer(GL_FRAMEBUFFER, frame.BlurredDensity.FboHandle);
+        glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, frame.BlurredDensity.ColorTexture, 0);
+        glGenFramebuffers(1, &frame.LightCache.FboHandle);
+        glBindFramebuffer(GL_FRAMEBUFFER, frame.LightCache.FboHandle);
+        glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, frame.LightCache.ColorTexture, 0);
+    }
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+    Fluid = CreateFluid(GridWidth, GridHeight, GridDepth * EnsembleSize);
+    Residual = CreateVolume(GridWidth, GridHeight, GridDepth * EnsembleSize, 1);
+    BoundFluid(&Fluid, true);
+    InitReadback(3);
 
     glDisable(GL_DEPTH_TEST);
     glDisable(GL_CULL_FACE);
     glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-
-    pezCheck(OpenGLError);
 }
 
-void PezRender()
+// Blurs and lights the displayed ensemble member into the frame being written, then
+// hands it to the renderer.
+static void PublishFields(SurfacePod density)
 {
-    pezCheck(OpenGLError);
-    PezConfig cfg = PezGetConfig();
-
-    // Blur and brighten the density map:
-    bool BlurAndBrighten = true;
-    if (BlurAndBrighten) {
-        glDisable(GL_BLEND);
-        glBindFramebuffer(GL_FRAMEBUFFER, Surfaces.BlurredDensity.FboHandle);
-        glViewport(0, 0, Slabs.Density.Ping.Width, Slabs.Density.Ping.Height);
-        glBindVertexArray(Vaos.FullscreenQuad);
-        glBindTexture(GL_TEXTURE_3D, Slabs.Density.Ping.ColorTexture);
-        glUseProgram(BlurProgram);
-        SetUniform("DensityScale", 5.0f);
-        SetUniform("StepSize", sqrtf(2.0) / float(ViewSamples));
-        SetUniform("InverseSize", recipPerElem(Vector3(float(GridWidth), float(GridHeight), float(GridDepth))));
-        glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, GridDepth);
+    FieldFrame& frame = Fields.Frames[Fields.Writing];
+    if (frame.Released) {
+        glWaitSync(frame.Released, 0, GL_TIMEOUT_IGNORED);
+        glDeleteSync(frame.Released);
+        frame.Released = 0;
+    }
+    if (frame.Ready) {
+        glDeleteSync(frame.Ready);
+        frame.Ready = 0;
     }
-    pezCheck(OpenGLError);
+
+    int memberCount = std::max(1, density.Depth / GridDepth);
+
+    // Blur and brighten the density map of the displayed ensemble member:
+    glDisable(GL_BLEND);
+    glBindFramebuffer(GL_FRAMEBUFFER, frame.BlurredDensity.FboHandle);
+    glViewport(0, 0, density.Width, density.Height);
+    glBindVertexArray(Vaos.FullscreenQuad);
+    glBindTexture(GL_TEXTURE_3D, density.ColorTexture);
+    glUseProgram(BlurProgram);
+    SetUniform("DensityScale", 5.0f);
+    SetUniform("StepSize", sqrtf(2.0) / float(ViewSamples));
+    SetUniform("InverseSize", recipPerElem(Vector3(float(GridWidth), float(GridHeight), float(density.Depth))));
+    float memberLayer = float((DisplayMember % memberCount) * GridDepth);
+    SetUniform("MemberLayer", memberLayer);
+    SetUniform("DepthScale", 1.0f / memberCount);
+    SetUniform("LayerRange", (memberLayer + 0.5f) / density.Depth, (memberLayer + GridDepth - 0.5f) / density.Depth);
+    glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, GridDepth);
 
     // Generate the light cache:
-    bool CacheLights = true;
-    if (CacheLights) {
-        glDisable(GL_BLEND);
-        glBindFramebuffer(GL_FRAMEBUFFER, Surfaces.LightCache.FboHandle);
-        glViewport(0, 0, Surfaces.LightCache.Width, Surfaces.LightCache.Height);
-        glBindVertexArray(Vaos.FullscreenQuad);
-        glBindTexture(GL_TEXTURE_3D, Surfaces.BlurredDensity.ColorTexture);
-        glUseProgram(LightProgram);
-        SetUniform("LightStep", sqrtf(2.0) / float(LightSamples));
-        SetUniform("LightSamples", LightSamples);
-        SetUniform("InverseSize", recipPerElem(Vector3(float(GridWidth), float(GridHeight), float(GridDepth))));
-        glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, GridDepth);
+    glBindFramebuffer(GL_FRAMEBUFFER, frame.LightCache.FboHandle);
+    glViewport(0, 0, frame.LightCache.Width, frame.LightCache.Height);
+    glBindTexture(GL_TEXTURE_3D, frame.BlurredDensity.ColorTexture);
+    glUseProgram(LightProgram);
+    SetUniform("LightStep", sqrtf(2.0) / float(LightSamples));
+    SetUniform("LightSamples", LightSamples);
+    SetUniform("InverseSize", recipPerElem(Vector3(float(GridWidth), float(GridHeight), float(GridDepth))));
+    glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, GridDepth);
+    glBindTexture(GL_TEXTURE_3D, 0);
+
+    frame.Ready = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    glFlush();
+
+    std::lock_guard<std::mutex> lock(Fields.Mutex);
+    std::swap(Fields.Writing, Fields.Pending);
+    Fields.Fresh = true;
+}
+
+// Returns the newest published frame, making the GPU wait until it has been filled.
+static FieldFrame& AcquireFields()
+{
+    int showing;
+    {
+        std::lock_guard<std::mutex> lock(Fields.Mutex);
+        if (Fields.Fresh) {
+            std::swap(Fields.Showing, Fields.Pending);
+            Fields.Fresh = false;
+        }
+        showing = Fields.Showing;
+    }
+
+    FieldFrame& frame = Fields.Frames[showing];
+    if (frame.Ready) {
+        glWaitSync(frame.Ready, 0, GL_TIMEOUT_IGNORED);
+        glDeleteSync(frame.Ready);
+        frame.Ready = 0;
     }
+    return frame;
+}
+
+void PezRender()
+{
+    PezConfig cfg = PezGetConfig();
+    FieldFrame& frame = AcquireFields();
 
     // Perform raycasting:
     glBindFramebuffer(GL_FRAMEBUFFER, 0);
@@ -144,12 +275,9 @@ void PezRender()
     glEnable(GL_BLEND);
     glBindVertexArray(Vaos.CubeCenter);
     glActiveTexture(GL_TEXTURE0);
-    if (BlurAndBrighten)
-        glBindTexture(GL_TEXTURE_3D, Surfaces.BlurredDensity.ColorTexture);
-    else
-        glBindTexture(GL_TEXTURE_3D, Slabs.Density.Ping.ColorTexture);
+    glBindTexture(GL_TEXTURE_3D, frame.BlurredDensity.ColorTexture);
     glActiveTexture(GL_TEXTURE1);
-    glBindTexture(GL_TEXTURE_3D, Surfaces.LightCache.ColorTexture);
+    glBindTexture(GL_TEXTURE_3D, frame.LightCache.ColorTexture);
     glUseProgram(RaycastProgram);
     SetUniform("ModelviewProjection", Matrices.ModelviewProjection);
     SetUniform("Modelview", Matrices.Modelview);
@@ -167,16 +295,85 @@ void PezRender()
     glActiveTexture(GL_TEXTURE1);
     glBindTexture(GL_TEXTURE_3D, 0);
     glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_3D, 0);
+
+    // The simulation thread waits on this before it writes into the frame again.  A frame
+    // that is drawn again before it is replaced only needs the latest fence.
+    if (frame.Released) {
+        glDeleteSync(frame.Released);
+    }
+    frame.Released = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    glFlush();
+
+    RecordFrame(cfg.Width, cfg.Height);
+
+    // Drawn after the recorder has read the frame, so it never shows up in recordings.
+    if (ShowHud) {
+        DrawHud(cfg.Width, cfg.Height);
+    }
+}
+
+// Rebuilds the overlay text a few times a second so the numbers stay readable.
+static void UpdateHudText(float seconds)
+{
+    static float elapsed = 0;
+    elapsed += seconds;
+    if (elapsed < HudInterval) {
+        return;
+    }
+    float stepsPerSecond = StepCount.exchange(0) / elapsed;
+    elapsed = 0;
+
+    PezTimingStats frame = pezGetTimingStats(PEZ_TIME_FRAME);
+    char text[1024];
+    int length = snprintf(text, sizeof(text),
+        "%.0f steps/s   frame p50 %.1f, p99 %.1f ms\n"
+        "Jacobi solver: %d iterations\n",
+        stepsPerSecond, frame.P50, frame.P99, NumJacobiIterations);
+
+    float passes[PassCount];
+    if (ReadPassTimings(passes)) {
+        float total = 0;
+        for (int pass = 0; pass < PassCount; ++pass) {
+            total += passes[pass];
+        }
+        length += snprintf(text + length, sizeof(text) - length, "GPU per step: %.2f ms, %s layers\n",
+            total, VertexLayerActive() ? "VS" : "GS");
+        for (int pass = 0; pass < PassCount; ++pass) {
+            length += snprintf(text + length, sizeof(text) - length, "%s%-10s %5.2f%s",
+                pass % 2 ? "   " : "  ", SolverPassNames[pass], passes[pass], pass % 2 ? "\n" : "");
+        }
+    } else {
+        length += snprintf(text + length, sizeof(text) - length, "GPU per step: waiting\n");
+    }
 
-    pezCheck(OpenGLError);
+    {
+        std::lock_guard<std::mutex> lock(SolverStats.Mutex);
+        if (SolverStats.Valid) {
+            length += snprintf(text + length, sizeof(text) - length,
+                "Residual %.2e   mass %.1f   CFL %.2f\n",
+                SolverStats.Residual, SolverStats.Mass, SolverStats.Courant);
+        }
+    }
+
+    length += snprintf(text + length, sizeof(text) - length, "Active box: %.0f%% of the grid\n",
+        ActiveShare * 100.0f);
+    length += snprintf(text + length, sizeof(text) - length, "Textures: %.1f MB",
+        AllocatedTextureBytes() / (1024.0f * 1024.0f));
+    int used, total;
+    if (ReadVideoMemory(&used, &total)) {
+        snprintf(text + length, sizeof(text) - length, ", VRAM %d of %d MB", used, total);
+    }
+    SetHudText(text);
 }
 
 void PezUpdate(float seconds)
 {
-    pezCheck(OpenGLError);
     PezConfig cfg = PezGetConfig();
 
-    float dt = seconds * 0.0001f;
+    // Edited effect files are recompiled in the background and swapped in once they link.
+    PollProgramReloads();
+
     Vector3 up(1, 0, 0); Point3 target(0);
     Matrices.View = Matrix4::lookAt(EyePosition, target, up);
     Matrix4 modelMatrix = Matrix4::identity();
@@ -190,35 +387,103 @@ void PezUpdate(float seconds)
         1.0f);  // Far Plane
     Matrices.ModelviewProjection = Matrices.Projection * Matrices.Modelview;
 
-    float fips = 1.0f / dt;
-    float alpha = 0.05f;
-    if (Fips < 0) Fips++;
-    else if (Fips == 0) Fips = fips;
-    else  Fips = fips * alpha + Fips * (1.0f - alpha);
+    if (ShowHud) {
+        AddHudFrame(seconds * 1000.0f);
+        UpdateHudText(seconds);
+    }
+
+    // Only the recorded frames are read back on this thread.
+    PollReadback();
+}
 
-    if (SimulateFluid) {
+static void HandleSimulationKey(char c);
+
+static void ReceiveSolverStats(const ReduceResult& result, void* userData)
+{
+    std::lock_guard<std::mutex> lock(SolverStats.Mutex);
+    SolverStats.Residual = result.Max[0][0];
+    SolverStats.Mass = result.Sum[0][1];
+    SolverStats.Courant = result.Max[0][2] * TimeStep;
+    SolverStats.Valid = true;
+}
+
+// Velocities are in cells per unit time, so the largest speed times the time step is
+// the CFL number.
+static void MeasureSolver()
+{
+    ComputeResidual(Fluid.Pressure.Ping, Fluid.Divergence, Fluid.Obstacles, Residual);
+    ReduceInput inputs[3] = {
+        { Residual, ReduceX },
+        { Fluid.Density.Ping, ReduceX },
+        { Fluid.Velocity.Ping, ReduceLength },
+    };
+    BeginReduce(inputs, 3, 1, ReceiveSolverStats, 0);
+}
+
+void PezSimulate(float seconds)
+{
+    char key;
+    while (true) {
+        {
+            std::lock_guard<std::mutex> lock(SimulationKeys.Mutex);
+            if (SimulationKeys.Pending.empty()) {
+                break;
+            }
+            key = SimulationKeys.Pending.front();
+            SimulationKeys.Pending.pop_front();
+        }
+        HandleSimulationKey(key);
+    }
+
+    // Rebuilt simulation programs are swapped in here, since this thread is the one using them.
+    AdoptProgramReloads();
+
+    bool idle = false;
+    if (IsPlaying()) {
+        UpdatePlayback(seconds);
+    } else if (SimulateFluid) {
         glBindVertexArray(Vaos.FullscreenQuad);
-        glViewport(0, 0, GridWidth, GridHeight);
-        Advect(Slabs.Velocity.Ping, Slabs.Velocity.Ping, Surfaces.Obstacles, Slabs.Velocity.Pong, VelocityDissipation);
-        SwapSurfaces(&Slabs.Velocity);
-        Advect(Slabs.Velocity.Ping, Slabs.Temperature.Ping, Surfaces.Obstacles, Slabs.Temperature.Pong, TemperatureDissipation);
-        SwapSurfaces(&Slabs.Temperature);
-        Advect(Slabs.Velocity.Ping, Slabs.Density.Ping, Surfaces.Obstacles, Slabs.Density.Pong, DensityDissipation);
-        SwapSurfaces(&Slabs.Density);
-        ApplyBuoyancy(Slabs.Velocity.Ping, Slabs.Temperature.Ping, Slabs.Density.Ping, Slabs.Velocity.Pong);
-        SwapSurfaces(&Slabs.Velocity);
-        ApplyImpulse(Slabs.Temperature.Ping, ImpulsePosition, ImpulseTemperature);
-        ApplyImpulse(Slabs.Density.Ping, ImpulsePosition, ImpulseDensity);
-        ComputeDivergence(Slabs.Velocity.Ping, Surfaces.Obstacles, Surfaces.Divergence);
-        ClearSurface(Slabs.Pressure.Ping, 0);
-        for (int i = 0; i < NumJacobiIterations; ++i) {
-            Jacobi(Slabs.Pressure.Ping, Surfaces.Divergence, Surfaces.Obstacles, Slabs.Pressure.Pong);
-            SwapSurfaces(&Slabs.Pressure);
+        StepFluid(&Fluid);
+        static int stepsSinceStats = 0;
+        if (ShowHud && ++stepsSinceStats >= SolverStatsInterval) {
+            MeasureSolver();
+            stepsSinceStats = 0;
         }
-        SubtractGradient(Slabs.Velocity.Ping, Slabs.Pressure.Ping, Surfaces.Obstacles, Slabs.Velocity.Pong);
-        SwapSurfaces(&Slabs.Velocity);
+        StepCount++;
+        ActiveShare = ActiveFraction(Fluid);
+        if (RecordFluid) {
+            RecordCacheFrame(Fluid);
+        }
+    } else {
+        idle = true;
+    }
+    PollReadback();
+    PollReduce();
+
+    // Baked frames replace the live simulation while a cache is playing:
+    PublishFields(IsPlaying() ? PlaybackSurface() : Fluid.Density.Ping);
+
+    // While paused there's nothing new to publish, so don't spin.
+    if (idle) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+}
+
+void PezShutdown()
+{
+    if (IsRecordingFrames()) {
+        EndFrameRecording();
     }
-    pezCheck(OpenGLError);
+    ShutdownReadback();
+}
+
+void PezShutdownSimulation()
+{
+    if (RecordFluid) {
+        EndCacheRecording();
+    }
+    FlushReduce();
+    ShutdownReadback();
 }
 
 void PezHandleMouse(int x, int y, int action)
@@ -240,7 +505,214 @@ void PezHandleMouse(int x, int y, int action)
 
 void PezHandleKey(char c)
 {
-    if (c == ' ') {
+    // Debug output is per context, so the simulation thread toggles its own as well.
+    if (c == 'g' && PEZ_GL_DEBUG) {
+        DebugOutput = !DebugOutput;
+        pezSetDebugOutput(DebugOutput);
+        pezPrintString("Debug output %s\n", DebugOutput ? "on" : "off");
+    }
+
+    // GPU pass timings are gathered only while the overlay is up.
+    if (c == 'h') {
+        ShowHud = !ShowHud;
+    }
+
+    if (c == 'v' || c == 'y') {
+        if (IsRecordingFrames()) {
+            EndFrameRecording();
+        } else if (c == 'v') {
+            BeginFrameRecording(FramePattern, FramePng);
+        } else {
+            BeginFrameRecording(FrameStream, FrameY4m);
+        }
+    } else {
+        std::lock_guard<std::mutex> lock(SimulationKeys.Mutex);
+        SimulationKeys.Pending.push_back(c);
+    }
+}
+
+// Swaps the members' splats for a grid of small sources along the floor, cycling through
+// the shapes, or back again.  The boxes are reset so they take in the new sources.
+static void ToggleEmitterField()
+{
+    const int Rows = 8;
+    bool field = EmitterCount() == 0;
+    ClearEmitters();
+    EnableMemberSplats(!field);
+    for (int i = 0; field && i < Rows * Rows; ++i) {
+        float x = (i % Rows + 0.5f) * GridWidth / Rows;
+        float z = (i / Rows + 0.5f) * GridDepth / Rows;
+        Emitter emitter = CreateEmitter(EmitterShape(i % 3), Vector3(x, GridHeight - 4.0f, z), Vector3(2.5f));
+        emitter.Rate = 0.5f;
+        emitter.Velocity = Vector3(0, -4, 0);
+        emitter.VelocityWeight = 0.5f;
+        AddEmitter(emitter);
+    }
+    BoundFluid(&Fluid, Fluid.Bounded);
+    pezPrintString("%d emitters per member\n", field ? Rows * Rows : 1);
+}
+
+// Switches between a single simulation and an ensemble whose members differ in buoyancy,
+// stepped together in one stacked volume.  Press M to show the next member.
+static void ToggleEnsemble()
+{
+    FlushReadback();
+    FlushReduce();
+    bool bounded = Fluid.Bounded;
+    DestroyFluid(Fluid);
+    DestroySurface(Residual);
+
+    EnsembleSize = EnsembleSize == 1 ? ViewerEnsembleSize : 1;
+    InitMembers();
+    for (int i = 0; i < EnsembleSize; ++i) {
+        Members[i].SmokeBuoyancy = SmokeBuoyancy * (1.0f + 0.5f * i);
+    }
+    DisplayMember = 0;
+
+    Fluid = CreateFluid(GridWidth, GridHeight, GridDepth * EnsembleSize);
+    Residual = CreateVolume(GridWidth, GridHeight, GridDepth * EnsembleSize, 1);
+    BoundFluid(&Fluid, bounded);
+    pezPrintString("%d ensemble member%s\n", EnsembleSize, EnsembleSize == 1 ? "" : "s");
+}
+
+static void HandleSimulationKey(char c)
+{
+    if (c == 'g') {
+        pezSetDebugOutput(DebugOutput);
+    } else if (c == 'h') {
+        EnablePassTimings(ShowHud);
+    } else if (c == 'b') {
+        BoundFluid(&Fluid, !Fluid.Bounded);
+        pezPrintString("Active box %s\n", Fluid.Bounded ? "on" : "off");
+    } else if (c == 'e') {
+        ToggleEmitterField();
+    } else if (c == ' ') {
         SimulateFluid = !SimulateFluid;
+    } else if ((c == 'r' || c == 'R') && !IsPlaying()) {
+        // Shift records with quantized bricks instead of exact deltas.
+        RecordFluid = !RecordFluid;
+        if (RecordFluid) {
+            BeginCacheRecording(CacheFile, Fluid, c == 'R' ? EncodingBricks : EncodingLzfxDelta);
+        } else {
+            EndCacheRecording();
+        }
+    } else if (c == 'p') {
+        if (IsPlaying()) {
+            ClosePlayback();
+        } else if (!RecordFluid) {
+            FlushReadback();
+            OpenPlayback(CacheFile);
+        }
+    } else if (c == ',' && IsPlaying()) {
+        SeekPlayback(PlaybackFrame() - 10);
+    } else if (c == '.' && IsPlaying()) {
+        SeekPlayback(PlaybackFrame() + 10);
+    } else if (c == '[' && IsPlaying()) {
+        SetPlaybackRate(GetPlaybackRate() * 0.5f);
+    } else if (c == ']' && IsPlaying()) {
+        SetPlaybackRate(GetPlaybackRate() * 2.0f);
+    } else if (c == '-' && IsPlaying()) {
+        SetPlaybackRate(-GetPlaybackRate());
+    } else if (c == 'm') {
+        DisplayMember = (DisplayMember + 1) % EnsembleSize;
+    } else if (c == 'n' && !IsPlaying() && !RecordFluid) {
+        ToggleEnsemble();
+    } else if (c == 'k' && !IsPlaying()) {
+        WriteCheckpointAsync(CheckpointFile, Fluid);
+    } else if (c == 'l' && !IsPlaying() && !RecordFluid) {
+        FILE* file = fopen(CheckpointFile, "rb");
+        if (!file) {
+            pezPrintString("No checkpoint to load; press K to write %s.\n", CheckpointFile);
+            return;
+        }
+        fclose(file);
+        FlushReadback();
+        FlushReduce();
+        ReadCheckpoint(CheckpointFile, &Fluid);
+        if (Residual.Depth != Fluid.Density.Ping.Depth) {
+            DestroySurface(Residual);
+            Residual = CreateVolume(GridWidth, GridHeight, Fluid.Density.Ping.Depth, 1);
+        }
+        DisplayMember %= EnsembleSize;
     }
 }
+
+// Steps a fresh simulation until it reaches the given step count, checkpointing every
+// interval steps.  If the checkpoint file already exists the bake resumes from it.
+static void RunBake(int steps, const char* checkpoint, int interval)
+{
+    InitSlabOps();
+    FinishPrograms();
+    GLuint vao;
+    glGenVertexArrays(1, &vao);
+    glBindVertexArray(vao);
+    GLuint vbo = CreateQuadVbo();
+    glEnableVertexAttribArray(SlotPosition);
+    glVertexAttribPointer(SlotPosition, 2, GL_SHORT, GL_FALSE, 2 * sizeof(short), 0);
+    glDisable(GL_DEPTH_TEST);
+    glDisable(GL_CULL_FACE);
+
+    FluidPod fluid = CreateFluid(GridWidth, GridHeight, GridDepth * EnsembleSize);
+    InitReadback(3);
+
+    int step = 0;
+    if (FILE* file = fopen(checkpoint, "rb")) {
+        fclose(file);
+        ReadCheckpoint(checkpoint, &fluid);
+        step = int(lround(fluid.Time / TimeStep));
+        pezPrintString("Resuming %s at step %d\n", checkpoint, step);
+    }
+
+    while (step < steps) {
+        StepFluid(&fluid);
+        PollReadback();
+        if (++step % interval == 0 || step == steps) {
+            WriteCheckpointAsync(checkpoint, fluid);
+        }
+    }
+    ShutdownReadback();
+    pezPrintString("Baked %d steps into %s\n", steps, checkpoint);
+
+    DestroyFluid(fluid);
+    glDeleteBuffers(1, &vbo);
+    glDeleteVertexArrays(1, &vao);
+}
+
+int PezRunHeadless(int argc, char** argv)
+{
+    if (argc == 3 && !strcmp(argv[0], "sweep")) {
+        InitSlabOps();
+        FinishPrograms();
+        RunSweep(argv[1], argv[2]);
+        return 0;
+    }
+    if ((argc == 1 || argc == 2) && !strcmp(argv[0], "bench-reduce")) {
+        InitSlabOps();
+        InitReduce();
+        FinishPrograms();
+        BenchmarkReduce(argc == 2 ? atoi(argv[1]) : 100);
+        return 0;
+    }
+    if ((argc == 1 || argc == 2) && !strcmp(argv[0], "bench-layers")) {
+        InitSlabOps();
+        FinishPrograms();
+        BenchmarkLayers(argc == 2 ? atoi(argv[1]) : 200);
+        return 0;
+    }
+    if (argc == 2 && !strcmp(argv[0], "bench-cache")) {
+        BenchmarkVolumeFile(argv[1]);
+        return 0;
+    }
+    if ((argc == 3 || argc == 4) && !strcmp(argv[0], "bake")) {
+        int interval = argc == 4 ? atoi(argv[3]) : CheckpointInterval;
+        RunBake(atoi(argv[1]), argv[2], interval > 0 ? interval : CheckpointInterval);
+        return 0;
+    }
+
+    pezPrintString("Usage: Fluid --headless sweep <spec file> <csv file>\n"
+                   "       Fluid --headless bench-cache <volume file>\n"
+                   "       Fluid --headless bench-reduce [iterations]\n"
+                   "       Fluid --headless bench-layers [steps]\n"
+                   "       Fluid --headless bake <steps> <checkpoint file> [checkpoint interval]\n");
+    return 1;
+}
@@ -0,0 +1,157 @@
+#include "Hud.h"
+#include <algorithm>
+#include <cstring>
+#include <string>
+
+// Texels in the overlay; it is drawn at twice this size in the top left corner.
+static const int HudWidth = 300;
+static const int HudHeight = 120;
+static const int HudScale = 2;
+static const int Margin = 4;
+static const int GraphHeight = 32;
+
+// Frame times at or above this many milliseconds fill the graph.
+static const float GraphRange = 33.3f;
+
+// From GL_NVX_gpu_memory_info; both are in kilobytes.
+#define GL_GPU_MEMORY_INFO_TOTAL_AVAILABLE_MEMORY_NVX 0x9048
+#define GL_GPU_MEMORY_INFO_CURRENT_AVAILABLE_VIDMEM_NVX 0x9049
+
+static struct {
+    GLuint Program;
+    GLuint Texture;
+    GLuint Vao;
+    std::string Text;
+    float Frames[HudWidth - 2 * Margin];
+    int NextFrame;
+    unsigned char Pixels[HudWidth * HudHeight * 4];
+    unsigned char Glyphs[(HudWidth - 2 * Margin) * (HudHeight - 3 * Margin - GraphHeight)];
+} Hud;
+
+void InitHud()
+{
+    Hud.Program = SubmitProgram("Hud.VS", 0, "Hud.FS");
+    WatchProgram(&Hud.Program, OwnerRenderer, "Hud.VS", 0, "Hud.FS");
+
+    // The quad's corners come from gl_VertexID, but core profiles still need a vertex array.
+    glGenVertexArrays(1, &Hud.Vao);
+
+    glGenTextures(1, &Hud.Texture);
+    glBindTexture(GL_TEXTURE_2D, Hud.Texture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, HudWidth, HudHeight, 0, GL_RGBA, GL_UNSIGNED_BYTE, 0);
+    glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+void SetHudText(const char* text)
+{
+    Hud.Text = text;
+}
+
+void AddHudFrame(float milliseconds)
+{
+    const int frameCount = sizeof(Hud.Frames) / sizeof(Hud.Frames[0]);
+    Hud.Frames[Hud.NextFrame] = milliseconds;
+    Hud.NextFrame = (Hud.NextFrame + 1) % frameCount;
+}
+
+static void SetTexel(int x, int y, unsigned char r, unsigned char g, unsigned char b, unsigned char a)
+{
+    unsigned char* texel = Hud.Pixels + (y * HudWidth + x) * 4;
+    texel[0] = r;
+    texel[1] = g;
+    texel[2] = b;
+    texel[3] = a;
+}
+
+// Rows run bottom-up: the graph sits along the bottom and the text fills the rest.
+static void RasterizeHud()
+{
+    for (int i = 0; i < HudWidth * HudHeight; ++i) {
+        SetTexel(i % HudWidth, i / HudWidth, 0, 0, 0, 160);
+    }
+
+    PezPixels glyphs;
+    memset(&glyphs, 0, sizeof(glyphs));
+    glyphs.FrameCount = 1;
+    glyphs.Width = HudWidth - 2 * Margin;
+    glyphs.Height = HudHeight - 3 * Margin - GraphHeight;
+    glyphs.Depth = 1;
+    glyphs.Format = GL_RED;
+    glyphs.Type = GL_UNSIGNED_BYTE;
+    glyphs.BytesPerFrame = sizeof(Hud.Glyphs);
+    glyphs.Frames = Hud.Glyphs;
+    memset(Hud.Glyphs, 0, sizeof(Hud.Glyphs));
+    pezRenderText(glyphs, Hud.Text.c_str());
+    for (int y = 0; y < glyphs.Height; ++y) {
+        for (int x = 0; x < glyphs.Width; ++x) {
+            if (Hud.Glyphs[y * glyphs.Width + x]) {
+                SetTexel(Margin + x, 2 * Margin + GraphHeight + y, 255, 255, 255, 255);
+            }
+        }
+    }
+
+    // Oldest frame on the left; green fits in 60 Hz, yellow in 30 Hz, red doesn't.
+    const int frameCount = sizeof(Hud.Frames) / sizeof(Hud.Frames[0]);
+    for (int i = 0; i < frameCount; ++i) {
+        float ms = Hud.Frames[(Hud.NextFrame + i) % frameCount];
+        int height = int(std::min(ms / GraphRange, 1.0f) * GraphHeight);
+        unsigned char red = ms > 16.7f ? 255 : 0;
+        unsigned char green = ms > GraphRange ? 0 : 255;
+        for (int y = 0; y < height; ++y) {
+            SetTexel(Margin + i, Margin + y, red, green, 0, 255);
+        }
+        SetTexel(Margin + i, Margin + int(16.7f / GraphRange * GraphHeight), 128, 128, 128, 255);
+    }
+}
+
+void DrawHud(int viewportWidth, int viewportHeight)
+{
+    RasterizeHud();
+    glBindTexture(GL_TEXTURE_2D, Hud.Texture);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, HudWidth, HudHeight, GL_RGBA, GL_UNSIGNED_BYTE, Hud.Pixels);
+
+    float right = -1 + 2.0f * HudWidth * HudScale / viewportWidth;
+    float bottom = 1 - 2.0f * HudHeight * HudScale / viewportHeight;
+
+    glEnable(GL_BLEND);
+    glBindVertexArray(Hud.Vao);
+    glUseProgram(Hud.Program);
+    SetUniform("Rect", vmath::Vector4(-1, bottom, right, 1));
+    SetUniform("Overlay", 0);
+    glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+    glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+static bool MemoryInfoSupported()
+{
+    static int supported = -1;
+    if (supported >= 0) {
+        return supported;
+    }
+
+    GLint extensionCount = 0;
+    glGetIntegerv(GL_NUM_EXTENSIONS, &extensionCount);
+    supported = 0;
+    for (GLint i = 0; i < extensionCount && !supported; ++i) {
+        const char* name = (const char*) glGetStringi(GL_EXTENSIONS, i);
+        supported = name && !strcmp(name, "GL_NVX_gpu_memory_info");
+    }
+    return supported;
+}
+
+bool ReadVideoMemory(int* usedMegabytes, int* totalMegabytes)
+{
+    if (!MemoryInfoSupported()) {
+        return false;
+    }
+    GLint total = 0, available = 0;
+    glGetIntegerv(GL_GPU_MEMORY_INFO_TOTAL_AVAILABLE_MEMORY_NVX, &total);
+    glGetIntegerv(GL_GPU_MEMORY_INFO_CURRENT_AVAILABLE_VIDMEM_NVX, &available);
+    *usedMegabytes = (total - available) / 1024;
+    *totalMegabytes = total / 1024;
+    return true;
+}
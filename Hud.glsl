@@ -0,0 +1,23 @@
+
+-- VS
+
+out vec2 vTexCoord;
+uniform vec4 Rect;
+
+void main()
+{
+    vec2 corner = vec2(gl_VertexID & 1, gl_VertexID >> 1);
+    vTexCoord = corner;
+    gl_Position = vec4(mix(Rect.xy, Rect.zw, corner), 0, 1);
+}
+
+-- FS
+
+in vec2 vTexCoord;
+out vec4 FragColor;
+uniform sampler2D Overlay;
+
+void main()
+{
+    FragColor = texture(Overlay, vTexCoord);
+}
@@ -0,0 +1,13 @@
+#pragma once
+#include "Utility.h"
+
+// The performance overlay.  Its text and frame-time graph are rasterized on the CPU
+// into one texture, so drawing it costs one upload and one quad however much it shows.
+// All of these run on the thread that owns the window's context.
+void InitHud();
+void SetHudText(const char* text);
+void AddHudFrame(float milliseconds);
+void DrawHud(int viewportWidth, int viewportHeight);
+
+// Reports the driver's whole-GPU memory use where GL_NVX_gpu_memory_info is available.
+bool ReadVideoMemory(int* usedMegabytes, int* totalMegabytes);
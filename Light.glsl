@@ -50,9 +50,16 @@ uniform sampler3D Density;
 uniform vec3 InverseSize;
 uniform float StepSize;
 uniform float DensityScale;
+uniform float MemberLayer;
+uniform float DepthScale = 1.0;
+
+// The displayed member's first and last layer centers, in texture coordinates, so that
+// taps don't reach into the neighboring members of the stacked volume.
+uniform vec2 LayerRange = vec2(0.0, 1.0);
 
 float GetDensity(vec3 pos)
 {
+    pos.z = clamp(pos.z, LayerRange.x, LayerRange.y);
     return texture(Density, pos).x * DensityScale;
 }
 
@@ -61,9 +68,9 @@ float GetDensity(vec3 pos)
 
 void main()
 {
-    vec3 pos = InverseSize * vec3(gl_FragCoord.xy, gLayer);
+    vec3 pos = InverseSize * vec3(gl_FragCoord.xy, gLayer + MemberLayer);
     float e = StepSize;
-    float z = e;
+    float z = e * DepthScale;
     float density = GetDensity(pos);
     density += GetDensity(pos + vec3(e,e,0));
     density += GetDensity(pos + vec3(-e,e,0));
@@ -0,0 +1,413 @@
+#include "Playback.h"
+#include <cmath>
+#include <condition_variable>
+#include <cstring>
+#include <mutex>
+#include <thread>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+enum SlotState {
+    SlotFree,
+    SlotLoading,
+    SlotReady,
+};
+
+struct StagingSlot {
+    GLuint Pbo;
+    GLsync Fence;
+    void* Mapped;
+    int Frame;
+    SlotState State;
+};
+
+static const int StagingSlots = 4;
+static const int ReadaheadFrames = 8;
+
+// Baked frames are shown at this rate when the playback rate is 1.
+static const double FramesPerSecond = 30.0;
+
+static struct {
+    bool Open;
+    int Fd;
+    const unsigned char* Map;
+    size_t MapSize;
+    VolumeHeader Header;
+    std::vector<VolumeField> Frames;
+    SurfacePod Volume;
+    GLenum Format;
+    size_t FrameSize;
+    double Position;
+    float Rate;
+    bool Loop;
+    int Displayed;
+    bool Deltas;
+    std::vector<unsigned char> Decoded;
+    int DecodedFrame;
+    StagingSlot Slots[StagingSlots];
+    std::mutex Mutex;
+    std::condition_variable Wake;
+    std::thread Loader;
+    bool Quit;
+} Player;
+
+static int WrapFrame(int frame)
+{
+    int count = int(Player.Frames.size());
+    if (Player.Loop) {
+        return ((frame % count) + count) % count;
+    }
+    return frame < 0 ? 0 : frame >= count ? count - 1 : frame;
+}
+
+static void Readahead(int frame)
+{
+    const VolumeField& field = Player.Frames[frame];
+    size_t page = size_t(sysconf(_SC_PAGESIZE));
+    size_t begin = size_t(field.Offset) & ~(page - 1);
+    madvise((void*) (Player.Map + begin), size_t(field.Offset + field.Size - begin), MADV_WILLNEED);
+}
+
+// Copies (or decodes) frames from the mapping into whichever staging buffers the GL thread has mapped.
+// The frame after the last one decoded is preferred, so that delta frames apply to it directly.
+static void LoaderThread()
+{
+    std::unique_lock<std::mutex> lock(Player.Mutex);
+    while (!Player.Quit) {
+        StagingSlot* slot = 0;
+        for (int i = 0; i < StagingSlots; ++i) {
+            StagingSlot& candidate = Player.Slots[i];
+            if (candidate.State == SlotLoading && (!slot || candidate.Frame == Player.DecodedFrame + 1)) {
+                slot = &candidate;
+            }
+        }
+        if (!slot) {
+            Player.Wake.wait(lock);
+            continue;
+        }
+
+        const VolumeField& field = Player.Frames[slot->Frame];
+        int direction = Player.Rate < 0 ? -1 : 1;
+        int ahead = WrapFrame(slot->Frame + direction * ReadaheadFrames);
+        lock.unlock();
+        if (Player.Deltas && field.Encoding != EncodingRaw) {
+            DecodeMappedFrame(Player.Map, Player.Header, Player.Frames, slot->Frame, &Player.Decoded, &Player.DecodedFrame);
+            memcpy(slot->Mapped, &Player.Decoded[0], Player.FrameSize);
+        } else if (field.Encoding == EncodingLzfx) {
+            DecodeChunks(Player.Map + field.Offset, 0, Player.Header.Depth, slot->Mapped);
+        } else if (field.Encoding == EncodingBricks) {
+            DecodeBricks(Player.Map + field.Offset, 0, Player.Header.Depth, slot->Mapped);
+        } else {
+            memcpy(slot->Mapped, Player.Map + field.Offset, size_t(field.Size));
+        }
+        Readahead(ahead);
+        lock.lock();
+        slot->State = SlotReady;
+    }
+}
+
+// Lets go of a file that OpenPlayback has turned down, after it has said why.
+static bool RefusePlayback()
+{
+    if (Player.Map) {
+        munmap((void*) Player.Map, Player.MapSize);
+        Player.Map = 0;
+    }
+    close(Player.Fd);
+    Player.Frames.clear();
+    return false;
+}
+
+bool OpenPlayback(const char* filename, const char* fieldName)
+{
+    ClosePlayback();
+
+    Player.Map = 0;
+    Player.Fd = open(filename, O_RDONLY);
+    if (Player.Fd < 0) {
+        pezPrintString("Unable to open %s\n", filename);
+        return false;
+    }
+    struct stat info;
+    fstat(Player.Fd, &info);
+    Player.MapSize = size_t(info.st_size);
+    if (Player.MapSize < sizeof(VolumeHeader)) {
+        pezPrintString("%s is not a volume file\n", filename);
+        return RefusePlayback();
+    }
+    const void* map = mmap(0, Player.MapSize, PROT_READ, MAP_SHARED, Player.Fd, 0);
+    if (map == MAP_FAILED) {
+        pezPrintString("Unable to map %s\n", filename);
+        return RefusePlayback();
+    }
+    Player.Map = (const unsigned char*) map;
+    madvise((void*) Player.Map, Player.MapSize, MADV_SEQUENTIAL);
+
+    memcpy(&Player.Header, Player.Map, sizeof(VolumeHeader));
+    const VolumeHeader& header = Player.Header;
+    if (memcmp(header.Magic, "FVOL", 4) || header.Version > VolumeVersion) {
+        pezPrintString("%s is not a supported volume file\n", filename);
+        return RefusePlayback();
+    }
+
+    // A recording that was cut off before it closed has no table yet.
+    if (header.TableOffset > Player.MapSize ||
+        header.FieldCount > (Player.MapSize - header.TableOffset) / sizeof(VolumeField)) {
+        pezPrintString("Truncated field table in %s\n", filename);
+        return RefusePlayback();
+    }
+
+    // Frames are shown as stacked ensemble members of the simulation's grid.
+    int members = int(header.Depth / GridDepth);
+    if (header.Width != uint32_t(GridWidth) || header.Height != uint32_t(GridHeight) ||
+        header.Depth % GridDepth || members < 1 || members > MaxEnsembleSize) {
+        pezPrintString("%s is %dx%dx%d, which isn't a stack of %dx%dx%d members\n", filename,
+                       int(header.Width), int(header.Height), int(header.Depth), GridWidth, GridHeight, GridDepth);
+        return RefusePlayback();
+    }
+
+    // Index the requested field by frame:
+    const VolumeField* table = (const VolumeField*) (Player.Map + header.TableOffset);
+    Player.Frames.clear();
+    Player.Deltas = false;
+    for (uint32_t i = 0; i < header.FieldCount; ++i) {
+        if (strncmp(table[i].Name, fieldName, sizeof(table[i].Name))) {
+            continue;
+        }
+        if (table[i].Encoding > EncodingBricks || table[i].Type != GL_HALF_FLOAT) {
+            pezPrintString("Unsupported encoding for the %s field in %s\n", fieldName, filename);
+            return RefusePlayback();
+        }
+        if (table[i].Offset > Player.MapSize || table[i].Size > Player.MapSize - table[i].Offset) {
+            pezPrintString("Truncated %s field in %s\n", fieldName, filename);
+            return RefusePlayback();
+        }
+        if (table[i].Frame >= Player.Frames.size()) {
+            Player.Frames.resize(table[i].Frame + 1);
+        }
+        Player.Frames[table[i].Frame] = table[i];
+        Player.Deltas = Player.Deltas || table[i].Encoding == EncodingLzfxDelta;
+    }
+    if (Player.Frames.empty()) {
+        pezPrintString("%s has no %s field\n", filename, fieldName);
+        return RefusePlayback();
+    }
+
+    int channels = Player.Frames[0].Channels;
+    Player.Format = channels == 1 ? GL_RED : GL_RGB;
+    Player.FrameSize = size_t(header.Width) * header.Height * header.Depth * channels * 2;
+    for (size_t i = 0; i < Player.Frames.size(); ++i) {
+        const VolumeField& frame = Player.Frames[i];
+        bool valid = frame.Encoding == EncodingRaw ? frame.Size == Player.FrameSize : frame.Size > sizeof(ChunkHeader);
+        if (!valid || DecodedFieldSize(header, frame) != Player.FrameSize) {
+            pezPrintString("Frame %d of %s is missing or malformed\n", int(i), filename);
+            return RefusePlayback();
+        }
+    }
+    Player.Volume = CreateVolume(header.Width, header.Height, header.Depth, channels);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+    for (int i = 0; i < StagingSlots; ++i) {
+        StagingSlot& slot = Player.Slots[i];
+        glGenBuffers(1, &slot.Pbo);
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, slot.Pbo);
+        glBufferData(GL_PIXEL_UNPACK_BUFFER, Player.FrameSize, 0, GL_STREAM_DRAW);
+        slot.Fence = 0;
+        slot.Mapped = 0;
+        slot.Frame = -1;
+        slot.State = SlotFree;
+    }
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+    Player.Position = 0;
+    Player.Rate = 1;
+    Player.Loop = true;
+    Player.Displayed = -1;
+    Player.DecodedFrame = -1;
+    Player.Quit = false;
+    Player.Open = true;
+    Player.Loader = std::thread(LoaderThread);
+    return true;
+}
+
+void ClosePlayback()
+{
+    if (!Player.Open) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(Player.Mutex);
+        Player.Quit = true;
+        Player.Wake.notify_one();
+    }
+    Player.Loader.join();
+
+    for (int i = 0; i < StagingSlots; ++i) {
+        StagingSlot& slot = Player.Slots[i];
+        if (slot.Mapped) {
+            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, slot.Pbo);
+            glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+        }
+        if (slot.Fence) {
+            glDeleteSync(slot.Fence);
+        }
+        glDeleteBuffers(1, &slot.Pbo);
+    }
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+    DestroySurface(Player.Volume);
+    munmap((void*) Player.Map, Player.MapSize);
+    close(Player.Fd);
+    Player.Frames.clear();
+    Player.Decoded.clear();
+    Player.Open = false;
+}
+
+bool IsPlaying()
+{
+    return Player.Open;
+}
+
+SurfacePod PlaybackSurface()
+{
+    return Player.Volume;
+}
+
+static StagingSlot* FindSlot(int frame)
+{
+    for (int i = 0; i < StagingSlots; ++i) {
+        if (Player.Slots[i].State != SlotFree && Player.Slots[i].Frame == frame) {
+            return &Player.Slots[i];
+        }
+    }
+    return 0;
+}
+
+static void UnmapSlot(StagingSlot* slot)
+{
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, slot->Pbo);
+    glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+    slot->Mapped = 0;
+}
+
+void UpdatePlayback(double seconds)
+{
+    if (!Player.Open) {
+        return;
+    }
+
+    std::unique_lock<std::mutex> lock(Player.Mutex);
+    int count = int(Player.Frames.size());
+    Player.Position += seconds * FramesPerSecond * Player.Rate;
+    if (Player.Loop) {
+        Player.Position -= count * floor(Player.Position / count);
+    } else {
+        Player.Position = Player.Position < 0 ? 0 : Player.Position > count - 1 ? count - 1 : Player.Position;
+    }
+    int target = WrapFrame(int(Player.Position));
+    int direction = Player.Rate < 0 ? -1 : 1;
+
+    // Upload the current frame if the loader has staged it:
+    StagingSlot* ready = FindSlot(target);
+    if (ready && ready->State == SlotReady && target != Player.Displayed) {
+        UnmapSlot(ready);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+        glBindTexture(GL_TEXTURE_3D, Player.Volume.ColorTexture);
+        glTexSubImage3D(GL_TEXTURE_3D, 0, 0, 0, 0, Player.Volume.Width, Player.Volume.Height, Player.Volume.Depth,
+                        Player.Format, GL_HALF_FLOAT, 0);
+        glBindTexture(GL_TEXTURE_3D, 0);
+        ready->Fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        ready->State = SlotFree;
+        ready->Frame = -1;
+        Player.Displayed = target;
+    }
+
+    // Staged frames that fell out of the playback window (after a scrub, say) are recycled:
+    for (int i = 0; i < StagingSlots; ++i) {
+        StagingSlot& slot = Player.Slots[i];
+        if (slot.State != SlotReady) {
+            continue;
+        }
+        bool wanted = false;
+        for (int k = 0; k < StagingSlots; ++k) {
+            wanted = wanted || slot.Frame == WrapFrame(target + direction * k);
+        }
+        if (!wanted) {
+            UnmapSlot(&slot);
+            slot.State = SlotFree;
+            slot.Frame = -1;
+        }
+    }
+
+    // Hand free buffers whose previous upload has finished to the loader:
+    for (int k = 0; k < StagingSlots; ++k) {
+        int frame = WrapFrame(target + direction * k);
+        if (frame == Player.Displayed || FindSlot(frame)) {
+            continue;
+        }
+        StagingSlot* slot = 0;
+        for (int i = 0; i < StagingSlots && !slot; ++i) {
+            StagingSlot& candidate = Player.Slots[i];
+            if (candidate.State != SlotFree) {
+                continue;
+            }
+            if (candidate.Fence) {
+                if (glClientWaitSync(candidate.Fence, 0, 0) == GL_TIMEOUT_EXPIRED) {
+                    continue;
+                }
+                glDeleteSync(candidate.Fence);
+                candidate.Fence = 0;
+            }
+            slot = &candidate;
+        }
+        if (!slot) {
+            break;
+        }
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, slot->Pbo);
+        slot->Mapped = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, Player.FrameSize,
+                                        GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+        pezCheck(slot->Mapped != 0, "Unable to map a staging buffer.");
+        slot->Frame = frame;
+        slot->State = SlotLoading;
+        Player.Wake.notify_one();
+    }
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+}
+
+void SeekPlayback(double frame)
+{
+    std::lock_guard<std::mutex> lock(Player.Mutex);
+    int count = int(Player.Frames.size());
+    Player.Position = Player.Loop ? frame - count * floor(frame / count) :
+        frame < 0 ? 0 : frame > count - 1 ? count - 1 : frame;
+}
+
+void SetPlaybackRate(float rate)
+{
+    std::lock_guard<std::mutex> lock(Player.Mutex);
+    Player.Rate = rate;
+}
+
+float GetPlaybackRate()
+{
+    std::lock_guard<std::mutex> lock(Player.Mutex);
+    return Player.Rate;
+}
+
+void SetPlaybackLoop(bool loop)
+{
+    std::lock_guard<std::mutex> lock(Player.Mutex);
+    Player.Loop = loop;
+}
+
+int PlaybackFrame()
+{
+    return Player.Displayed;
+}
+
+int PlaybackFrameCount()
+{
+    return int(Player.Frames.size());
+}
@@ -0,0 +1,21 @@
+#pragma once
+#include "VolumeFile.h"
+
+// Plays back one field of a multi-frame volume file for look-dev.  The file is
+// memory-mapped, a loader thread copies or decodes upcoming frames into a ring of pixel
+// unpack buffers, and UpdatePlayback only ever uploads frames that are already
+// staged, so a slow disk drops frames instead of stalling the render loop.
+
+// Returns false, after saying why, when the file can't be opened, is malformed or cut
+// short, or its frames aren't ensemble members of the simulation's grid.
+bool OpenPlayback(const char* filename, const char* field = "density");
+void ClosePlayback();
+bool IsPlaying();
+SurfacePod PlaybackSurface();
+void UpdatePlayback(double seconds);
+void SeekPlayback(double frame);
+void SetPlaybackRate(float rate);
+float GetPlaybackRate();
+void SetPlaybackLoop(bool loop);
+int PlaybackFrame();
+int PlaybackFrameCount();
@@ -0,0 +1,398 @@
+#include "Readback.h"
+#include <atomic>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+
+struct ReadbackSlot {
+    GLuint Pbo;
+    GLsync Fence;
+    size_t Capacity;
+    size_t Size;
+    SurfacePod Surface;
+    ReadbackHandler Handler;
+    void* UserData;
+};
+
+struct ReadbackFrame {
+    std::vector<unsigned char> Pixels;
+    SurfacePod Surface;
+    ReadbackHandler Handler;
+    void* UserData;
+};
+
+struct ReadbackRing {
+    std::vector<ReadbackSlot> Slots;
+    int Head;
+    int InFlight;
+    std::deque<ReadbackFrame*> Queue;
+    std::mutex Mutex;
+    std::condition_variable Wake;
+    std::condition_variable Drained;
+    std::thread Writer;
+    bool Writing;
+    bool Quit;
+};
+
+// Fences and buffer bindings go through the calling thread's context, so each thread
+// that reads back gets its own ring and writer thread.
+static thread_local ReadbackRing* Ring = 0;
+
+// Caps the number of frames that wait for the disk, so memory stays bounded.
+static const size_t MaxQueuedFrames = 8;
+
+static int BytesPerPixel(GLenum format, GLenum type)
+{
+    int components = 4;
+    switch (format) {
+        case GL_RED: components = 1; break;
+        case GL_RG: components = 2; break;
+        case GL_RGB: case GL_BGR: components = 3; break;
+    }
+    return components * (type == GL_HALF_FLOAT ? 2 : type == GL_FLOAT ? 4 : 1);
+}
+
+static void WriterThread(ReadbackRing* ring)
+{
+    std::unique_lock<std::mutex> lock(ring->Mutex);
+    while (true) {
+        ring->Wake.wait(lock, [ring] { return ring->Quit || !ring->Queue.empty(); });
+        if (ring->Queue.empty()) {
+            return;
+        }
+        ReadbackFrame* frame = ring->Queue.front();
+        ring->Queue.pop_front();
+        ring->Writing = true;
+
+        lock.unlock();
+        frame->Handler(&frame->Pixels[0], frame->Pixels.size(), frame->Surface, frame->UserData);
+        delete frame;
+        lock.lock();
+
+        ring->Writing = false;
+        ring->Drained.notify_all();
+    }
+}
+
+// Maps the oldest slot, copies its pixels out, and queues them for the writer thread.
+static void RetireSlot(GLuint64 timeout)
+{
+    int tail = (Ring->Head - Ring->InFlight + int(Ring->Slots.size())) % int(Ring->Slots.size());
+    ReadbackSlot& slot = Ring->Slots[tail];
+
+    // A blocking wait has to flush the fence, or it may never reach the GPU.
+    GLbitfield flags = timeout ? GL_SYNC_FLUSH_COMMANDS_BIT : 0;
+    GLenum status = glClientWaitSync(slot.Fence, flags, timeout);
+    if (status == GL_TIMEOUT_EXPIRED) {
+        return;
+    }
+    pezCheck(status != GL_WAIT_FAILED, "Readback fence wait failed.");
+    glDeleteSync(slot.Fence);
+    slot.Fence = 0;
+
+    ReadbackFrame* frame = new ReadbackFrame;
+    frame->Pixels.resize(slot.Size);
+    frame->Surface = slot.Surface;
+    frame->Handler = slot.Handler;
+    frame->UserData = slot.UserData;
+
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.Pbo);
+    void* mapped = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, slot.Size, GL_MAP_READ_BIT);
+    pezCheck(mapped != 0, "Unable to map readback buffer.");
+    memcpy(&frame->Pixels[0], mapped, slot.Size);
+    glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    --Ring->InFlight;
+
+    std::unique_lock<std::mutex> lock(Ring->Mutex);
+    Ring->Drained.wait(lock, [] { return Ring->Queue.size() < MaxQueuedFrames; });
+    Ring->Queue.push_back(frame);
+    Ring->Wake.notify_one();
+}
+
+void InitReadback(int ringSize)
+{
+    pezCheck(Ring == 0, "InitReadback has already been called on this thread.");
+    Ring = new ReadbackRing;
+    Ring->Slots.resize(ringSize);
+    for (int i = 0; i < ringSize; ++i) {
+        ReadbackSlot& slot = Ring->Slots[i];
+        memset(&slot, 0, sizeof(slot));
+        glGenBuffers(1, &slot.Pbo);
+    }
+    Ring->Head = 0;
+    Ring->InFlight = 0;
+    Ring->Writing = false;
+    Ring->Quit = false;
+    Ring->Writer = std::thread(WriterThread, Ring);
+}
+
+void ShutdownReadback()
+{
+    if (!Ring) {
+        return;
+    }
+    while (Ring->InFlight) {
+        RetireSlot(GL_TIMEOUT_IGNORED);
+    }
+    {
+        std::lock_guard<std::mutex> lock(Ring->Mutex);
+        Ring->Quit = true;
+        Ring->Wake.notify_one();
+    }
+    Ring->Writer.join();
+    for (size_t i = 0; i < Ring->Slots.size(); ++i) {
+        glDeleteBuffers(1, &Ring->Slots[i].Pbo);
+    }
+    delete Ring;
+    Ring = 0;
+}
+
+static bool QueueFull()
+{
+    std::lock_guard<std::mutex> lock(Ring->Mutex);
+    return Ring->Queue.size() >= MaxQueuedFrames;
+}
+
+// Binds the buffer at the head of the ring, sized for the given readback, to GL_PIXEL_PACK_BUFFER.
+static ReadbackSlot& AcquireSlot(SurfacePod surface, GLenum format, GLenum type, ReadbackHandler handler, void* userData)
+{
+    ReadbackSlot& slot = Ring->Slots[Ring->Head];
+    slot.Size = size_t(surface.Width) * surface.Height * surface.Depth * BytesPerPixel(format, type);
+    slot.Surface = surface;
+    slot.Handler = handler;
+    slot.UserData = userData;
+
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.Pbo);
+    if (slot.Capacity < slot.Size) {
+        glBufferData(GL_PIXEL_PACK_BUFFER, slot.Size, 0, GL_STREAM_READ);
+        slot.Capacity = slot.Size;
+    }
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    return slot;
+}
+
+static void SubmitSlot(ReadbackSlot& slot)
+{
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    slot.Fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    Ring->Head = (Ring->Head + 1) % int(Ring->Slots.size());
+    ++Ring->InFlight;
+}
+
+void BeginReadback(SurfacePod surface, GLenum format, GLenum type, ReadbackHandler handler, void* userData)
+{
+    pezCheck(Ring != 0, "InitReadback has not been called.");
+
+    // When every buffer is in flight, the oldest one has to land first.
+    if (Ring->InFlight == int(Ring->Slots.size())) {
+        RetireSlot(GL_TIMEOUT_IGNORED);
+    }
+
+    ReadbackSlot& slot = AcquireSlot(surface, format, type, handler, userData);
+    GLenum target = surface.Depth > 1 ? GL_TEXTURE_3D : GL_TEXTURE_2D;
+    glBindTexture(target, surface.ColorTexture);
+    glGetTexImage(target, 0, format, type, 0);
+    glBindTexture(target, 0);
+    SubmitSlot(slot);
+}
+
+bool TryBeginFramebufferReadback(int width, int height, GLenum format, GLenum type, ReadbackHandler handler, void* userData)
+{
+    pezCheck(Ring != 0, "InitReadback has not been called.");
+    if (Ring->InFlight == int(Ring->Slots.size()) && !QueueFull()) {
+        RetireSlot(0);
+    }
+    if (Ring->InFlight == int(Ring->Slots.size())) {
+        return false;
+    }
+
+    SurfacePod surface;
+    memset(&surface, 0, sizeof(surface));
+    surface.Width = width;
+    surface.Height = height;
+    surface.Depth = 1;
+    ReadbackSlot& slot = AcquireSlot(surface, format, type, handler, userData);
+    glReadPixels(0, 0, width, height, format, type, 0);
+    SubmitSlot(slot);
+    return true;
+}
+
+void FlushReadback()
+{
+    if (!Ring) {
+        return;
+    }
+    while (Ring->InFlight) {
+        RetireSlot(GL_TIMEOUT_IGNORED);
+    }
+    std::unique_lock<std::mutex> lock(Ring->Mutex);
+    Ring->Drained.wait(lock, [] { return Ring->Queue.empty() && !Ring->Writing; });
+}
+
+void PollReadback()
+{
+    if (!Ring) {
+        return;
+    }
+    while (Ring->InFlight && !QueueFull()) {
+        int before = Ring->InFlight;
+        RetireSlot(0);
+        if (Ring->InFlight == before) {
+            break;
+        }
+    }
+}
+
+// Collects the fields of one volume file; whoever drops the last reference closes it.
+struct PendingVolume {
+    std::string Filename;
+    std::string RenameTo;
+    VolumeParams Params;
+    int MemberCount;
+    VolumeParams Members[MaxEnsembleSize];
+    std::vector<unsigned char> State;
+    VolumeEncoding Encoding;
+    int KeyframeInterval;
+    bool Report;
+    std::atomic<int> References;
+    VolumeWriter* Writer;
+};
+
+struct PendingField {
+    PendingVolume* Volume;
+    const char* Name;
+    int Frame;
+    double Time;
+};
+
+static PendingVolume* Recording = 0;
+static int RecordingFrame = 0;
+
+static PendingVolume* CreatePendingVolume(const char* filename, VolumeParams params, VolumeEncoding encoding = EncodingRaw)
+{
+    PendingVolume* volume = new PendingVolume;
+    volume->Filename = filename;
+    volume->Params = params;
+    volume->MemberCount = EnsembleSize;
+    for (int member = 0; member < EnsembleSize; ++member) {
+        volume->Members[member] = CurrentVolumeParams(params.Time, member);
+    }
+    volume->Encoding = encoding;
+    volume->KeyframeInterval = DefaultKeyframeInterval;
+    volume->Report = false;
+    volume->References = 1;
+    volume->Writer = 0;
+    return volume;
+}
+
+static void ReleasePendingVolume(PendingVolume* volume)
+{
+    if (--volume->References == 0) {
+        if (volume->Writer) {
+            VolumeWriterStats stats = CloseVolumeWriter(volume->Writer);
+            if (!volume->RenameTo.empty()) {
+                int result = rename(volume->Filename.c_str(), volume->RenameTo.c_str());
+                pezCheck(result == 0, "Unable to rename %s.", volume->Filename.c_str());
+            }
+            if (volume->Report) {
+                pezPrintString("Wrote %s: %d fields, %.1f MB in %.1f MB, %.3f GB/s sustained, %.3f GB/s per encoder thread\n",
+                               volume->Filename.c_str(), stats.FieldCount, stats.RawBytes * 1e-6, stats.EncodedBytes * 1e-6,
+                               stats.RawBytes / stats.Seconds * 1e-9, stats.EncodeSeconds ? stats.RawBytes / stats.EncodeSeconds * 1e-9 : 0.0);
+            }
+        }
+        delete volume;
+    }
+}
+
+static void WriteField(const unsigned char* pixels, size_t size, SurfacePod surface, void* userData)
+{
+    PendingField* field = (PendingField*) userData;
+    PendingVolume* volume = field->Volume;
+    if (!volume->Writer) {
+        volume->Writer = OpenVolumeWriter(volume->Filename.c_str(), surface.Width, surface.Height, surface.Depth,
+                                          volume->Params, volume->Encoding, volume->KeyframeInterval);
+
+        // The writer opens on this thread, after the members may have changed, so take the ones from the request:
+        VolumeHeader& header = volume->Writer->Header;
+        header.MemberCount = volume->MemberCount;
+        memcpy(header.Members, volume->Members, sizeof(header.Members));
+        if (!volume->State.empty()) {
+            SetVolumeState(volume->Writer, &volume->State[0], volume->State.size());
+        }
+    }
+    int channels = VolumeFieldChannels(field->Name);
+    WriteVolumeField(volume->Writer, field->Name, field->Frame, field->Time, GL_HALF_FLOAT, channels, pixels, size);
+    ReleasePendingVolume(volume);
+    delete field;
+}
+
+static void BeginFieldReadback(PendingVolume* volume, const char* name, int frame, double time, SurfacePod surface)
+{
+    PendingField* field = new PendingField;
+    field->Volume = volume;
+    field->Name = name;
+    field->Frame = frame;
+    field->Time = time;
+    ++volume->References;
+    GLenum format = VolumeFieldChannels(name) == 1 ? GL_RED : GL_RGB;
+    BeginReadback(surface, format, GL_HALF_FLOAT, WriteField, field);
+}
+
+static void BeginFluidReadback(PendingVolume* volume, int frame, const FluidPod& fluid)
+{
+    BeginFieldReadback(volume, "density", frame, fluid.Time, fluid.Density.Ping);
+    BeginFieldReadback(volume, "temperature", frame, fluid.Time, fluid.Temperature.Ping);
+    BeginFieldReadback(volume, "velocity", frame, fluid.Time, fluid.Velocity.Ping);
+    BeginFieldReadback(volume, "pressure", frame, fluid.Time, fluid.Pressure.Ping);
+}
+
+void WriteToFileAsync(const char* filename, SurfacePod density)
+{
+    PendingVolume* volume = CreatePendingVolume(filename, CurrentVolumeParams(0));
+    BeginFieldReadback(volume, "density", 0, 0, density);
+    ReleasePendingVolume(volume);
+}
+
+void WriteFluidToFileAsync(const char* filename, const FluidPod& fluid)
+{
+    PendingVolume* volume = CreatePendingVolume(filename, CurrentVolumeParams(fluid.Time));
+    BeginFluidReadback(volume, 0, fluid);
+    ReleasePendingVolume(volume);
+}
+
+void WriteCheckpointAsync(const char* filename, const FluidPod& fluid)
+{
+    std::string temporary = std::string(filename) + ".tmp";
+    PendingVolume* volume = CreatePendingVolume(temporary.c_str(), CurrentVolumeParams(fluid.Time), EncodingLzfx);
+    volume->RenameTo = filename;
+    SaveCheckpointState(fluid, &volume->State);
+    BeginFluidReadback(volume, 0, fluid);
+    BeginFieldReadback(volume, "obstacles", 0, fluid.Time, fluid.Obstacles);
+    ReleasePendingVolume(volume);
+}
+
+void BeginCacheRecording(const char* filename, const FluidPod& fluid, VolumeEncoding encoding, int keyframeInterval)
+{
+    pezCheck(Recording == 0, "A cache is already being recorded.");
+    Recording = CreatePendingVolume(filename, CurrentVolumeParams(fluid.Time), encoding);
+    Recording->KeyframeInterval = keyframeInterval;
+    Recording->Report = true;
+    RecordingFrame = 0;
+}
+
+void RecordCacheFrame(const FluidPod& fluid)
+{
+    BeginFluidReadback(Recording, RecordingFrame++, fluid);
+}
+
+void EndCacheRecording()
+{
+    ReleasePendingVolume(Recording);
+    Recording = 0;
+}
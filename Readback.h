@@ -0,0 +1,35 @@
+#pragma once
+#include "VolumeFile.h"
+
+// Called on the writer thread once the pixels of a readback have landed in system memory.
+typedef void (*ReadbackHandler)(const unsigned char* pixels, size_t size, SurfacePod surface, void* userData);
+
+// Readbacks are issued into a ring of pixel buffer objects, each guarded by a fence.
+// PollReadback maps the buffers whose fences have signaled and hands their contents
+// to a background thread, so neither the GPU drain nor the disk is waited on.
+// Every thread with its own GL context calls InitReadback and uses a separate ring,
+// and calls ShutdownReadback while that context is still current.
+void InitReadback(int ringSize);
+void ShutdownReadback();
+void BeginReadback(SurfacePod surface, GLenum format, GLenum type, ReadbackHandler handler, void* userData);
+void PollReadback();
+
+// Reads the bound framebuffer, unless every buffer is still in flight, in which case
+// it returns false rather than waiting.  The handler gets a surface without textures.
+bool TryBeginFramebufferReadback(int width, int height, GLenum format, GLenum type, ReadbackHandler handler, void* userData);
+void FlushReadback();
+void WriteToFileAsync(const char* filename, SurfacePod density);
+void WriteFluidToFileAsync(const char* filename, const FluidPod& fluid);
+
+// Snapshots the fluid, obstacles included, every member's parameters, the active
+// boxes and the emitters for ReadCheckpoint. The file is written under a temporary
+// name and renamed once complete, so an interrupted write never replaces the previous
+// checkpoint.
+void WriteCheckpointAsync(const char* filename, const FluidPod& fluid);
+
+// Streams every recorded step into one multi-frame volume file.  Delta encodings store
+// a keyframe every keyframeInterval frames and XOR deltas in between.
+void BeginCacheRecording(const char* filename, const FluidPod& fluid, VolumeEncoding encoding = EncodingLzfxDelta,
+                         int keyframeInterval = DefaultKeyframeInterval);
+void RecordCacheFrame(const FluidPod& fluid);
+void EndCacheRecording();
@@ -0,0 +1,258 @@
+#include "Recorder.h"
+#include "Readback.h"
+#include <png.h>
+#include <algorithm>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+
+struct PendingImage {
+    int Index;
+    int Width;
+    int Height;
+    std::vector<unsigned char> Pixels;
+    std::vector<unsigned char> Encoded;
+    bool Done;
+};
+
+// Caps the frames between readback and disk; the readback thread waits beyond this.
+static const size_t MaxPendingImages = 16;
+
+// Y4M streams are tagged with the rate that baked caches play back at.
+static const int FramesPerSecond = 30;
+
+static struct {
+    bool Active;
+    FrameFormat Format;
+    std::string Path;
+    FILE* Stream;
+    int Captured;
+    int Dropped;
+    std::deque<PendingImage*> Work;
+    std::deque<PendingImage*> Order;
+    std::vector<std::thread> Workers;
+    std::thread Writer;
+    std::mutex Mutex;
+    std::condition_variable Wake;
+    std::condition_variable Progress;
+    bool Closing;
+} Recorder;
+
+static void AppendPng(png_structp png, png_bytep data, png_size_t size)
+{
+    std::vector<unsigned char>* out = (std::vector<unsigned char>*) png_get_io_ptr(png);
+    out->insert(out->end(), data, data + size);
+}
+
+// GL hands back rows bottom-up, so the row pointers are flipped.
+static void EncodePng(PendingImage* image)
+{
+    std::vector<png_bytep> rows(image->Height);
+    for (int y = 0; y < image->Height; ++y) {
+        rows[y] = &image->Pixels[size_t(image->Height - 1 - y) * image->Width * 3];
+    }
+
+    png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING, 0, 0, 0);
+    png_infop info = png ? png_create_info_struct(png) : 0;
+    pezCheck(png && info, "Unable to create a PNG encoder.");
+    if (setjmp(png_jmpbuf(png))) {
+        pezFatal("Unable to encode frame %d.", image->Index);
+    }
+    png_set_write_fn(png, &image->Encoded, AppendPng, 0);
+    png_set_IHDR(png, info, image->Width, image->Height, 8, PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE,
+                 PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+
+    // Favor speed; these are previews, and the disk is rarely the bottleneck for them.
+    png_set_compression_level(png, 1);
+    png_write_info(png, info);
+    png_write_image(png, &rows[0]);
+    png_write_end(png, 0);
+    png_destroy_write_struct(&png, &info);
+}
+
+// Converts to 4:2:0 with BT.601 studio-swing coefficients, averaging chroma over 2x2 blocks.
+static void EncodeY4m(PendingImage* image)
+{
+    int width = image->Width & ~1;
+    int height = image->Height & ~1;
+    image->Encoded.resize(size_t(width) * height * 3 / 2);
+    unsigned char* luma = &image->Encoded[0];
+    unsigned char* cb = luma + width * height;
+    unsigned char* cr = cb + width * height / 4;
+
+    for (int y = 0; y < height; ++y) {
+        const unsigned char* rgb = &image->Pixels[size_t(image->Height - 1 - y) * image->Width * 3];
+        for (int x = 0; x < width; ++x, rgb += 3) {
+            *luma++ = (unsigned char) (((66 * rgb[0] + 129 * rgb[1] + 25 * rgb[2] + 128) >> 8) + 16);
+        }
+    }
+    for (int y = 0; y < height; y += 2) {
+        const unsigned char* top = &image->Pixels[size_t(image->Height - 1 - y) * image->Width * 3];
+        const unsigned char* bottom = top - image->Width * 3;
+        for (int x = 0; x < width; x += 2, top += 6, bottom += 6) {
+            int r = (top[0] + top[3] + bottom[0] + bottom[3] + 2) >> 2;
+            int g = (top[1] + top[4] + bottom[1] + bottom[4] + 2) >> 2;
+            int b = (top[2] + top[5] + bottom[2] + bottom[5] + 2) >> 2;
+            *cb++ = (unsigned char) (((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128);
+            *cr++ = (unsigned char) (((112 * r - 94 * g - 18 * b + 128) >> 8) + 128);
+        }
+    }
+}
+
+static void WriteImage(PendingImage* image)
+{
+    if (Recorder.Format == FramePng) {
+        char filename[1024];
+        snprintf(filename, sizeof(filename), Recorder.Path.c_str(), image->Index);
+        FILE* file = fopen(filename, "wb");
+        pezCheck(file != 0, "Unable to open %s for writing.", filename);
+        fwrite(&image->Encoded[0], 1, image->Encoded.size(), file);
+        pezCheck(!ferror(file), "Unable to write %s.", filename);
+        fclose(file);
+        return;
+    }
+
+    if (image->Index == 0) {
+        fprintf(Recorder.Stream, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C420jpeg\n",
+                image->Width & ~1, image->Height & ~1, FramesPerSecond);
+    }
+    fputs("FRAME\n", Recorder.Stream);
+    fwrite(&image->Encoded[0], 1, image->Encoded.size(), Recorder.Stream);
+    pezCheck(!ferror(Recorder.Stream), "Unable to write frame %d to %s.", image->Index, Recorder.Path.c_str());
+}
+
+static void EncodeWorker()
+{
+    std::unique_lock<std::mutex> lock(Recorder.Mutex);
+    while (true) {
+        Recorder.Wake.wait(lock, [] { return Recorder.Closing || !Recorder.Work.empty(); });
+        if (Recorder.Work.empty()) {
+            return;
+        }
+        PendingImage* image = Recorder.Work.front();
+        Recorder.Work.pop_front();
+        lock.unlock();
+
+        if (Recorder.Format == FramePng) {
+            EncodePng(image);
+        } else {
+            EncodeY4m(image);
+        }
+
+        lock.lock();
+        image->Done = true;
+        Recorder.Progress.notify_all();
+    }
+}
+
+// Writes encoded frames in capture order, whichever worker finishes first.
+static void WriterThread()
+{
+    std::unique_lock<std::mutex> lock(Recorder.Mutex);
+    while (true) {
+        Recorder.Progress.wait(lock, [] {
+            return (Recorder.Order.empty() && Recorder.Closing) || (!Recorder.Order.empty() && Recorder.Order.front()->Done);
+        });
+        if (Recorder.Order.empty()) {
+            return;
+        }
+        PendingImage* image = Recorder.Order.front();
+        Recorder.Order.pop_front();
+        lock.unlock();
+
+        WriteImage(image);
+        delete image;
+
+        lock.lock();
+        Recorder.Progress.notify_all();
+    }
+}
+
+// Runs on the readback thread, in capture order.
+static void QueueImage(const unsigned char* pixels, size_t size, SurfacePod surface, void* userData)
+{
+    PendingImage* image = (PendingImage*) userData;
+    image->Pixels.assign(pixels, pixels + size);
+
+    std::unique_lock<std::mutex> lock(Recorder.Mutex);
+    Recorder.Progress.wait(lock, [] { return Recorder.Order.size() < MaxPendingImages; });
+    Recorder.Order.push_back(image);
+    Recorder.Work.push_back(image);
+    Recorder.Wake.notify_one();
+}
+
+void BeginFrameRecording(const char* path, FrameFormat format)
+{
+    pezCheck(!Recorder.Active, "Frames are already being recorded.");
+    Recorder.Format = format;
+    Recorder.Path = path;
+    Recorder.Stream = 0;
+    if (format == FrameY4m) {
+        Recorder.Stream = strcmp(path, "-") ? fopen(path, "wb") : stdout;
+        pezCheck(Recorder.Stream != 0, "Unable to open %s for writing.", path);
+    }
+    Recorder.Captured = 0;
+    Recorder.Dropped = 0;
+    Recorder.Closing = false;
+
+    int workers = std::max(1, int(std::thread::hardware_concurrency()) - 1);
+    for (int i = 0; i < workers; ++i) {
+        Recorder.Workers.push_back(std::thread(EncodeWorker));
+    }
+    Recorder.Writer = std::thread(WriterThread);
+    Recorder.Active = true;
+}
+
+void RecordFrame(int width, int height)
+{
+    if (!Recorder.Active) {
+        return;
+    }
+    PendingImage* image = new PendingImage;
+    image->Index = Recorder.Captured;
+    image->Width = width;
+    image->Height = height;
+    image->Done = false;
+    if (TryBeginFramebufferReadback(width, height, GL_RGB, GL_UNSIGNED_BYTE, QueueImage, image)) {
+        ++Recorder.Captured;
+    } else {
+        delete image;
+        ++Recorder.Dropped;
+    }
+}
+
+void EndFrameRecording()
+{
+    if (!Recorder.Active) {
+        return;
+    }
+    FlushReadback();
+    {
+        std::lock_guard<std::mutex> lock(Recorder.Mutex);
+        Recorder.Closing = true;
+        Recorder.Wake.notify_all();
+        Recorder.Progress.notify_all();
+    }
+    for (size_t i = 0; i < Recorder.Workers.size(); ++i) {
+        Recorder.Workers[i].join();
+    }
+    Recorder.Workers.clear();
+    Recorder.Writer.join();
+
+    if (Recorder.Stream == stdout) {
+        fflush(stdout);
+    } else if (Recorder.Stream) {
+        fclose(Recorder.Stream);
+    }
+    pezPrintString("Recorded %d frames to %s (%d skipped)\n", Recorder.Captured, Recorder.Path.c_str(), Recorder.Dropped);
+    Recorder.Active = false;
+}
+
+bool IsRecordingFrames()
+{
+    return Recorder.Active;
+}
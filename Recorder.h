@@ -0,0 +1,18 @@
+#pragma once
+#include "Utility.h"
+
+// Records the rendered frames as a numbered PNG sequence, or as one YUV4MPEG2 stream
+// ("-" writes it to stdout for piping into an encoder).  Frames are captured through
+// the readback ring, encoded on a pool of threads and written in order.  RecordFrame
+// never waits: when every readback buffer is busy, the frame is skipped and counted.
+
+enum FrameFormat {
+    FramePng,
+    FrameY4m,
+};
+
+// For PNG sequences, path is a printf pattern that receives the frame index.
+void BeginFrameRecording(const char* path, FrameFormat format);
+void RecordFrame(int width, int height);
+void EndFrameRecording();
+bool IsRecordingFrames();
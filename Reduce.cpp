@@ -0,0 +1,372 @@
+#include "Reduce.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+using namespace vmath;
+
+static const int ReduceRingSize = 4;
+
+// One level of a chain holds the min, max and sum of every input over a block of the
+// level above it, as three float targets of one layered framebuffer.
+struct ReduceLevel {
+    GLuint Fbo;
+    GLuint Textures[3];
+    GLsizei Width;
+    GLsizei Height;
+    GLsizei Depth;
+};
+
+// Chains are built on first use for each source size and kept for reuse.
+struct ReduceChain {
+    GLsizei Width;
+    GLsizei Height;
+    GLsizei Depth;
+    int Groups;
+    std::vector<ReduceLevel> Levels;
+};
+
+struct PendingReduce {
+    GLuint Pbo;
+    GLsync Fence;
+    int InputCount;
+    int Groups;
+    ReduceHandler Handler;
+    void* UserData;
+};
+
+static struct {
+    GLuint Gather;
+    GLuint Combine;
+} Programs;
+
+static std::vector<ReduceChain> Chains;
+static PendingReduce Ring[ReduceRingSize];
+static int RingHead;
+static int RingCount;
+
+void InitReduce()
+{
+    Programs.Gather = SubmitLayeredProgram("Fluid.Vertex", "Fluid.PickLayer", "Reduce.Gather");
+    Programs.Combine = SubmitLayeredProgram("Fluid.Vertex", "Fluid.PickLayer", "Reduce.Combine");
+    WatchLayeredProgram(&Programs.Gather, OwnerSimulation, "Fluid.Vertex", "Fluid.PickLayer", "Reduce.Gather");
+    WatchLayeredProgram(&Programs.Combine, OwnerSimulation, "Fluid.Vertex", "Fluid.PickLayer", "Reduce.Combine");
+}
+
+static GLuint CreateLevelTexture(GLsizei width, GLsizei height, GLsizei depth)
+{
+    GLuint texture;
+    glGenTextures(1, &texture);
+    glBindTexture(GL_TEXTURE_3D, texture);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexImage3D(GL_TEXTURE_3D, 0, GL_RGBA32F, width, height, depth, 0, GL_RGBA, GL_FLOAT, 0);
+    return texture;
+}
+
+// X and Y halve down to one texel, and Z halves down to one layer per group.
+static ReduceChain& GetChain(SurfacePod source, int groups)
+{
+    for (size_t i = 0; i < Chains.size(); ++i) {
+        ReduceChain& chain = Chains[i];
+        if (chain.Width == source.Width && chain.Height == source.Height &&
+            chain.Depth == source.Depth && chain.Groups == groups) {
+            return chain;
+        }
+    }
+
+    int groupDepth = source.Depth / groups;
+    pezCheck(groupDepth * groups == source.Depth && (groups == 1 || !(groupDepth & (groupDepth - 1))),
+             "Reduction groups must split the volume into slabs of a power-of-two depth.");
+
+    ReduceChain chain;
+    chain.Width = source.Width;
+    chain.Height = source.Height;
+    chain.Depth = source.Depth;
+    chain.Groups = groups;
+
+    GLsizei width = source.Width, height = source.Height, depth = source.Depth;
+    while (width > 1 || height > 1 || depth > groups || chain.Levels.empty()) {
+        ReduceLevel level;
+        level.Width = width = (width + 1) / 2;
+        level.Height = height = (height + 1) / 2;
+        level.Depth = depth = depth > groups ? (depth + 1) / 2 : depth;
+
+        glGenFramebuffers(1, &level.Fbo);
+        glBindFramebuffer(GL_FRAMEBUFFER, level.Fbo);
+        for (int t = 0; t < 3; ++t) {
+            level.Textures[t] = CreateLevelTexture(width, height, depth);
+            glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0 + t, level.Textures[t], 0);
+        }
+        GLenum drawBuffers[3] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1, GL_COLOR_ATTACHMENT2 };
+        glDrawBuffers(3, drawBuffers);
+        pezCheck(GL_FRAMEBUFFER_COMPLETE == glCheckFramebufferStatus(GL_FRAMEBUFFER), "Unable to create reduction FBO.");
+        chain.Levels.push_back(level);
+    }
+    glBindTexture(GL_TEXTURE_3D, 0);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+    Chains.push_back(chain);
+    return Chains.back();
+}
+
+static void SetUniform(const char* name, int x, int y, int z)
+{
+    GLuint program;
+    glGetIntegerv(GL_CURRENT_PROGRAM, (GLint*) &program);
+    glUniform3i(glGetUniformLocation(program, name), x, y, z);
+}
+
+static void DeliverOldest(bool wait)
+{
+    PendingReduce& pending = Ring[RingHead];
+    if (wait) {
+        glClientWaitSync(pending.Fence, GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+    }
+    glDeleteSync(pending.Fence);
+
+    float values[3][MaxEnsembleSize][4];
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, pending.Pbo);
+    glGetBufferSubData(GL_PIXEL_PACK_BUFFER, 0, sizeof(values), values);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+    ReduceResult result;
+    memset(&result, 0, sizeof(result));
+    result.InputCount = pending.InputCount;
+    result.Groups = pending.Groups;
+    for (int group = 0; group < pending.Groups; ++group) {
+        for (int input = 0; input < pending.InputCount; ++input) {
+            result.Min[group][input] = values[0][group][input];
+            result.Max[group][input] = values[1][group][input];
+            result.Sum[group][input] = values[2][group][input];
+        }
+    }
+
+    RingHead = (RingHead + 1) % ReduceRingSize;
+    --RingCount;
+    pending.Handler(result, pending.UserData);
+}
+
+void BeginReduce(const ReduceInput* inputs, int inputCount, int groups, ReduceHandler handler, void* userData,
+                 const ReduceMask* masks, int maskCount)
+{
+    pezCheck(inputCount >= 1 && inputCount <= MaxReduceInputs, "A reduction takes 1 to %d inputs.", MaxReduceInputs);
+    pezCheck(maskCount >= 0 && maskCount <= MaxReduceMasks, "A reduction takes up to %d masks.", MaxReduceMasks);
+    pezCheck(groups >= 1 && groups <= MaxEnsembleSize, "A reduction takes 1 to %d groups.", MaxEnsembleSize);
+    if (RingCount == ReduceRingSize) {
+        DeliverOldest(true);
+    }
+
+    SurfacePod source = inputs[0].Surface;
+    ReduceChain& chain = GetChain(source, groups);
+    glDisable(GL_BLEND);
+
+    GLsizei width = source.Width, height = source.Height, depth = source.Depth;
+    for (size_t i = 0; i < chain.Levels.size(); ++i) {
+        const ReduceLevel& level = chain.Levels[i];
+        glBindFramebuffer(GL_FRAMEBUFFER, level.Fbo);
+        glViewport(0, 0, level.Width, level.Height);
+
+        if (i == 0) {
+            glUseProgram(Programs.Gather);
+            char name[32];
+            for (int input = 0; input < inputCount; ++input) {
+                glActiveTexture(GL_TEXTURE0 + input);
+                glBindTexture(GL_TEXTURE_3D, inputs[input].Surface.ColorTexture);
+                sprintf(name, "Inputs[%d]", input);
+                SetUniform(name, input);
+                sprintf(name, "Channels[%d]", input);
+                SetUniform(name, int(inputs[input].Channel));
+            }
+            SetUniform("InputCount", inputCount);
+
+            // Masks take the texture units after the inputs.
+            for (int mask = 0; mask < maskCount; ++mask) {
+                int unit = MaxReduceInputs + mask;
+                glActiveTexture(GL_TEXTURE0 + unit);
+                glBindTexture(GL_TEXTURE_3D, masks[mask].Surface.ColorTexture);
+                sprintf(name, "Masks[%d]", mask);
+                SetUniform(name, unit);
+                sprintf(name, "MaskChannels[%d]", mask);
+                SetUniform(name, int(masks[mask].Channel));
+                sprintf(name, "MaskThresholds[%d]", mask);
+                SetUniform(name, masks[mask].Threshold);
+            }
+            SetUniform("MaskCount", maskCount);
+        } else {
+            const ReduceLevel& above = chain.Levels[i - 1];
+            glUseProgram(Programs.Combine);
+            for (int t = 0; t < 3; ++t) {
+                glActiveTexture(GL_TEXTURE0 + t);
+                glBindTexture(GL_TEXTURE_3D, above.Textures[t]);
+            }
+            SetUniform("MinLevel", 0);
+            SetUniform("MaxLevel", 1);
+            SetUniform("SumLevel", 2);
+        }
+        SetUniform("SourceSize", width, height, depth);
+        SetUniform("Stride", width > 1 ? 2 : 1, height > 1 ? 2 : 1, depth > level.Depth ? 2 : 1);
+        glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, level.Depth);
+
+        width = level.Width;
+        height = level.Height;
+        depth = level.Depth;
+    }
+
+    int unitCount = maskCount ? MaxReduceInputs + maskCount : std::max(inputCount, 3);
+    for (int unit = unitCount - 1; unit >= 0; --unit) {
+        glActiveTexture(GL_TEXTURE0 + unit);
+        glBindTexture(GL_TEXTURE_3D, 0);
+    }
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+    // The last level is 1x1 with a layer per group; copy its three targets into the buffer.
+    PendingReduce& pending = Ring[(RingHead + RingCount) % ReduceRingSize];
+    if (!pending.Pbo) {
+        glGenBuffers(1, &pending.Pbo);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, pending.Pbo);
+        glBufferData(GL_PIXEL_PACK_BUFFER, 3 * MaxEnsembleSize * 4 * sizeof(float), 0, GL_STREAM_READ);
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, pending.Pbo);
+    const ReduceLevel& last = chain.Levels.back();
+    for (int t = 0; t < 3; ++t) {
+        glBindTexture(GL_TEXTURE_3D, last.Textures[t]);
+        glGetTexImage(GL_TEXTURE_3D, 0, GL_RGBA, GL_FLOAT, (GLvoid*) (t * MaxEnsembleSize * 4 * sizeof(float)));
+    }
+    glBindTexture(GL_TEXTURE_3D, 0);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+    pending.Fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    pending.InputCount = inputCount;
+    pending.Groups = groups;
+    pending.Handler = handler;
+    pending.UserData = userData;
+    ++RingCount;
+}
+
+void PollReduce()
+{
+    while (RingCount) {
+        GLenum status = glClientWaitSync(Ring[RingHead].Fence, 0, 0);
+        if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED) {
+            break;
+        }
+        DeliverOldest(false);
+    }
+}
+
+void FlushReduce()
+{
+    while (RingCount) {
+        DeliverOldest(true);
+    }
+}
+
+static void StoreResult(const ReduceResult& result, void* userData)
+{
+    *(ReduceResult*) userData = result;
+}
+
+// Reduces the fields the same way on the CPU, after reading them back.
+static void ReduceOnCpu(const ReduceInput* inputs, int inputCount, ReduceResult* result)
+{
+    memset(result, 0, sizeof(*result));
+    result->InputCount = inputCount;
+    result->Groups = 1;
+    for (int input = 0; input < inputCount; ++input) {
+        SurfacePod surface = inputs[input].Surface;
+        size_t cellCount = size_t(surface.Width) * surface.Height * surface.Depth;
+        std::vector<float> texels(cellCount * 4);
+        glBindTexture(GL_TEXTURE_3D, surface.ColorTexture);
+        glGetTexImage(GL_TEXTURE_3D, 0, GL_RGBA, GL_FLOAT, &texels[0]);
+
+        float lo = 3.4e38f, hi = -3.4e38f;
+        double sum = 0;
+        for (size_t i = 0; i < cellCount; ++i) {
+            const float* t = &texels[i * 4];
+            float v = inputs[input].Channel == ReduceLength ?
+                sqrtf(t[0] * t[0] + t[1] * t[1] + t[2] * t[2]) : t[inputs[input].Channel];
+            lo = std::min(lo, v);
+            hi = std::max(hi, v);
+            sum += v;
+        }
+        result->Min[0][input] = lo;
+        result->Max[0][input] = hi;
+        result->Sum[0][input] = float(sum);
+    }
+    glBindTexture(GL_TEXTURE_3D, 0);
+}
+
+static float RelativeError(float a, float b)
+{
+    return fabsf(a - b) / std::max(std::max(fabsf(a), fabsf(b)), 1e-6f);
+}
+
+void BenchmarkReduce(int iterations)
+{
+    const int WarmupSteps = 100;
+    GLuint vao;
+    glGenVertexArrays(1, &vao);
+    glBindVertexArray(vao);
+    GLuint vbo = CreateQuadVbo();
+    glEnableVertexAttribArray(SlotPosition);
+    glVertexAttribPointer(SlotPosition, 2, GL_SHORT, GL_FALSE, 2 * sizeof(short), 0);
+    glDisable(GL_DEPTH_TEST);
+    glDisable(GL_CULL_FACE);
+
+    FluidPod fluid = CreateFluid(GridWidth, GridHeight, GridDepth * EnsembleSize);
+    for (int step = 0; step < WarmupSteps; ++step) {
+        StepFluid(&fluid);
+    }
+
+    ReduceInput inputs[3] = {
+        { fluid.Density.Ping, ReduceX },
+        { fluid.Temperature.Ping, ReduceX },
+        { fluid.Velocity.Ping, ReduceLength },
+    };
+    const char* names[3] = { "density", "temperature", "speed" };
+    ReduceResult gpu, cpu;
+
+    // Round trips include the wait for the result; throughput issues them back to back.
+    BeginReduce(inputs, 3, 1, StoreResult, &gpu);
+    FlushReduce();
+    unsigned long long start = pezGetNanoseconds();
+    for (int i = 0; i < iterations; ++i) {
+        BeginReduce(inputs, 3, 1, StoreResult, &gpu);
+        FlushReduce();
+    }
+    double roundTrip = (pezGetNanoseconds() - start) * 1e-6 / iterations;
+
+    start = pezGetNanoseconds();
+    for (int i = 0; i < iterations; ++i) {
+        BeginReduce(inputs, 3, 1, StoreResult, &gpu);
+        PollReduce();
+    }
+    FlushReduce();
+    double throughput = (pezGetNanoseconds() - start) * 1e-6 / iterations;
+
+    start = pezGetNanoseconds();
+    for (int i = 0; i < iterations; ++i) {
+        ReduceOnCpu(inputs, 3, &cpu);
+    }
+    double readback = (pezGetNanoseconds() - start) * 1e-6 / iterations;
+
+    pezPrintString("Reducing 3 fields of %dx%dx%d, %d iterations\n",
+                   GridWidth, GridHeight, GridDepth * EnsembleSize, iterations);
+    pezPrintString("  GPU round trip  %8.3f ms\n", roundTrip);
+    pezPrintString("  GPU pipelined   %8.3f ms\n", throughput);
+    pezPrintString("  CPU readback    %8.3f ms\n", readback);
+    for (int input = 0; input < 3; ++input) {
+        pezPrintString("  %-12s min %10.4g  max %10.4g  sum %12.6g  (relative error %.1e)\n", names[input],
+                       gpu.Min[0][input], gpu.Max[0][input], gpu.Sum[0][input],
+                       std::max(RelativeError(gpu.Sum[0][input], cpu.Sum[0][input]),
+                                std::max(RelativeError(gpu.Min[0][input], cpu.Min[0][input]),
+                                         RelativeError(gpu.Max[0][input], cpu.Max[0][input]))));
+    }
+
+    DestroyFluid(fluid);
+    glDeleteBuffers(1, &vbo);
+    glDeleteVertexArrays(1, &vao);
+}
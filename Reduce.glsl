@@ -0,0 +1,98 @@
+
+-- Gather
+
+layout(location = 0) out vec4 MinColor;
+layout(location = 1) out vec4 MaxColor;
+layout(location = 2) out vec4 SumColor;
+
+uniform sampler3D Inputs[4];
+uniform int Channels[4];
+uniform int InputCount;
+uniform sampler3D Masks[3];
+uniform int MaskChannels[3];
+uniform float MaskThresholds[3];
+uniform int MaskCount;
+uniform ivec3 SourceSize;
+uniform ivec3 Stride;
+
+in float gLayer;
+
+float Pick(vec4 value, int channel, ivec3 cell)
+{
+    if (channel >= 5)
+        return float(cell[channel - 5]);
+    return channel == 4 ? length(value.xyz) : value[channel];
+}
+
+bool Counted(ivec3 cell)
+{
+    if (MaskCount == 0)
+        return true;
+    for (int i = 0; i < MaskCount; ++i)
+        if (abs(Pick(texelFetch(Masks[i], cell, 0), MaskChannels[i], cell)) > MaskThresholds[i])
+            return true;
+    return false;
+}
+
+void main()
+{
+    ivec3 T = ivec3(gl_FragCoord.xy, gLayer) * Stride;
+    vec4 lo = vec4(3.4e38);
+    vec4 hi = vec4(-3.4e38);
+    vec4 sum = vec4(0);
+
+    for (int z = 0; z < Stride.z; ++z)
+    for (int y = 0; y < Stride.y; ++y)
+    for (int x = 0; x < Stride.x; ++x) {
+        ivec3 C = T + ivec3(x, y, z);
+        if (any(greaterThanEqual(C, SourceSize)) || !Counted(C))
+            continue;
+        vec4 v = vec4(0);
+        for (int i = 0; i < InputCount; ++i)
+            v[i] = Pick(texelFetch(Inputs[i], C, 0), Channels[i], C);
+        lo = min(lo, v);
+        hi = max(hi, v);
+        sum += v;
+    }
+
+    MinColor = lo;
+    MaxColor = hi;
+    SumColor = sum;
+}
+
+-- Combine
+
+layout(location = 0) out vec4 MinColor;
+layout(location = 1) out vec4 MaxColor;
+layout(location = 2) out vec4 SumColor;
+
+uniform sampler3D MinLevel;
+uniform sampler3D MaxLevel;
+uniform sampler3D SumLevel;
+uniform ivec3 SourceSize;
+uniform ivec3 Stride;
+
+in float gLayer;
+
+void main()
+{
+    ivec3 T = ivec3(gl_FragCoord.xy, gLayer) * Stride;
+    vec4 lo = vec4(3.4e38);
+    vec4 hi = vec4(-3.4e38);
+    vec4 sum = vec4(0);
+
+    for (int z = 0; z < Stride.z; ++z)
+    for (int y = 0; y < Stride.y; ++y)
+    for (int x = 0; x < Stride.x; ++x) {
+        ivec3 C = T + ivec3(x, y, z);
+        if (any(greaterThanEqual(C, SourceSize)))
+            continue;
+        lo = min(lo, texelFetch(MinLevel, C, 0));
+        hi = max(hi, texelFetch(MaxLevel, C, 0));
+        sum += texelFetch(SumLevel, C, 0);
+    }
+
+    MinColor = lo;
+    MaxColor = hi;
+    SumColor = sum;
+}
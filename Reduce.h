@@ -0,0 +1,59 @@
+#pragma once
+#include "Utility.h"
+
+// What each cell of an input contributes to a reduction.  The cell channels contribute
+// the cell's own coordinate, so that min and max give the extent of the cells counted;
+// their surface only has to match the size of the other inputs.
+enum ReduceChannel {
+    ReduceX,
+    ReduceY,
+    ReduceZ,
+    ReduceW,
+    ReduceLength,
+    ReduceCellX,
+    ReduceCellY,
+    ReduceCellZ,
+};
+
+struct ReduceInput {
+    SurfacePod Surface;
+    ReduceChannel Channel;
+};
+
+// With masks, only the cells where some mask channel's magnitude exceeds its threshold
+// are counted.  A group without any such cell reports a min above its max.
+struct ReduceMask {
+    SurfacePod Surface;
+    ReduceChannel Channel;
+    float Threshold;
+};
+
+const int MaxReduceInputs = 4;
+const int MaxReduceMasks = 3;
+
+// Min, max and sum of every input, indexed by group and then by input.  Groups split
+// the volume into equal slabs along Z, so an ensemble reduces per member when Groups
+// is EnsembleSize.
+struct ReduceResult {
+    int InputCount;
+    int Groups;
+    float Min[MaxEnsembleSize][MaxReduceInputs];
+    float Max[MaxEnsembleSize][MaxReduceInputs];
+    float Sum[MaxEnsembleSize][MaxReduceInputs];
+};
+
+typedef void (*ReduceHandler)(const ReduceResult& result, void* userData);
+
+// Volumes are reduced on the GPU by a chain of passes that each collapse 2x2x2 blocks,
+// and the last level is copied into a small buffer guarded by a fence.  PollReduce hands
+// finished results to their handlers, so nothing waits on the GPU unless every buffer
+// is in flight.  The inputs of one reduction must share a size, and reductions are
+// issued and polled on one thread, with the fullscreen quad's vertex array bound.
+void InitReduce();
+void BeginReduce(const ReduceInput* inputs, int inputCount, int groups, ReduceHandler handler, void* userData,
+                 const ReduceMask* masks = 0, int maskCount = 0);
+void PollReduce();
+void FlushReduce();
+
+// Compares reducing the solver's fields on the GPU against reading them back.
+void BenchmarkReduce(int iterations);
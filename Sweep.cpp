@@ -0,0 +1,240 @@
+#include "Sweep.h"
+#include "Utility.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+
+using namespace vmath;
+
+struct SweepRun {
+    int Index;
+    MemberParams Params;
+    int JacobiIterations;
+};
+
+struct FieldStats {
+    float Mass;
+    float MaxDensity;
+    float MeanTemperature;
+    float MaxSpeed;
+    float CentroidY;
+};
+
+static const struct {
+    const char* Name;
+    float MemberParams::* Field;
+} SweepParams[] = {
+    { "SmokeBuoyancy", &MemberParams::SmokeBuoyancy },
+    { "SmokeWeight", &MemberParams::SmokeWeight },
+    { "TemperatureDissipation", &MemberParams::TemperatureDissipation },
+    { "VelocityDissipation", &MemberParams::VelocityDissipation },
+    { "DensityDissipation", &MemberParams::DensityDissipation },
+    { "ImpulseTemperature", &MemberParams::ImpulseTemperature },
+    { "ImpulseDensity", &MemberParams::ImpulseDensity },
+};
+
+static bool CompareJacobi(const SweepRun& a, const SweepRun& b)
+{
+    return a.JacobiIterations < b.JacobiIterations;
+}
+
+static double GetSeconds()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Reads back the fields of every member and reduces each member's slab of layers on the CPU.
+// This runs once per batch, after the timed steps, so it doesn't affect the throughput
+// columns.  Reduce.h could take it over except for CentroidY, which needs a sum weighted
+// by height that the GPU reduction doesn't offer.
+static void ComputeStats(FluidPod fluid, FieldStats* stats)
+{
+    size_t cellCount = size_t(GridWidth) * GridHeight * GridDepth;
+    std::vector<float> density(cellCount * EnsembleSize);
+    std::vector<float> temperature(cellCount * EnsembleSize);
+    std::vector<float> velocity(cellCount * EnsembleSize * 3);
+
+    glBindTexture(GL_TEXTURE_3D, fluid.Density.Ping.ColorTexture);
+    glGetTexImage(GL_TEXTURE_3D, 0, GL_RED, GL_FLOAT, &density[0]);
+    glBindTexture(GL_TEXTURE_3D, fluid.Temperature.Ping.ColorTexture);
+    glGetTexImage(GL_TEXTURE_3D, 0, GL_RED, GL_FLOAT, &temperature[0]);
+    glBindTexture(GL_TEXTURE_3D, fluid.Velocity.Ping.ColorTexture);
+    glGetTexImage(GL_TEXTURE_3D, 0, GL_RGB, GL_FLOAT, &velocity[0]);
+    glBindTexture(GL_TEXTURE_3D, 0);
+
+    for (int member = 0; member < EnsembleSize; ++member) {
+        FieldStats s = {0};
+        double mass = 0, temperatureSum = 0, heightSum = 0;
+        size_t base = cellCount * member;
+        for (size_t i = 0; i < cellCount; ++i) {
+            float d = density[base + i];
+            const float* v = &velocity[(base + i) * 3];
+            float speed = sqrtf(v[0] * v[0] + v[1] * v[1] + v[2] * v[2]);
+            int y = int(i / GridWidth) % GridHeight;
+            mass += d;
+            heightSum += d * y;
+            temperatureSum += temperature[base + i];
+            s.MaxDensity = std::max(s.MaxDensity, d);
+            s.MaxSpeed = std::max(s.MaxSpeed, speed);
+        }
+        s.Mass = float(mass);
+        s.MeanTemperature = float(temperatureSum / cellCount);
+        s.CentroidY = mass > 0 ? float(heightSum / mass) : 0;
+        stats[member] = s;
+    }
+}
+
+static std::vector<SweepRun> ParseSpec(const char* specFile, int* steps, int* batchSize)
+{
+    FILE* file = fopen(specFile, "r");
+    pezCheck(file != 0, "Unable to open sweep spec '%s'.", specFile);
+
+    std::vector<SweepRun> runs(1);
+    InitMembers();
+    runs[0].Params = Members[0];
+    runs[0].JacobiIterations = NumJacobiIterations;
+
+    char line[1024];
+    while (fgets(line, sizeof(line), file)) {
+        const char* name = strtok(line, " \t\r\n");
+        if (!name || name[0] == '#') {
+            continue;
+        }
+
+        std::vector<float> values;
+        while (const char* token = strtok(0, " \t\r\n")) {
+            values.push_back(float(atof(token)));
+        }
+        pezCheck(!values.empty(), "No values given for '%s' in sweep spec.", name);
+
+        if (!strcmp(name, "Steps")) {
+            *steps = int(values[0]);
+            pezCheck(*steps > 0, "Steps must be positive in sweep spec '%s'.", specFile);
+            continue;
+        }
+        if (!strcmp(name, "BatchSize")) {
+            *batchSize = int(values[0]);
+            continue;
+        }
+
+        float MemberParams::* field = 0;
+        for (size_t p = 0; p < countof(SweepParams); ++p) {
+            if (!strcmp(name, SweepParams[p].Name)) {
+                field = SweepParams[p].Field;
+            }
+        }
+        pezCheck(field || !strcmp(name, "NumJacobiIterations"), "Unknown sweep parameter '%s'.", name);
+
+        // Expand the grid by this axis:
+        std::vector<SweepRun> expanded;
+        for (size_t r = 0; r < runs.size(); ++r) {
+            for (size_t v = 0; v < values.size(); ++v) {
+                SweepRun run = runs[r];
+                if (field) {
+                    run.Params.*field = values[v];
+                } else {
+                    run.JacobiIterations = int(values[v]);
+                }
+                expanded.push_back(run);
+            }
+        }
+        runs.swap(expanded);
+    }
+    fclose(file);
+
+    for (size_t r = 0; r < runs.size(); ++r) {
+        runs[r].Index = int(r);
+    }
+    return runs;
+}
+
+void RunSweep(const char* specFile, const char* csvFile)
+{
+    int steps = 200;
+    int batchSize = MaxEnsembleSize;
+    std::vector<SweepRun> runs = ParseSpec(specFile, &steps, &batchSize);
+
+    // Every member needs GridDepth layers of the shared volume:
+    GLint maxDepth;
+    glGetIntegerv(GL_MAX_3D_TEXTURE_SIZE, &maxDepth);
+    batchSize = std::max(1, std::min(batchSize, std::min(MaxEnsembleSize, int(maxDepth / GridDepth))));
+
+    // Only runs with matching solver iterations can share a batch:
+    std::stable_sort(runs.begin(), runs.end(), CompareJacobi);
+
+    FILE* csv = fopen(csvFile, "w");
+    pezCheck(csv != 0, "Unable to open '%s' for writing.", csvFile);
+    fprintf(csv, "Run");
+    for (size_t p = 0; p < countof(SweepParams); ++p) {
+        fprintf(csv, ",%s", SweepParams[p].Name);
+    }
+    // Runs in a batch step together, so time and cell rates are the batch's; RunCellsPerSecond
+    // is one run's share of them.
+    fprintf(csv, ",NumJacobiIterations,BatchSize,Steps,BatchSeconds,StepsPerSecond,BatchCellsPerSecond,RunCellsPerSecond");
+    fprintf(csv, ",Mass,MaxDensity,MeanTemperature,MaxSpeed,CentroidY\n");
+
+    GLuint vao;
+    glGenVertexArrays(1, &vao);
+    glBindVertexArray(vao);
+    GLuint vbo = CreateQuadVbo();
+    glEnableVertexAttribArray(SlotPosition);
+    glVertexAttribPointer(SlotPosition, 2, GL_SHORT, GL_FALSE, 2 * sizeof(short), 0);
+    glDisable(GL_DEPTH_TEST);
+    glDisable(GL_CULL_FACE);
+    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+
+    size_t first = 0;
+    while (first < runs.size()) {
+        size_t last = first + 1;
+        while (last < runs.size() && int(last - first) < batchSize &&
+               runs[last].JacobiIterations == runs[first].JacobiIterations) {
+            ++last;
+        }
+
+        EnsembleSize = int(last - first);
+        NumJacobiIterations = runs[first].JacobiIterations;
+        for (size_t r = first; r < last; ++r) {
+            Members[r - first] = runs[r].Params;
+        }
+
+        FluidPod fluid = CreateFluid(GridWidth, GridHeight, GridDepth * EnsembleSize);
+        glFinish();
+        double start = GetSeconds();
+        for (int step = 0; step < steps; ++step) {
+            StepFluid(&fluid);
+        }
+        glFinish();
+        double seconds = GetSeconds() - start;
+
+        FieldStats stats[MaxEnsembleSize];
+        ComputeStats(fluid, stats);
+        DestroyFluid(fluid);
+        pezCheck(GL_NO_ERROR == glGetError(), "OpenGL error during sweep batch.");
+
+        double cells = double(GridWidth) * GridHeight * GridDepth * EnsembleSize * steps;
+        for (size_t r = first; r < last; ++r) {
+            const FieldStats& s = stats[r - first];
+            fprintf(csv, "%d", runs[r].Index);
+            for (size_t p = 0; p < countof(SweepParams); ++p) {
+                fprintf(csv, ",%g", runs[r].Params.*SweepParams[p].Field);
+            }
+            fprintf(csv, ",%d,%d,%d,%g,%g,%g,%g", runs[r].JacobiIterations, EnsembleSize, steps,
+                    seconds, steps / seconds, cells / seconds, cells / EnsembleSize / seconds);
+            fprintf(csv, ",%g,%g,%g,%g,%g\n", s.Mass, s.MaxDensity, s.MeanTemperature, s.MaxSpeed, s.CentroidY);
+        }
+        fflush(csv);
+
+        pezPrintString("Batch of %d runs (%d Jacobi iterations): %.2f steps/s\n",
+                       EnsembleSize, NumJacobiIterations, steps / seconds);
+        first = last;
+    }
+
+    fclose(csv);
+    glDeleteBuffers(1, &vbo);
+    glDeleteVertexArrays(1, &vao);
+}
@@ -0,0 +1,14 @@
+#pragma once
+
+// Runs every point of a parameter grid without a window and writes one CSV row per run.
+//
+// The spec file has one parameter per line followed by the values to sweep, e.g.:
+//
+//     Steps 200
+//     BatchSize 8
+//     SmokeBuoyancy 0.5 1.0 2.0
+//     NumJacobiIterations 20 40
+//
+// Runs that share NumJacobiIterations are packed into one ensemble so that
+// each slab pass advances the whole batch with a single draw.
+void RunSweep(const char* specFile, const char* csvFile);
@@ -1,8 +1,16 @@
 #include "Utility.h"
+#include "Emitter.h"
+#include "Reduce.h"
+#include "VolumeFile.h"
 #include "pez.h"
 #include <string.h>
+#include <algorithm>
+#include <atomic>
 #include <cmath>
 #include <cstdio>
+#include <deque>
+#include <mutex>
+#include <sys/stat.h>
 
 using namespace vmath;
 
@@ -11,8 +19,11 @@ static struct {
     GLuint Jacobi;
     GLuint SubtractGradient;
     GLuint ComputeDivergence;
-    GLuint ApplyImpulse;
+    GLuint Inject;
     GLuint ApplyBuoyancy;
+    GLuint Residual;
+    GLuint ClearOutside;
+    GLuint Fill;
 } Programs;
 
 const float CellSize = 1.25f;
@@ -23,15 +34,75 @@ const float SplatRadius = GridWidth / 8.0f;
 const float AmbientTemperature = 0.0f;
 const float ImpulseTemperature = 10.0f;
 const float ImpulseDensity = 1.25f;
-const int NumJacobiIterations = 40;
+int NumJacobiIterations = 40;
 const float TimeStep = 0.25f;
 const float SmokeBuoyancy = 1.0f;
 const float SmokeWeight = 0.0;
+const char* ProgramCacheFolder = "programcache";
 const float GradientScale = 1.125f / CellSize;
 const float TemperatureDissipation = 0.99f;
 const float VelocityDissipation = 0.99f;
 const float DensityDissipation = 0.999f;
 const Vector3 ImpulsePosition( GridWidth / 2.0f, GridHeight - (int) SplatRadius / 2.0f, GridDepth / 2.0f);
+int EnsembleSize = 1;
+MemberParams Members[MaxEnsembleSize];
+const char* SolverPassNames[PassCount] = { "advect", "buoyancy", "splat", "divergence", "jacobi", "gradient" };
+
+// GPU timestamps bracket each group of passes in StepFluid.  The query sets rotate so
+// that a set is only read back several steps after it was issued, which keeps the
+// readback from stalling the pipeline.
+static const int TimerSets = 4;
+
+static struct {
+    bool Enabled;
+    GLuint Queries[TimerSets][PassCount + 1];
+    bool Issued[TimerSets];
+    int Current;
+    float Milliseconds[PassCount];
+    bool Valid;
+    std::mutex Mutex;
+} PassTimer;
+
+static std::atomic<size_t> TextureBytes(0);
+
+// Backs the Emitters texture buffer that the inject program reads.  The framebuffer
+// gathers the three fields that emitters write, and is made on first use by the
+// context that steps the fluid.
+static struct {
+    GLuint Buffer;
+    GLuint Texture;
+    GLuint Fbo;
+} EmitterBuffer;
+
+// The boxes that the slab ops are restricted to while StepFluid runs; null means every cell.
+static const ActiveBox* SlabBounds;
+
+// Cells count as active when their density, temperature or speed exceeds this.  The
+// ambient temperature is zero, so the temperature is tested as is.
+static const float ActiveThreshold = 1e-3f;
+
+// Extra cells around the active region, on top of how far the smoke can travel while a
+// measurement is in flight.  A face only moves inward once it would move by ShrinkSlack
+// cells, since every shrink has to clear the cells it gives up.
+static const int BoundsSlack = 2;
+static const int ShrinkSlack = 4;
+
+// The fluid times at which the pending bounds reductions were issued, oldest first.
+static std::deque<double> BoundsIssueTimes;
+
+void InitMembers()
+{
+    for (int i = 0; i < MaxEnsembleSize; ++i) {
+        Members[i].ImpulsePosition = ImpulsePosition;
+        Members[i].ImpulseTemperature = ImpulseTemperature;
+        Members[i].ImpulseDensity = ImpulseDensity;
+        Members[i].SmokeBuoyancy = SmokeBuoyancy;
+        Members[i].SmokeWeight = SmokeWeight;
+        Members[i].TemperatureDissipation = TemperatureDissipation;
+        Members[i].VelocityDissipation = VelocityDissipation;
+        Members[i].DensityDissipation = DensityDissipation;
+    }
+}
 
 void CreateObstacles(SurfacePod dest)
 {
@@ -43,8 +114,7 @@ void CreateObstacles(SurfacePod dest)
     GLuint vao;
     glGenVertexArrays(1, &vao);
     glBindVertexArray(vao);
-    GLuint program = LoadProgram("Fluid.Vertex", 0, "Fluid.Fill");
-    glUseProgram(program);
+    glUseProgram(Programs.Fill);
 
     GLuint lineVbo;
     glGenBuffers(1, &lineVbo);
@@ -52,20 +122,22 @@ void CreateObstacles(SurfacePod dest)
     glGenBuffers(1, &circleVbo);
     glEnableVertexAttribArray(SlotPosition);
 
-    for (int slice = 0; slice < dest.Depth; ++slice) {
+    // Every ensemble member gets its own walls, so stencils never reach into a neighbor.
+    for (int layer = 0; layer < dest.Depth; ++layer) {
 
-        glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, dest.ColorTexture, 0, dest.Depth - 1 - slice);
-        float z = dest.Depth / 2.0f;
+        glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, dest.ColorTexture, 0, dest.Depth - 1 - layer);
+        int slice = layer % GridDepth;
+        float z = GridDepth / 2.0f;
         z = std::abs(slice - z) / z;
         float fraction = 1 - sqrt(z);
         float radius = 0.5f * fraction;
 
-        if (slice == 0 || slice == dest.Depth - 1) {
+        if (slice == 0 || slice == GridDepth - 1) {
             radius *= 100;
         }
 
         const bool DrawBorder = true;
-        if (DrawBorder && slice != 0 && slice != dest.Depth - 1) {
+        if (DrawBorder && slice != 0 && slice != GridDepth - 1) {
             #define T 0.9999f
             float positions[] = { -T, -T, T, -T, T,  T, -T,  T, -T, -T };
             #undef T
@@ -78,7 +150,7 @@ void CreateObstacles(SurfacePod dest)
         }
 
         const bool DrawSphere = false;
-        if (DrawSphere || slice == 0 || slice == dest.Depth - 1) {
+        if (DrawSphere || slice == 0 || slice == GridDepth - 1) {
             const int slices = 64;
             float positions[slices*2*3];
             float twopi = 8*atan(1.0f);
@@ -106,76 +178,519 @@ void CreateObstacles(SurfacePod dest)
     }
 
     // Cleanup
-    glDeleteProgram(program);
     glDeleteVertexArrays(1, &vao);
     glDeleteBuffers(1, &lineVbo);
     glDeleteBuffers(1, &circleVbo);
 }
 
-GLuint LoadProgram(const char* vsKey, const char* gsKey, const char* fsKey)
+static bool ProgramBinariesSupported()
+{
+    static int supported = -1;
+    if (supported >= 0) {
+        return supported;
+    }
+
+    // Core in 4.1; a 4.0 context needs the ARB extension.
+    GLint major = 0, minor = 0, extensionCount = 0;
+    glGetIntegerv(GL_MAJOR_VERSION, &major);
+    glGetIntegerv(GL_MINOR_VERSION, &minor);
+    glGetIntegerv(GL_NUM_EXTENSIONS, &extensionCount);
+    supported = major > 4 || (major == 4 && minor >= 1);
+    for (GLint i = 0; i < extensionCount && !supported; ++i) {
+        const char* name = (const char*) glGetStringi(GL_EXTENSIONS, i);
+        supported = name && !strcmp(name, "GL_ARB_get_program_binary");
+    }
+
+    if (supported) {
+        GLint formatCount = 0;
+        glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formatCount);
+        supported = formatCount > 0;
+    }
+    return supported;
+}
+
+// The sources already carry every directive, so hashing them along with the
+// specialization defines and the driver strings invalidates the cache whenever
+// any of them changes.
+static std::string ProgramCachePath(const char* vsSource, const char* gsSource, const char* fsSource, const char* defines)
+{
+    const char* strings[] = {
+        vsSource, gsSource, fsSource, defines,
+        (const char*) glGetString(GL_VENDOR),
+        (const char*) glGetString(GL_RENDERER),
+        (const char*) glGetString(GL_VERSION),
+    };
+
+    unsigned long long hash = 14695981039346656037ull;
+    for (size_t i = 0; i < sizeof(strings) / sizeof(strings[0]); ++i) {
+        for (const char* c = strings[i]; c && *c; ++c) {
+            hash = (hash ^ (unsigned char) *c) * 1099511628211ull;
+        }
+        hash = (hash ^ 0xff) * 1099511628211ull;
+    }
+
+    char path[256];
+    sprintf(path, "%s/%016llx.bin", ProgramCacheFolder, hash);
+    return path;
+}
+
+static bool LoadCachedProgram(GLuint programHandle, const std::string& path)
+{
+    FILE* file = fopen(path.c_str(), "rb");
+    if (!file) {
+        return false;
+    }
+
+    GLenum format = 0;
+    GLint length = 0;
+    std::vector<char> binary;
+    bool valid =
+        fread(&format, sizeof(format), 1, file) == 1 &&
+        fread(&length, sizeof(length), 1, file) == 1 &&
+        length > 0;
+    if (valid) {
+        binary.resize(length);
+        valid = fread(&binary[0], 1, length, file) == (size_t) length;
+    }
+    fclose(file);
+
+    GLint linkSuccess = 0;
+    if (valid) {
+        glProgramBinary(programHandle, format, &binary[0], length);
+        glGetProgramiv(programHandle, GL_LINK_STATUS, &linkSuccess);
+    }
+
+    // Drivers reject binaries from other builds; drop the entry so it gets rewritten.
+    if (!linkSuccess) {
+        remove(path.c_str());
+    }
+    return linkSuccess;
+}
+
+static void SaveCachedProgram(GLuint programHandle, const std::string& path)
+{
+    GLint length = 0;
+    glGetProgramiv(programHandle, GL_PROGRAM_BINARY_LENGTH, &length);
+    if (length <= 0) {
+        return;
+    }
+
+    GLenum format = 0;
+    std::vector<char> binary(length);
+    glGetProgramBinary(programHandle, length, &length, &format, &binary[0]);
+
+    mkdir(ProgramCacheFolder, 0755);
+    std::string tempPath = path + ".tmp";
+    FILE* file = fopen(tempPath.c_str(), "wb");
+    if (!file) {
+        return;
+    }
+
+    bool written =
+        fwrite(&format, sizeof(format), 1, file) == 1 &&
+        fwrite(&length, sizeof(length), 1, file) == 1 &&
+        fwrite(&binary[0], 1, length, file) == (size_t) length;
+    written = fclose(file) == 0 && written;
+
+    if (!written || rename(tempPath.c_str(), path.c_str()) != 0) {
+        remove(tempPath.c_str());
+    }
+}
+
+#ifndef GL_COMPLETION_STATUS_KHR
+#define GL_COMPLETION_STATUS_KHR 0x91B1
+#endif
+
+// Programs whose compile and link status have not been checked yet.  Leaving the
+// status queries until FinishPrograms lets the driver compile them all concurrently.
+struct PendingProgram {
+    GLuint Handle;
+    GLuint Shaders[3];
+    const char* Keys[3];
+    std::string CachePath;
+};
+
+static std::vector<PendingProgram> PendingPrograms;
+
+// Programs that are rebuilt when their effect files change on disk.  A rebuild stays
+// in Reload until it finishes compiling, and only replaces *Handle if it linked.
+// A finished rebuild of a simulation program waits in Adopt, with a fence from the
+// context that linked it, until the simulation thread takes it.
+struct WatchedProgram {
+    GLuint* Handle;
+    ProgramOwner Owner;
+    const char* Keys[3];
+    std::string Defines;
+    bool Layered;
+    bool Reloading;
+    PendingProgram Reload;
+    GLuint Adopt;
+    GLsync AdoptFence;
+};
+
+static std::vector<WatchedProgram> WatchedPrograms;
+
+// Guards Adopt and AdoptFence, which are the only parts of a watched program that both
+// threads touch.
+static std::mutex AdoptMutex;
+
+// Whether layered programs set gl_Layer in the vertex shader; decided when the first one
+// is built unless SetVertexLayer has been called.
+static int VertexLayer = -1;
+
+static bool ParallelCompileSupported()
+{
+    static int supported = -1;
+    if (supported >= 0) {
+        return supported;
+    }
+
+    GLint extensionCount = 0;
+    glGetIntegerv(GL_NUM_EXTENSIONS, &extensionCount);
+    supported = 0;
+    for (GLint i = 0; i < extensionCount && !supported; ++i) {
+        const char* name = (const char*) glGetStringi(GL_EXTENSIONS, i);
+        supported = name &&
+            (!strcmp(name, "GL_KHR_parallel_shader_compile") ||
+             !strcmp(name, "GL_ARB_parallel_shader_compile"));
+    }
+    return supported;
+}
+
+static bool ProgramCompleted(const PendingProgram& program)
+{
+    if (!ParallelCompileSupported()) {
+        return true;
+    }
+    GLint complete = GL_FALSE;
+    glGetProgramiv(program.Handle, GL_COMPLETION_STATUS_KHR, &complete);
+    return complete;
+}
+
+// Compile errors are fatal at startup, but a reload only reports them.
+static bool FinishProgram(const PendingProgram& program, bool fatal)
+{
+    GLint compileSuccess = GL_TRUE;
+    GLchar compilerSpew[256];
+    for (int stage = 0; stage < 3 && compileSuccess; ++stage) {
+        GLuint shader = program.Shaders[stage];
+        if (!shader) {
+            continue;
+        }
+        glGetShaderiv(shader, GL_COMPILE_STATUS, &compileSuccess);
+        glGetShaderInfoLog(shader, sizeof(compilerSpew), 0, compilerSpew);
+        if (fatal) {
+            pezCheck(compileSuccess, "Can't compile %s:\n%s", program.Keys[stage], compilerSpew);
+        } else if (!compileSuccess) {
+            pezPrintString("Can't compile %s:\n%s", program.Keys[stage], compilerSpew);
+        }
+    }
+
+    GLint linkSuccess = GL_FALSE;
+    if (compileSuccess) {
+        glGetProgramiv(program.Handle, GL_LINK_STATUS, &linkSuccess);
+        glGetProgramInfoLog(program.Handle, sizeof(compilerSpew), 0, compilerSpew);
+
+        if (!linkSuccess) {
+            pezPrintString("Link error.\n");
+            if (program.Keys[0]) pezPrintString("Vertex Shader: %s\n", program.Keys[0]);
+            if (program.Keys[1]) pezPrintString("Geometry Shader: %s\n", program.Keys[1]);
+            if (program.Keys[2]) pezPrintString("Fragment Shader: %s\n", program.Keys[2]);
+            pezPrintString("%s\n", compilerSpew);
+        } else if (!program.CachePath.empty()) {
+            SaveCachedProgram(program.Handle, program.CachePath);
+        }
+    }
+
+    for (int stage = 0; stage < 3; ++stage) {
+        if (program.Shaders[stage]) {
+            glDetachShader(program.Handle, program.Shaders[stage]);
+            glDeleteShader(program.Shaders[stage]);
+        }
+    }
+    return linkSuccess;
+}
+
+void FinishPrograms()
+{
+    // With parallel compile, retire programs in whatever order the driver completes them.
+    while (!PendingPrograms.empty()) {
+        bool retired = false;
+        for (size_t i = 0; i < PendingPrograms.size(); ++i) {
+            if (ProgramCompleted(PendingPrograms[i])) {
+                FinishProgram(PendingPrograms[i], true);
+                PendingPrograms.erase(PendingPrograms.begin() + i--);
+                retired = true;
+            }
+        }
+        if (!retired) {
+            FinishProgram(PendingPrograms.front(), true);
+            PendingPrograms.erase(PendingPrograms.begin());
+        }
+    }
+}
+
+// Specialization defines go right after the #version line, which must stay first;
+// the #line directive that follows keeps compiler messages pointing at the effect file.
+static GLuint SubmitShader(GLenum type, const char* source, const char* defines)
+{
+    const char* body = source;
+    if (!strncmp(source, "#version", 8)) {
+        body = strchr(source, '\n');
+        body = body ? body + 1 : source + strlen(source);
+    }
+
+    const GLchar* strings[] = { source, defines ? defines : "", body };
+    GLint lengths[] = { GLint(body - source), -1, -1 };
+
+    GLuint handle = glCreateShader(type);
+    glShaderSource(handle, 3, strings, lengths);
+    glCompileShader(handle);
+    return handle;
+}
+
+// Starts compiling and linking a program without waiting on the driver.  Returns
+// false if a section is missing, which is fatal unless the caller is reloading.
+static bool StartProgram(const char* vsKey, const char* gsKey, const char* fsKey, const char* defines,
+                         bool fatal, PendingProgram* program)
 {
     const char* vsSource = pezGetShader(vsKey);
     const char* gsSource = pezGetShader(gsKey);
     const char* fsSource = pezGetShader(fsKey);
 
     const char* msg = "Can't find %s shader: '%s'.\n";
-    pezCheck(vsSource != 0, msg, "vertex", vsKey);
-    pezCheck(gsKey == 0 || gsSource != 0, msg, "geometry", gsKey);
-    pezCheck(fsKey == 0 || fsSource != 0, msg, "fragment", fsKey);
-    
-    GLint compileSuccess;
-    GLchar compilerSpew[256];
-    GLuint programHandle = glCreateProgram();
-
-    GLuint vsHandle = glCreateShader(GL_VERTEX_SHADER);
-    glShaderSource(vsHandle, 1, &vsSource, 0);
-    glCompileShader(vsHandle);
-    glGetShaderiv(vsHandle, GL_COMPILE_STATUS, &compileSuccess);
-    glGetShaderInfoLog(vsHandle, sizeof(compilerSpew), 0, compilerSpew);
-    pezCheck(compileSuccess, "Can't compile %s:\n%s", vsKey, compilerSpew);
-    glAttachShader(programHandle, vsHandle);
-
-    GLuint gsHandle;
-    if (gsKey) {
-        gsHandle = glCreateShader(GL_GEOMETRY_SHADER);
-        glShaderSource(gsHandle, 1, &gsSource, 0);
-        glCompileShader(gsHandle);
-        glGetShaderiv(gsHandle, GL_COMPILE_STATUS, &compileSuccess);
-        glGetShaderInfoLog(gsHandle, sizeof(compilerSpew), 0, compilerSpew);
-        pezCheck(compileSuccess, "Can't compile %s:\n%s", gsKey, compilerSpew);
-        glAttachShader(programHandle, gsHandle);
+    bool found = vsSource && (gsKey == 0 || gsSource) && (fsKey == 0 || fsSource);
+    if (fatal) {
+        pezCheck(vsSource != 0, msg, "vertex", vsKey);
+        pezCheck(gsKey == 0 || gsSource != 0, msg, "geometry", gsKey);
+        pezCheck(fsKey == 0 || fsSource != 0, msg, "fragment", fsKey);
+    } else if (!found) {
+        pezPrintString("%s\n", pezSwGetError());
+        return false;
     }
     
-    GLuint fsHandle;
-    if (fsKey) {
-        fsHandle = glCreateShader(GL_FRAGMENT_SHADER);
-        glShaderSource(fsHandle, 1, &fsSource, 0);
-        glCompileShader(fsHandle);
-        glGetShaderiv(fsHandle, GL_COMPILE_STATUS, &compileSuccess);
-        glGetShaderInfoLog(fsHandle, sizeof(compilerSpew), 0, compilerSpew);
-        pezCheck(compileSuccess, "Can't compile %s:\n%s", fsKey, compilerSpew);
-        glAttachShader(programHandle, fsHandle);
-    }
-
-    glBindAttribLocation(programHandle, SlotPosition, "Position");
-    glBindAttribLocation(programHandle, SlotTexCoord, "TexCoord");
-    glLinkProgram(programHandle);
-    
-    GLint linkSuccess;
-    glGetProgramiv(programHandle, GL_LINK_STATUS, &linkSuccess);
-    glGetProgramInfoLog(programHandle, sizeof(compilerSpew), 0, compilerSpew);
+    program->Handle = glCreateProgram();
+    program->Keys[0] = vsKey;
+    program->Keys[1] = gsKey;
+    program->Keys[2] = fsKey;
+    program->Shaders[0] = program->Shaders[1] = program->Shaders[2] = 0;
+    program->CachePath.clear();
+
+    if (ProgramBinariesSupported()) {
+        program->CachePath = ProgramCachePath(vsSource, gsKey ? gsSource : 0, fsKey ? fsSource : 0, defines);
+        if (LoadCachedProgram(program->Handle, program->CachePath)) {
+            program->CachePath.clear();
+            return true;
+        }
+        glProgramParameteri(program->Handle, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+    }
 
-    if (!linkSuccess) {
-        pezPrintString("Link error.\n");
-        if (vsKey) pezPrintString("Vertex Shader: %s\n", vsKey);
-        if (gsKey) pezPrintString("Geometry Shader: %s\n", gsKey);
-        if (fsKey) pezPrintString("Fragment Shader: %s\n", fsKey);
-        pezPrintString("%s\n", compilerSpew);
+    program->Shaders[0] = SubmitShader(GL_VERTEX_SHADER, vsSource, defines);
+    program->Shaders[1] = gsKey ? SubmitShader(GL_GEOMETRY_SHADER, gsSource, defines) : 0;
+    program->Shaders[2] = fsKey ? SubmitShader(GL_FRAGMENT_SHADER, fsSource, defines) : 0;
+    for (int stage = 0; stage < 3; ++stage) {
+        if (program->Shaders[stage]) {
+            glAttachShader(program->Handle, program->Shaders[stage]);
+        }
     }
-    
+
+    glBindAttribLocation(program->Handle, SlotPosition, "Position");
+    glBindAttribLocation(program->Handle, SlotTexCoord, "TexCoord");
+    glLinkProgram(program->Handle);
+    return true;
+}
+
+GLuint SubmitProgram(const char* vsKey, const char* gsKey, const char* fsKey, const char* defines)
+{
+    PendingProgram program;
+    StartProgram(vsKey, gsKey, fsKey, defines, true, &program);
+    if (program.Shaders[0]) {
+        PendingPrograms.push_back(program);
+    }
+    return program.Handle;
+}
+
+GLuint LoadProgram(const char* vsKey, const char* gsKey, const char* fsKey)
+{
+    GLuint programHandle = SubmitProgram(vsKey, gsKey, fsKey);
+    FinishPrograms();
     return programHandle;
 }
 
+void WatchProgram(GLuint* program, ProgramOwner owner, const char* vsKey, const char* gsKey, const char* fsKey,
+                  const char* defines)
+{
+    WatchedProgram watched;
+    watched.Handle = program;
+    watched.Owner = owner;
+    watched.Keys[0] = vsKey;
+    watched.Keys[1] = gsKey;
+    watched.Keys[2] = fsKey;
+    watched.Defines = defines ? defines : "";
+    watched.Layered = false;
+    watched.Reloading = false;
+    watched.Adopt = 0;
+    watched.AdoptFence = 0;
+    WatchedPrograms.push_back(watched);
+}
+
+static bool VertexLayerSupported()
+{
+    static int supported = -1;
+    if (supported >= 0) {
+        return supported;
+    }
+
+    GLint extensionCount = 0;
+    glGetIntegerv(GL_NUM_EXTENSIONS, &extensionCount);
+    supported = 0;
+    for (GLint i = 0; i < extensionCount && !supported; ++i) {
+        const char* name = (const char*) glGetStringi(GL_EXTENSIONS, i);
+        supported = name && (!strcmp(name, "GL_ARB_shader_viewport_layer_array") ||
+                             !strcmp(name, "GL_AMD_vertex_shader_layer"));
+    }
+    return supported;
+}
+
+// Drops the geometry shader of a layered program when its vertex shader can pick the layer.
+static void ApplyLayerPath(const char** gsKey, std::string* defines)
+{
+    if (VertexLayer < 0) {
+        VertexLayer = VertexLayerSupported();
+    }
+    if (VertexLayer) {
+        *gsKey = 0;
+        defines->insert(0, "#define VertexLayer\n");
+    }
+}
+
+GLuint SubmitLayeredProgram(const char* vsKey, const char* gsKey, const char* fsKey, const char* defines)
+{
+    std::string layerDefines = defines ? defines : "";
+    ApplyLayerPath(&gsKey, &layerDefines);
+    return SubmitProgram(vsKey, gsKey, fsKey, layerDefines.empty() ? 0 : layerDefines.c_str());
+}
+
+void WatchLayeredProgram(GLuint* program, ProgramOwner owner, const char* vsKey, const char* gsKey, const char* fsKey,
+                         const char* defines)
+{
+    WatchProgram(program, owner, vsKey, gsKey, fsKey, defines);
+    WatchedPrograms.back().Layered = true;
+}
+
+bool VertexLayerActive()
+{
+    return VertexLayer > 0;
+}
+
+// Rebuilds every watched layered program for the requested path, on the thread that uses
+// them.  The new ones are usable once FinishPrograms has run.
+bool SetVertexLayer(bool enable)
+{
+    if (enable && !VertexLayerSupported()) {
+        return false;
+    }
+    if (VertexLayer == int(enable)) {
+        return true;
+    }
+    VertexLayer = enable;
+    for (size_t i = 0; i < WatchedPrograms.size(); ++i) {
+        WatchedProgram& watched = WatchedPrograms[i];
+        if (watched.Layered) {
+            if (watched.Reloading) {
+                FinishProgram(watched.Reload, false);
+                glDeleteProgram(watched.Reload.Handle);
+                watched.Reloading = false;
+            }
+            glDeleteProgram(*watched.Handle);
+            *watched.Handle = SubmitLayeredProgram(watched.Keys[0], watched.Keys[1], watched.Keys[2],
+                                                   watched.Defines.empty() ? 0 : watched.Defines.c_str());
+        }
+    }
+    return true;
+}
+
+static bool UsesEffect(const WatchedProgram& watched, const char* effect)
+{
+    size_t length = strlen(effect);
+    for (int stage = 0; stage < 3; ++stage) {
+        const char* key = watched.Keys[stage];
+        if (key && !strncmp(key, effect, length) && key[length] == '.') {
+            return true;
+        }
+    }
+    return false;
+}
+
+void PollProgramReloads()
+{
+    while (const char* effect = pezPollShaderChange()) {
+        pezPrintString("Reloading %s\n", effect);
+        for (size_t i = 0; i < WatchedPrograms.size(); ++i) {
+            WatchedProgram& watched = WatchedPrograms[i];
+            if (!UsesEffect(watched, effect)) {
+                continue;
+            }
+
+            // A newer edit supersedes a rebuild that is still in flight.
+            if (watched.Reloading) {
+                FinishProgram(watched.Reload, false);
+                glDeleteProgram(watched.Reload.Handle);
+            }
+            const char* gsKey = watched.Keys[1];
+            std::string defines = watched.Defines;
+            if (watched.Layered) {
+                ApplyLayerPath(&gsKey, &defines);
+            }
+            watched.Reloading = StartProgram(watched.Keys[0], gsKey, watched.Keys[2],
+                                             defines.empty() ? 0 : defines.c_str(), false, &watched.Reload);
+        }
+    }
+
+    // Swap in finished rebuilds; a program that fails to build leaves the old one running.
+    for (size_t i = 0; i < WatchedPrograms.size(); ++i) {
+        WatchedProgram& watched = WatchedPrograms[i];
+        if (!watched.Reloading || !ProgramCompleted(watched.Reload)) {
+            continue;
+        }
+        watched.Reloading = false;
+        if (!FinishProgram(watched.Reload, false)) {
+            glDeleteProgram(watched.Reload.Handle);
+        } else if (watched.Owner == OwnerRenderer) {
+            glDeleteProgram(*watched.Handle);
+            *watched.Handle = watched.Reload.Handle;
+        } else {
+            // Replace a rebuild that the simulation thread hasn't taken yet, so only the newest is handed over.
+            GLsync fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+            glFlush();
+            std::lock_guard<std::mutex> lock(AdoptMutex);
+            if (watched.Adopt) {
+                glDeleteProgram(watched.Adopt);
+                glDeleteSync(watched.AdoptFence);
+            }
+            watched.Adopt = watched.Reload.Handle;
+            watched.AdoptFence = fence;
+        }
+    }
+}
+
+void AdoptProgramReloads()
+{
+    std::lock_guard<std::mutex> lock(AdoptMutex);
+    for (size_t i = 0; i < WatchedPrograms.size(); ++i) {
+        WatchedProgram& watched = WatchedPrograms[i];
+        if (!watched.Adopt) {
+            continue;
+        }
+        glWaitSync(watched.AdoptFence, 0, GL_TIMEOUT_IGNORED);
+        glDeleteSync(watched.AdoptFence);
+        glDeleteProgram(*watched.Handle);
+        *watched.Handle = watched.Adopt;
+        watched.Adopt = 0;
+        watched.AdoptFence = 0;
+    }
+}
+
 SlabPod CreateSlab(GLsizei width, GLsizei height, GLsizei depth, int numComponents)
 {
     SlabPod slab;
@@ -184,6 +699,410 @@ SlabPod CreateSlab(GLsizei width, GLsizei height, GLsizei depth, int numComponen
     return slab;
 }
 
+// Estimates the size of the bound texture's base level from its dimensions and channel depths.
+static size_t LevelBytes(GLenum target)
+{
+    static const GLenum channelSizes[] = {
+        GL_TEXTURE_RED_SIZE, GL_TEXTURE_GREEN_SIZE, GL_TEXTURE_BLUE_SIZE, GL_TEXTURE_ALPHA_SIZE
+    };
+    GLint width, height, depth, bits = 0;
+    glGetTexLevelParameteriv(target, 0, GL_TEXTURE_WIDTH, &width);
+    glGetTexLevelParameteriv(target, 0, GL_TEXTURE_HEIGHT, &height);
+    glGetTexLevelParameteriv(target, 0, GL_TEXTURE_DEPTH, &depth);
+    for (int i = 0; i < 4; ++i) {
+        GLint size;
+        glGetTexLevelParameteriv(target, 0, channelSizes[i], &size);
+        bits += size;
+    }
+    return size_t(width) * height * depth * bits / 8;
+}
+
+// Counts the textures made by CreateSurface and CreateVolume that haven't been destroyed.
+size_t AllocatedTextureBytes()
+{
+    return TextureBytes;
+}
+
+void DestroySurface(SurfacePod surface)
+{
+    GLenum target = surface.Depth > 1 ? GL_TEXTURE_3D : GL_TEXTURE_2D;
+    glBindTexture(target, surface.ColorTexture);
+    TextureBytes -= LevelBytes(target);
+    glBindTexture(target, 0);
+
+    glDeleteFramebuffers(1, &surface.FboHandle);
+    glDeleteTextures(1, &surface.ColorTexture);
+}
+
+void DestroySlab(SlabPod slab)
+{
+    DestroySurface(slab.Ping);
+    DestroySurface(slab.Pong);
+}
+
+FluidPod CreateFluid(GLsizei width, GLsizei height, GLsizei depth)
+{
+    FluidPod fluid;
+    fluid.Velocity = CreateSlab(width, height, depth, 3);
+    fluid.Density = CreateSlab(width, height, depth, 1);
+    fluid.Pressure = CreateSlab(width, height, depth, 1);
+    fluid.Temperature = CreateSlab(width, height, depth, 1);
+    fluid.Divergence = CreateVolume(width, height, depth, 3);
+    fluid.Obstacles = CreateVolume(width, height, depth, 3);
+    CreateObstacles(fluid.Obstacles);
+    ClearSurface(fluid.Temperature.Ping, AmbientTemperature);
+    fluid.Time = 0;
+    BoundFluid(&fluid, false);
+    return fluid;
+}
+
+void DestroyFluid(FluidPod fluid)
+{
+    DestroySlab(fluid.Velocity);
+    DestroySlab(fluid.Density);
+    DestroySlab(fluid.Pressure);
+    DestroySlab(fluid.Temperature);
+    DestroySurface(fluid.Divergence);
+    DestroySurface(fluid.Obstacles);
+}
+
+void ResetFluid(FluidPod* fluid)
+{
+    ClearSurface(fluid->Velocity.Ping, 0);
+    ClearSurface(fluid->Velocity.Pong, 0);
+    ClearSurface(fluid->Density.Ping, 0);
+    ClearSurface(fluid->Density.Pong, 0);
+    ClearSurface(fluid->Pressure.Ping, 0);
+    ClearSurface(fluid->Pressure.Pong, 0);
+    ClearSurface(fluid->Temperature.Ping, AmbientTemperature);
+    ClearSurface(fluid->Temperature.Pong, AmbientTemperature);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    fluid->Time = 0;
+}
+
+// Pass timings are per context, so this must be called on the thread that steps the fluid.
+void EnablePassTimings(bool enable)
+{
+    if (enable && !PassTimer.Queries[0][0]) {
+        glGenQueries(TimerSets * (PassCount + 1), &PassTimer.Queries[0][0]);
+    }
+    if (!enable) {
+        for (int set = 0; set < TimerSets; ++set) {
+            PassTimer.Issued[set] = false;
+        }
+        std::lock_guard<std::mutex> lock(PassTimer.Mutex);
+        PassTimer.Valid = false;
+    }
+    PassTimer.Enabled = enable;
+}
+
+// Copies out the GPU milliseconds of each SolverPass from a recent step; returns false
+// until a step has been timed.
+bool ReadPassTimings(float* milliseconds)
+{
+    std::lock_guard<std::mutex> lock(PassTimer.Mutex);
+    if (PassTimer.Valid) {
+        memcpy(milliseconds, PassTimer.Milliseconds, sizeof(PassTimer.Milliseconds));
+    }
+    return PassTimer.Valid;
+}
+
+// Stamp 0 marks the start of a step and stamp i + 1 the end of pass i.
+static void StampPass(int stamp)
+{
+    if (PassTimer.Enabled) {
+        glQueryCounter(PassTimer.Queries[PassTimer.Current][stamp], GL_TIMESTAMP);
+    }
+}
+
+static void FinishPassTimings()
+{
+    if (!PassTimer.Enabled) {
+        return;
+    }
+    PassTimer.Issued[PassTimer.Current] = true;
+    PassTimer.Current = (PassTimer.Current + 1) % TimerSets;
+
+    // The oldest set is about to be reused, so collect it now; by this point it has
+    // almost always landed and the read doesn't wait.
+    int set = PassTimer.Current;
+    if (!PassTimer.Issued[set]) {
+        return;
+    }
+    GLuint64 stamps[PassCount + 1];
+    for (int i = 0; i <= PassCount; ++i) {
+        glGetQueryObjectui64v(PassTimer.Queries[set][i], GL_QUERY_RESULT, &stamps[i]);
+    }
+    PassTimer.Issued[set] = false;
+
+    std::lock_guard<std::mutex> lock(PassTimer.Mutex);
+    for (int pass = 0; pass < PassCount; ++pass) {
+        PassTimer.Milliseconds[pass] = float(stamps[pass + 1] - stamps[pass]) * 1e-6f;
+    }
+    PassTimer.Valid = true;
+}
+
+// Draws the layers of dest, or only the active boxes while StepFluid has set SlabBounds.
+// Each box is one draw, scissored to its rectangle and instanced over its layers.
+static void DrawSlab(SurfacePod dest)
+{
+    if (!SlabBounds) {
+        SetUniform("LayerOffset", 0);
+        glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, dest.Depth);
+        return;
+    }
+
+    glEnable(GL_SCISSOR_TEST);
+    int memberCount = dest.Depth / GridDepth;
+    for (int member = 0; member < memberCount; ++member) {
+        const ActiveBox& box = SlabBounds[member];
+        if (box.Max[0] <= box.Min[0] || box.Max[1] <= box.Min[1] || box.Max[2] <= box.Min[2]) {
+            continue;
+        }
+        glScissor(box.Min[0], box.Min[1], box.Max[0] - box.Min[0], box.Max[1] - box.Min[1]);
+        SetUniform("LayerOffset", box.Min[2]);
+        glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, box.Max[2] - box.Min[2]);
+    }
+    glDisable(GL_SCISSOR_TEST);
+}
+
+// Resets every member's box to the whole member, so that nothing is skipped until the
+// next measurement arrives.  Measurements still in flight are delivered first, so that
+// they can't overwrite the reset.
+void BoundFluid(FluidPod* fluid, bool bounded)
+{
+    FlushReduce();
+    fluid->Bounded = bounded;
+    fluid->Shrunk = false;
+    SurfacePod extent = fluid->Density.Ping;
+    for (int member = 0; member < MaxEnsembleSize; ++member) {
+        ActiveBox box = { { 0, 0, member * GridDepth }, { extent.Width, extent.Height, (member + 1) * GridDepth } };
+        fluid->Active[member] = box;
+    }
+}
+
+float ActiveFraction(const FluidPod& fluid)
+{
+    SurfacePod extent = fluid.Density.Ping;
+    int memberCount = extent.Depth / GridDepth;
+    double cells = 0;
+    for (int member = 0; member < memberCount; ++member) {
+        const ActiveBox& box = fluid.Active[member];
+        cells += double(box.Max[0] - box.Min[0]) * (box.Max[1] - box.Min[1]) * (box.Max[2] - box.Min[2]);
+    }
+    return float(cells / (double(extent.Width) * extent.Height * extent.Depth));
+}
+
+static void ReceiveActiveBoxes(const ReduceResult& result, void* userData)
+{
+    FluidPod* fluid = (FluidPod*) userData;
+    double issued = BoundsIssueTimes.front();
+    BoundsIssueTimes.pop_front();
+    if (!fluid->Bounded) {
+        return;
+    }
+
+    // This box is first used by the next step, so the smoke moves for one more step
+    // than the steps that have run since the measurement.
+    int lagSteps = int(lround((fluid->Time - issued) / TimeStep)) + 1;
+    SurfacePod extent = fluid->Density.Ping;
+    for (int member = 0; member < result.Groups; ++member) {
+        ActiveBox& box = fluid->Active[member];
+        float speed = std::max(result.Max[member][3], 0.0f);
+        int margin = BoundsSlack + int(ceilf(speed * TimeStep * lagSteps));
+        int limits[3] = { extent.Width, extent.Height, GridDepth };
+
+        // The emitters are always part of the box, since they inject every step.  A member
+        // with neither emitters nor active cells has nothing to step, so its box is empty.
+        int emitterMin[3], emitterMax[3];
+        bool emitting = EmitterBounds(member, emitterMin, emitterMax);
+        bool measured = result.Min[member][0] <= result.Max[member][0];
+        if (!emitting && !measured) {
+            for (int axis = 0; axis < 3; ++axis) {
+                int base = axis == 2 ? member * GridDepth : 0;
+                fluid->Shrunk = fluid->Shrunk || box.Max[axis] > box.Min[axis];
+                box.Min[axis] = box.Max[axis] = base;
+            }
+            continue;
+        }
+
+        for (int axis = 0; axis < 3; ++axis) {
+            int base = axis == 2 ? member * GridDepth : 0;
+            int lo = emitterMin[axis];
+            int hi = emitterMax[axis];
+            float measuredMin = result.Min[member][axis] - base;
+            float measuredMax = result.Max[member][axis] - base;
+            if (measuredMin <= measuredMax) {
+                lo = std::min(lo, int(measuredMin));
+                hi = std::max(hi, int(measuredMax) + 1);
+            }
+            // Emitters can sit partly or wholly outside the grid, which mustn't invert the box.
+            lo = base + std::min(std::max(lo - margin, 0), limits[axis]);
+            hi = std::max(lo, base + std::min(hi + margin, limits[axis]));
+
+            if (lo > box.Min[axis] && lo - box.Min[axis] < ShrinkSlack) {
+                lo = box.Min[axis];
+            }
+            if (hi < box.Max[axis] && box.Max[axis] - hi < ShrinkSlack) {
+                hi = box.Max[axis];
+            }
+            fluid->Shrunk = fluid->Shrunk || lo > box.Min[axis] || hi < box.Max[axis];
+            box.Min[axis] = lo;
+            box.Max[axis] = hi;
+        }
+    }
+}
+
+// Measures the extent of the active cells of every member.  The result arrives a step
+// or so later through PollReduce.
+static void MeasureActiveBoxes(FluidPod* fluid)
+{
+    ReduceInput inputs[4] = {
+        { fluid->Density.Ping, ReduceCellX },
+        { fluid->Density.Ping, ReduceCellY },
+        { fluid->Density.Ping, ReduceCellZ },
+        { fluid->Velocity.Ping, ReduceLength },
+    };
+    ReduceMask masks[3] = {
+        { fluid->Density.Ping, ReduceX, ActiveThreshold },
+        { fluid->Temperature.Ping, ReduceX, ActiveThreshold },
+        { fluid->Velocity.Ping, ReduceLength, ActiveThreshold },
+    };
+    BoundsIssueTimes.push_back(fluid->Time);
+    BeginReduce(inputs, 4, fluid->Density.Ping.Depth / GridDepth, ReceiveActiveBoxes, fluid, masks, 3);
+}
+
+// Sets every cell outside the active boxes back to its ambient value, in every field
+// that the slab ops read.
+static void ClearOutside(const FluidPod& fluid)
+{
+    int memberCount = fluid.Density.Ping.Depth / GridDepth;
+    GLint boxMin[MaxEnsembleSize * 3], boxMax[MaxEnsembleSize * 3];
+    for (int member = 0; member < memberCount; ++member) {
+        for (int axis = 0; axis < 3; ++axis) {
+            boxMin[member * 3 + axis] = fluid.Active[member].Min[axis];
+            boxMax[member * 3 + axis] = fluid.Active[member].Max[axis];
+        }
+    }
+
+    glUseProgram(Programs.ClearOutside);
+    glUniform3iv(glGetUniformLocation(Programs.ClearOutside, "BoxMin"), memberCount, boxMin);
+    glUniform3iv(glGetUniformLocation(Programs.ClearOutside, "BoxMax"), memberCount, boxMax);
+
+    // Pressure.Ping is cleared whole every step, but the Jacobi passes read Pong as well.
+    const SurfacePod surfaces[] = {
+        fluid.Velocity.Ping, fluid.Velocity.Pong, fluid.Density.Ping, fluid.Density.Pong,
+        fluid.Divergence, fluid.Pressure.Pong, fluid.Temperature.Ping, fluid.Temperature.Pong,
+    };
+    for (int i = 0; i < 8; ++i) {
+        float value = i >= 6 ? AmbientTemperature : 0;
+        SetUniform("Value", Vector4(value));
+        glBindFramebuffer(GL_FRAMEBUFFER, surfaces[i].FboHandle);
+        DrawSlab(surfaces[i]);
+    }
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+// Expects a vertex array with the fullscreen quad to be bound.
+void StepFluid(FluidPod* fluid)
+{
+    glViewport(0, 0, fluid->Velocity.Ping.Width, fluid->Velocity.Ping.Height);
+    if (fluid->Shrunk) {
+        ClearOutside(*fluid);
+        fluid->Shrunk = false;
+    }
+    SlabBounds = fluid->Bounded ? fluid->Active : 0;
+    StampPass(0);
+    Advect(fluid->Velocity.Ping, fluid->Velocity.Ping, fluid->Obstacles, fluid->Velocity.Pong, &MemberParams::VelocityDissipation);
+    SwapSurfaces(&fluid->Velocity);
+    Advect(fluid->Velocity.Ping, fluid->Temperature.Ping, fluid->Obstacles, fluid->Temperature.Pong, &MemberParams::TemperatureDissipation);
+    SwapSurfaces(&fluid->Temperature);
+    Advect(fluid->Velocity.Ping, fluid->Density.Ping, fluid->Obstacles, fluid->Density.Pong, &MemberParams::DensityDissipation);
+    SwapSurfaces(&fluid->Density);
+    StampPass(1 + PassAdvect);
+    ApplyBuoyancy(fluid->Velocity.Ping, fluid->Temperature.Ping, fluid->Density.Ping, fluid->Velocity.Pong);
+    SwapSurfaces(&fluid->Velocity);
+    StampPass(1 + PassBuoyancy);
+    InjectEmitters(fluid->Density.Ping, fluid->Temperature.Ping, fluid->Velocity.Ping);
+    StampPass(1 + PassImpulse);
+    ComputeDivergence(fluid->Velocity.Ping, fluid->Obstacles, fluid->Divergence);
+    StampPass(1 + PassDivergence);
+    ClearSurface(fluid->Pressure.Ping, 0);
+    for (int i = 0; i < NumJacobiIterations; ++i) {
+        Jacobi(fluid->Pressure.Ping, fluid->Divergence, fluid->Obstacles, fluid->Pressure.Pong);
+        SwapSurfaces(&fluid->Pressure);
+    }
+    StampPass(1 + PassJacobi);
+    SubtractGradient(fluid->Velocity.Ping, fluid->Pressure.Ping, fluid->Obstacles, fluid->Velocity.Pong);
+    SwapSurfaces(&fluid->Velocity);
+    StampPass(1 + PassGradient);
+    FinishPassTimings();
+    SlabBounds = 0;
+    fluid->Time += TimeStep;
+
+    if (fluid->Bounded) {
+        MeasureActiveBoxes(fluid);
+    }
+}
+
+// Steps the whole grid with the layer picked by the geometry shader and then by the vertex
+// shader, and prints the mean GPU time of each pass for both.  Expects the slab ops to
+// have been initialized.
+void BenchmarkLayers(int steps)
+{
+    const int WarmupSteps = 20;
+    GLuint vao;
+    glGenVertexArrays(1, &vao);
+    glBindVertexArray(vao);
+    GLuint vbo = CreateQuadVbo();
+    glEnableVertexAttribArray(SlotPosition);
+    glVertexAttribPointer(SlotPosition, 2, GL_SHORT, GL_FALSE, 2 * sizeof(short), 0);
+    glDisable(GL_DEPTH_TEST);
+    glDisable(GL_CULL_FACE);
+
+    FluidPod fluid = CreateFluid(GridWidth, GridHeight, GridDepth * EnsembleSize);
+    double totals[2][PassCount] = {};
+    int samples[2] = {};
+    for (int path = 0; path < 2; ++path) {
+        if (!SetVertexLayer(path == 1)) {
+            pezPrintString("Neither GL_ARB_shader_viewport_layer_array nor GL_AMD_vertex_shader_layer is supported\n");
+            break;
+        }
+        FinishPrograms();
+        ResetFluid(&fluid);
+        EnablePassTimings(true);
+        for (int step = 0; step < WarmupSteps + steps; ++step) {
+            StepFluid(&fluid);
+            float milliseconds[PassCount];
+            if (step >= WarmupSteps && ReadPassTimings(milliseconds)) {
+                for (int pass = 0; pass < PassCount; ++pass) {
+                    totals[path][pass] += milliseconds[pass];
+                }
+                ++samples[path];
+            }
+        }
+        EnablePassTimings(false);
+    }
+
+    pezPrintString("Stepping %dx%dx%d, mean GPU ms per pass over %d steps\n",
+                   GridWidth, GridHeight, GridDepth * EnsembleSize, steps);
+    pezPrintString("  %-10s %10s %10s\n", "pass", "geometry", "vertex");
+    double sums[2] = {};
+    for (int pass = 0; pass < PassCount; ++pass) {
+        double means[2];
+        for (int path = 0; path < 2; ++path) {
+            means[path] = samples[path] ? totals[path][pass] / samples[path] : 0;
+            sums[path] += means[path];
+        }
+        pezPrintString("  %-10s %10.3f %10.3f\n", SolverPassNames[pass], means[0], means[1]);
+    }
+    pezPrintString("  %-10s %10.3f %10.3f\n", "total", sums[0], sums[1]);
+
+    DestroyFluid(fluid);
+    glDeleteBuffers(1, &vbo);
+    glDeleteVertexArrays(1, &vao);
+}
+
 SurfacePod CreateSurface(GLsizei width, GLsizei height, int numComponents)
 {
     GLuint fboHandle;
@@ -214,6 +1133,7 @@ SurfacePod CreateSurface(GLsizei width, GLsizei height, int numComponents)
     }
 
     pezCheck(GL_NO_ERROR == glGetError(), "Unable to create normals texture");
+    TextureBytes += LevelBytes(GL_TEXTURE_2D);
 
     GLuint colorbuffer;
     glGenRenderbuffers(1, &colorbuffer);
@@ -264,6 +1184,7 @@ SurfacePod CreateVolume(GLsizei width, GLsizei height, GLsizei depth, int numCom
     }
 
     pezCheck(GL_NO_ERROR == glGetError(), "Unable to create volume texture");
+    TextureBytes += LevelBytes(GL_TEXTURE_3D);
 
     GLuint colorbuffer;
     glGenRenderbuffers(1, &colorbuffer);
@@ -292,14 +1213,59 @@ static void ResetState()
     glDisable(GL_BLEND);
 }
 
+static void DefineFloat(std::string* defines, const char* name, float value)
+{
+    char line[128];
+    sprintf(line, "#define %s float(%.9g)\n", name, value);
+    *defines += line;
+}
+
+// Run-constant parameters are compiled into the slab kernels instead of being
+// uploaded as uniforms, so the compiler can fold them into the stencil weights.
+// Fluid.glsl falls back to uniforms for any name that isn't defined here.
+static const char* SlabDefines()
+{
+    static std::string defines;
+    if (defines.empty()) {
+        DefineFloat(&defines, "TimeStep", TimeStep);
+        DefineFloat(&defines, "MemberDepth", float(GridDepth));
+        DefineFloat(&defines, "AmbientTemperature", AmbientTemperature);
+        DefineFloat(&defines, "Alpha", -CellSize * CellSize);
+        DefineFloat(&defines, "InverseBeta", 0.1666f);
+        DefineFloat(&defines, "GradientScale", GradientScale);
+        DefineFloat(&defines, "HalfInverseCellSize", 0.5f / CellSize);
+    }
+    return defines.c_str();
+}
+
 void InitSlabOps()
 {
-    Programs.Advect = LoadProgram("Fluid.Vertex", "Fluid.PickLayer", "Fluid.Advect");
-    Programs.Jacobi = LoadProgram("Fluid.Vertex", "Fluid.PickLayer", "Fluid.Jacobi");
-    Programs.SubtractGradient = LoadProgram("Fluid.Vertex", "Fluid.PickLayer", "Fluid.SubtractGradient");
-    Programs.ComputeDivergence = LoadProgram("Fluid.Vertex", "Fluid.PickLayer", "Fluid.ComputeDivergence");
-    Programs.ApplyImpulse = LoadProgram("Fluid.Vertex", "Fluid.PickLayer", "Fluid.Splat");
-    Programs.ApplyBuoyancy = LoadProgram("Fluid.Vertex", "Fluid.PickLayer", "Fluid.Buoyancy");
+    // Must precede the first load of the Fluid effect, since directives are applied while parsing.
+    char directive[64];
+    sprintf(directive, "#define MaxEnsembleSize %d", MaxEnsembleSize);
+    pezSwAddDirective("Fluid", directive);
+    InitMembers();
+
+    // The programs are usable right away; errors surface at the caller's FinishPrograms.
+    const char* defines = SlabDefines();
+    Programs.Advect = SubmitLayeredProgram("Fluid.Vertex", "Fluid.PickLayer", "Fluid.Advect", defines);
+    Programs.Jacobi = SubmitLayeredProgram("Fluid.Vertex", "Fluid.PickLayer", "Fluid.Jacobi", defines);
+    Programs.SubtractGradient = SubmitLayeredProgram("Fluid.Vertex", "Fluid.PickLayer", "Fluid.SubtractGradient", defines);
+    Programs.ComputeDivergence = SubmitLayeredProgram("Fluid.Vertex", "Fluid.PickLayer", "Fluid.ComputeDivergence", defines);
+    Programs.Inject = SubmitLayeredProgram("Fluid.EmitterVertex", "Fluid.EmitterLayer", "Fluid.Inject", defines);
+    Programs.ApplyBuoyancy = SubmitLayeredProgram("Fluid.Vertex", "Fluid.PickLayer", "Fluid.Buoyancy", defines);
+    Programs.Residual = SubmitLayeredProgram("Fluid.Vertex", "Fluid.PickLayer", "Fluid.Residual", defines);
+    Programs.ClearOutside = SubmitLayeredProgram("Fluid.Vertex", "Fluid.PickLayer", "Fluid.ClearOutside", defines);
+    Programs.Fill = SubmitProgram("Fluid.Vertex", 0, "Fluid.Fill");
+
+    WatchLayeredProgram(&Programs.Advect, OwnerSimulation, "Fluid.Vertex", "Fluid.PickLayer", "Fluid.Advect", defines);
+    WatchLayeredProgram(&Programs.Jacobi, OwnerSimulation, "Fluid.Vertex", "Fluid.PickLayer", "Fluid.Jacobi", defines);
+    WatchLayeredProgram(&Programs.SubtractGradient, OwnerSimulation, "Fluid.Vertex", "Fluid.PickLayer", "Fluid.SubtractGradient", defines);
+    WatchLayeredProgram(&Programs.ComputeDivergence, OwnerSimulation, "Fluid.Vertex", "Fluid.PickLayer", "Fluid.ComputeDivergence", defines);
+    WatchLayeredProgram(&Programs.Inject, OwnerSimulation, "Fluid.EmitterVertex", "Fluid.EmitterLayer", "Fluid.Inject", defines);
+    WatchLayeredProgram(&Programs.ApplyBuoyancy, OwnerSimulation, "Fluid.Vertex", "Fluid.PickLayer", "Fluid.Buoyancy", defines);
+    WatchLayeredProgram(&Programs.Residual, OwnerSimulation, "Fluid.Vertex", "Fluid.PickLayer", "Fluid.Residual", defines);
+    WatchLayeredProgram(&Programs.ClearOutside, OwnerSimulation, "Fluid.Vertex", "Fluid.PickLayer", "Fluid.ClearOutside", defines);
 }
 
 void SwapSurfaces(SlabPod* slab)
@@ -316,13 +1282,17 @@ void ClearSurface(SurfacePod s, float v)
     glClear(GL_COLOR_BUFFER_BIT);
 }
 
-void Advect(SurfacePod velocity, SurfacePod source, SurfacePod obstacles, SurfacePod dest, float dissipation)
+void Advect(SurfacePod velocity, SurfacePod source, SurfacePod obstacles, SurfacePod dest, float MemberParams::* dissipation)
 {
     glUseProgram(Programs.Advect);
 
-    SetUniform("InverseSize", recipPerElem(Vector3(float(GridWidth), float(GridHeight), float(GridDepth))));
-    SetUniform("TimeStep", TimeStep);
-    SetUniform("Dissipation", dissipation);
+    float values[MaxEnsembleSize];
+    for (int i = 0; i < EnsembleSize; ++i) {
+        values[i] = Members[i].*dissipation;
+    }
+
+    SetUniform("InverseSize", recipPerElem(Vector3(float(dest.Width), float(dest.Height), float(dest.Depth))));
+    SetUniform("Dissipation", values, EnsembleSize);
     SetUniform("SourceTexture", 1);
     SetUniform("Obstacles", 2);
 
@@ -333,7 +1303,7 @@ void Advect(SurfacePod velocity, SurfacePod source, SurfacePod obstacles, Surfac
     glBindTexture(GL_TEXTURE_3D, source.ColorTexture);
     glActiveTexture(GL_TEXTURE2);
     glBindTexture(GL_TEXTURE_3D, obstacles.ColorTexture);
-    glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, dest.Depth);
+    DrawSlab(dest);
 
     ResetState();
 }
@@ -342,8 +1312,6 @@ void Jacobi(SurfacePod pressure, SurfacePod divergence, SurfacePod obstacles, Su
 {
     glUseProgram(Programs.Jacobi);
 
-    SetUniform("Alpha", -CellSize * CellSize);
-    SetUniform("InverseBeta", 0.1666f);
     SetUniform("Divergence", 1);
     SetUniform("Obstacles", 2);
 
@@ -354,7 +1322,25 @@ void Jacobi(SurfacePod pressure, SurfacePod divergence, SurfacePod obstacles, Su
     glBindTexture(GL_TEXTURE_3D, divergence.ColorTexture);
     glActiveTexture(GL_TEXTURE2);
     glBindTexture(GL_TEXTURE_3D, obstacles.ColorTexture);
-    glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, dest.Depth);
+    DrawSlab(dest);
+    ResetState();
+}
+
+void ComputeResidual(SurfacePod pressure, SurfacePod divergence, SurfacePod obstacles, SurfacePod dest)
+{
+    glUseProgram(Programs.Residual);
+
+    SetUniform("Divergence", 1);
+    SetUniform("Obstacles", 2);
+
+    glBindFramebuffer(GL_FRAMEBUFFER, dest.FboHandle);
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_3D, pressure.ColorTexture);
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_3D, divergence.ColorTexture);
+    glActiveTexture(GL_TEXTURE2);
+    glBindTexture(GL_TEXTURE_3D, obstacles.ColorTexture);
+    DrawSlab(dest);
     ResetState();
 }
 
@@ -362,8 +1348,6 @@ void SubtractGradient(SurfacePod velocity, SurfacePod pressure, SurfacePod obsta
 {
     glUseProgram(Programs.SubtractGradient);
 
-    SetUniform("GradientScale", GradientScale);
-    SetUniform("HalfInverseCellSize", 0.5f / CellSize);
     SetUniform("Pressure", 1);
     SetUniform("Obstacles", 2);
 
@@ -374,7 +1358,7 @@ void SubtractGradient(SurfacePod velocity, SurfacePod pressure, SurfacePod obsta
     glBindTexture(GL_TEXTURE_3D, pressure.ColorTexture);
     glActiveTexture(GL_TEXTURE2);
     glBindTexture(GL_TEXTURE_3D, obstacles.ColorTexture);
-    glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, dest.Depth);
+    DrawSlab(dest);
     ResetState();
 }
 
@@ -382,7 +1366,6 @@ void ComputeDivergence(SurfacePod velocity, SurfacePod obstacles, SurfacePod des
 {
     glUseProgram(Programs.ComputeDivergence);
 
-    SetUniform("HalfInverseCellSize", 0.5f / CellSize);
     SetUniform("Obstacles", 1);
 
     glBindFramebuffer(GL_FRAMEBUFFER, dest.FboHandle);
@@ -390,21 +1373,60 @@ void ComputeDivergence(SurfacePod velocity, SurfacePod obstacles, SurfacePod des
     glBindTexture(GL_TEXTURE_3D, velocity.ColorTexture);
     glActiveTexture(GL_TEXTURE1);
     glBindTexture(GL_TEXTURE_3D, obstacles.ColorTexture);
-    glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, dest.Depth);
+    DrawSlab(dest);
     ResetState();
 }
 
-void ApplyImpulse(SurfacePod dest, Vector3 position, float value)
+// Replaces the contents of the emitter buffer, which Fluid.Inject reads as a texture buffer.
+static void UploadEmitters(const float* texels, int texelCount)
 {
-    glUseProgram(Programs.ApplyImpulse);
+    if (!EmitterBuffer.Buffer) {
+        glGenBuffers(1, &EmitterBuffer.Buffer);
+        glGenTextures(1, &EmitterBuffer.Texture);
+    }
 
-    SetUniform("Point", position);
-    SetUniform("Radius", SplatRadius);
-    SetUniform("FillColor", Vector3(value, value, value));
+    // Orphaning the old storage lets the previous injection keep reading it.
+    glBindBuffer(GL_TEXTURE_BUFFER, EmitterBuffer.Buffer);
+    glBufferData(GL_TEXTURE_BUFFER, texelCount * 4 * sizeof(float), texels, GL_STREAM_DRAW);
+    glBindBuffer(GL_TEXTURE_BUFFER, 0);
+
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_BUFFER, EmitterBuffer.Texture);
+    glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, EmitterBuffer.Buffer);
+}
+
+// Every active emitter of every member goes out in a single draw that only covers the
+// layers and rectangle around each emitter, and writes all three fields through one
+// framebuffer.
+void InjectEmitters(SurfacePod density, SurfacePod temperature, SurfacePod velocity)
+{
+    static std::vector<float> texels;
+    int footprintLayers;
+    int count = PackEmitters(density.Depth / GridDepth, &texels, &footprintLayers);
+    if (!count) {
+        return;
+    }
+
+    glUseProgram(Programs.Inject);
+    UploadEmitters(&texels[0], count * 4);
+    SetUniform("Emitters", 0);
+    SetUniform("FootprintLayers", footprintLayers);
+    SetUniform("InverseSize", 1.0f / density.Width, 1.0f / density.Height);
+
+    if (!EmitterBuffer.Fbo) {
+        GLenum drawBuffers[3] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1, GL_COLOR_ATTACHMENT2 };
+        glGenFramebuffers(1, &EmitterBuffer.Fbo);
+        glBindFramebuffer(GL_FRAMEBUFFER, EmitterBuffer.Fbo);
+        glDrawBuffers(3, drawBuffers);
+    }
+    glBindFramebuffer(GL_FRAMEBUFFER, EmitterBuffer.Fbo);
+    glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, density.ColorTexture, 0);
+    glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, temperature.ColorTexture, 0);
+    glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT2, velocity.ColorTexture, 0);
 
-    glBindFramebuffer(GL_FRAMEBUFFER, dest.FboHandle);
     glEnable(GL_BLEND);
-    glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, dest.Depth);
+    glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, count * footprintLayers);
+    glBindTexture(GL_TEXTURE_BUFFER, 0);
     ResetState();
 }
 
@@ -414,10 +1436,15 @@ void ApplyBuoyancy(SurfacePod velocity, SurfacePod temperature, SurfacePod densi
 
     SetUniform("Temperature", 1);
     SetUniform("Density", 2);
-    SetUniform("AmbientTemperature", AmbientTemperature);
-    SetUniform("TimeStep", TimeStep);
-    SetUniform("Sigma", SmokeBuoyancy);
-    SetUniform("Kappa", SmokeWeight);
+
+    float sigma[MaxEnsembleSize];
+    float kappa[MaxEnsembleSize];
+    for (int i = 0; i < EnsembleSize; ++i) {
+        sigma[i] = Members[i].SmokeBuoyancy;
+        kappa[i] = Members[i].SmokeWeight;
+    }
+    SetUniform("Sigma", sigma, EnsembleSize);
+    SetUniform("Kappa", kappa, EnsembleSize);
 
     glBindFramebuffer(GL_FRAMEBUFFER, dest.FboHandle);
     glActiveTexture(GL_TEXTURE0);
@@ -426,7 +1453,7 @@ void ApplyBuoyancy(SurfacePod velocity, SurfacePod temperature, SurfacePod densi
     glBindTexture(GL_TEXTURE_3D, temperature.ColorTexture);
     glActiveTexture(GL_TEXTURE2);
     glBindTexture(GL_TEXTURE_3D, density.ColorTexture);
-    glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, dest.Depth);
+    DrawSlab(dest);
     ResetState();
 }
 
@@ -500,6 +1527,28 @@ void SetUniform(const char* name, Vector4 value)
     glUniform4f(location, value.getX(), value.getY(), value.getZ(), value.getW());
 }
 
+void SetUniform(const char* name, const float* values, int count)
+{
+    GLuint program;
+    glGetIntegerv(GL_CURRENT_PROGRAM, (GLint*) &program);
+    GLint location = glGetUniformLocation(program, name);
+    glUniform1fv(location, count, values);
+}
+
+void SetUniform(const char* name, const Vector3* values, int count)
+{
+    GLuint program;
+    glGetIntegerv(GL_CURRENT_PROGRAM, (GLint*) &program);
+    GLint location = glGetUniformLocation(program, name);
+    std::vector<float> packed(count * 3);
+    for (int i = 0; i < count; ++i) {
+        packed[i*3+0] = values[i].getX();
+        packed[i*3+1] = values[i].getY();
+        packed[i*3+2] = values[i].getZ();
+    }
+    glUniform3fv(location, count, &packed[0]);
+}
+
 void SetUniform(const char* name, Point3 value)
 {
     GLuint program;
@@ -524,25 +1573,133 @@ GLuint CreateQuadVbo()
     return vbo;
 }
 
-void WriteToFile(const char* filename, SurfacePod density)
+static void WriteField(VolumeWriter* writer, const char* name, SurfacePod surface, double time)
 {
-    size_t requiredBytes = density.Width * density.Height * density.Depth * 2;
+    int channels = VolumeFieldChannels(name);
+    size_t requiredBytes = size_t(surface.Width) * surface.Height * surface.Depth * channels * 2;
     std::vector<unsigned char> cache(requiredBytes);
-    glBindTexture(GL_TEXTURE_3D, density.ColorTexture);
-    glGetTexImage(GL_TEXTURE_3D, 0, GL_RED, GL_HALF_FLOAT, &cache[0]);
-    FILE* voxelsFile = fopen(filename, "wb");
-    size_t bytesWritten = fwrite(&cache[0], 1, requiredBytes, voxelsFile);
-    pezCheck(bytesWritten == requiredBytes, "Unable to dump out volume texture.");
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    glBindTexture(GL_TEXTURE_3D, surface.ColorTexture);
+    glGetTexImage(GL_TEXTURE_3D, 0, channels == 1 ? GL_RED : GL_RGB, GL_HALF_FLOAT, &cache[0]);
+    WriteVolumeField(writer, name, 0, time, GL_HALF_FLOAT, channels, &cache[0], requiredBytes);
+}
+
+void WriteToFile(const char* filename, SurfacePod density)
+{
+    VolumeParams params = CurrentVolumeParams(0);
+    VolumeWriter* writer = OpenVolumeWriter(filename, density.Width, density.Height, density.Depth, params);
+    WriteField(writer, "density", density, 0);
+    CloseVolumeWriter(writer);
+}
+
+void WriteFluidToFile(const char* filename, const FluidPod& fluid)
+{
+    SurfacePod d = fluid.Density.Ping;
+    VolumeParams params = CurrentVolumeParams(fluid.Time);
+    VolumeWriter* writer = OpenVolumeWriter(filename, d.Width, d.Height, d.Depth, params);
+    WriteField(writer, "density", fluid.Density.Ping, fluid.Time);
+    WriteField(writer, "temperature", fluid.Temperature.Ping, fluid.Time);
+    WriteField(writer, "velocity", fluid.Velocity.Ping, fluid.Time);
+    WriteField(writer, "pressure", fluid.Pressure.Ping, fluid.Time);
+    CloseVolumeWriter(writer);
+}
+
+static void ReadField(VolumeReader* reader, const char* filename, const char* name, SurfacePod dest)
+{
+    const VolumeHeader& header = reader->Header;
+    pezCheck(int(header.Width) == dest.Width && int(header.Height) == dest.Height && int(header.Depth) == dest.Depth,
+             "%s is %dx%dx%d, expected %dx%dx%d.", filename, header.Width, header.Height, header.Depth,
+             dest.Width, dest.Height, dest.Depth);
+
+    const VolumeField* field = FindVolumeField(reader, name);
+    pezCheck(field != 0, "%s has no %s field.", filename, name);
+    pezCheck(field->Type == GL_HALF_FLOAT, "The %s field is not stored as half floats.", name);
+
+    GLenum format = field->Channels == 1 ? GL_RED : GL_RGB;
+    std::vector<unsigned char> cache(DecodedFieldSize(header, *field));
+    ReadVolumeField(reader, field, &cache[0]);
+
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glBindTexture(GL_TEXTURE_3D, dest.ColorTexture);
+    glTexSubImage3D(GL_TEXTURE_3D, 0, 0, 0, 0, dest.Width, dest.Height, dest.Depth, format, GL_HALF_FLOAT, &cache[0]);
+}
+
+void ReadFieldFromFile(const char* filename, const char* name, SurfacePod dest)
+{
+    VolumeReader* reader = OpenVolumeReader(filename);
+    ReadField(reader, filename, name, dest);
+    CloseVolumeReader(reader);
 }
 
 void ReadFromFile(const char* filename, SurfacePod density)
 {
-    size_t requiredBytes = density.Width * density.Height * density.Depth * 2;
-    std::vector<unsigned char> cache(requiredBytes);
-    FILE* voxelsFile = fopen(filename, "rb");
-    size_t bytesRead = fread(&cache[0], 1, requiredBytes, voxelsFile);
-    pezCheck(bytesRead == requiredBytes, "Unable to slurp up volume texture.");
+    ReadFieldFromFile(filename, "density", density);
+}
 
-    glBindTexture(GL_TEXTURE_3D, density.ColorTexture);
-    glTexImage3D(GL_TEXTURE_3D, 0, GL_R16F, density.Width, density.Height, density.Depth, 0, GL_RED, GL_HALF_FLOAT, &cache[0]);
+// The part of a checkpoint that isn't a volume: the active boxes, then the emitters.
+struct CheckpointBoxes {
+    int32_t Bounded;
+    int32_t Shrunk;
+    ActiveBox Active[MaxEnsembleSize];
+};
+
+void SaveCheckpointState(const FluidPod& fluid, std::vector<unsigned char>* state)
+{
+    CheckpointBoxes boxes;
+    boxes.Bounded = fluid.Bounded;
+    boxes.Shrunk = fluid.Shrunk;
+    memcpy(boxes.Active, fluid.Active, sizeof(boxes.Active));
+    const unsigned char* bytes = (const unsigned char*) &boxes;
+    state->assign(bytes, bytes + sizeof(boxes));
+    SaveEmitters(state);
+}
+
+// Unbounded, every pass writes all of its destination before anything reads it, so the
+// Ping surfaces, the clock, the member parameters, the Jacobi count and the emitters are
+// the whole state of a step. Halves round-trip exactly, so stepping on from such a
+// checkpoint (any bake, for one) matches the run that wrote it bit for bit.
+//
+// Bounded runs get their boxes back too, but they still drift apart from the original:
+// box measurements land whenever the GPU delivers them, and the Pong surfaces outside
+// the boxes aren't saved.
+void ReadCheckpoint(const char* filename, FluidPod* fluid)
+{
+    VolumeReader* reader = OpenVolumeReader(filename);
+    const VolumeHeader& header = reader->Header;
+    int members = ReadVolumeMembers(header, Members);
+    pezCheck(int(header.Width) == GridWidth && int(header.Height) == GridHeight && int(header.Depth) == GridDepth * members,
+             "%s is %dx%dx%d, expected %d members of %dx%dx%d.", filename, header.Width, header.Height, header.Depth,
+             members, GridWidth, GridHeight, GridDepth);
+    EnsembleSize = members;
+    NumJacobiIterations = header.Params.NumJacobiIterations;
+
+    bool bounded = fluid->Bounded;
+    if (fluid->Density.Ping.Depth != int(header.Depth)) {
+        DestroyFluid(*fluid);
+        *fluid = CreateFluid(GridWidth, GridHeight, header.Depth);
+    }
+
+    ReadField(reader, filename, "density", fluid->Density.Ping);
+    ReadField(reader, filename, "temperature", fluid->Temperature.Ping);
+    ReadField(reader, filename, "velocity", fluid->Velocity.Ping);
+    ReadField(reader, filename, "pressure", fluid->Pressure.Ping);
+    ReadField(reader, filename, "obstacles", fluid->Obstacles);
+    glBindTexture(GL_TEXTURE_3D, 0);
+    fluid->Time = FindVolumeField(reader, "density")->Time;
+
+    // Older checkpoints keep the current emitters, and the loaded fields can reach
+    // anywhere, so they start over from whole boxes.
+    std::vector<unsigned char> state;
+    CheckpointBoxes boxes;
+    bool restored = ReadVolumeState(reader, &state) && state.size() >= sizeof(boxes) &&
+        LoadEmitters(&state[sizeof(boxes)], state.size() - sizeof(boxes));
+    CloseVolumeReader(reader);
+    if (!restored) {
+        BoundFluid(fluid, bounded);
+        return;
+    }
+    memcpy(&boxes, &state[0], sizeof(boxes));
+    BoundFluid(fluid, boxes.Bounded != 0);
+    fluid->Shrunk = boxes.Shrunk != 0;
+    memcpy(fluid->Active, boxes.Active, sizeof(fluid->Active));
 }
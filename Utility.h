@@ -29,7 +29,82 @@ struct SlabPod {
     SurfacePod Pong;
 };
 
+// Ensemble members are stacked along Z; member i owns layers [i*GridDepth, (i+1)*GridDepth).
+const int MaxEnsembleSize = 16;
+
+struct MemberParams {
+    vmath::Vector3 ImpulsePosition;
+    float ImpulseTemperature;
+    float ImpulseDensity;
+    float SmokeBuoyancy;
+    float SmokeWeight;
+    float TemperatureDissipation;
+    float VelocityDissipation;
+    float DensityDissipation;
+};
+
+// Half-open cell ranges; Z is in layers of the whole stacked volume.  A member with
+// nothing to step gets an empty box at its first cell, which the slab ops skip.
+struct ActiveBox {
+    int Min[3];
+    int Max[3];
+};
+
+// When Bounded, the slab ops in StepFluid only touch each member's Active box, which
+// BoundFluid keeps around the cells with smoke, heat or motion.  Outside the boxes the
+// fields stay at their ambient values.
+struct FluidPod {
+    SlabPod Velocity;
+    SlabPod Density;
+    SlabPod Pressure;
+    SlabPod Temperature;
+    SurfacePod Divergence;
+    SurfacePod Obstacles;
+    double Time;
+    bool Bounded;
+    bool Shrunk;
+    ActiveBox Active[MaxEnsembleSize];
+};
+
+// The groups of passes in StepFluid, in the order they run.
+enum SolverPass {
+    PassAdvect,
+    PassBuoyancy,
+    PassImpulse,
+    PassDivergence,
+    PassJacobi,
+    PassGradient,
+    PassCount
+};
+
 GLuint LoadProgram(const char* vsKey, const char* gsKey, const char* fsKey);
+GLuint SubmitProgram(const char* vsKey, const char* gsKey, const char* fsKey, const char* defines = 0);
+void FinishPrograms();
+
+// The thread that binds a watched program, which is the only one that may replace it.
+enum ProgramOwner {
+    OwnerRenderer,
+    OwnerSimulation,
+};
+
+void WatchProgram(GLuint* program, ProgramOwner owner, const char* vsKey, const char* gsKey, const char* fsKey,
+                  const char* defines = 0);
+
+// Reloads are polled on the thread that draws the window, which swaps in its own
+// programs.  Those of the simulation are only swapped in when the thread that steps
+// the fluid calls AdoptProgramReloads.
+void PollProgramReloads();
+void AdoptProgramReloads();
+
+// Layered programs draw an instance per layer, with a geometry shader that only routes
+// each instance to its layer.  Where the driver can set gl_Layer from the vertex shader,
+// they are built without it and with VertexLayer defined instead.  SetVertexLayer
+// rebuilds them for the other path and returns false if it isn't supported.
+GLuint SubmitLayeredProgram(const char* vsKey, const char* gsKey, const char* fsKey, const char* defines = 0);
+void WatchLayeredProgram(GLuint* program, ProgramOwner owner, const char* vsKey, const char* gsKey, const char* fsKey,
+                         const char* defines = 0);
+bool SetVertexLayer(bool enable);
+bool VertexLayerActive();
 void SetUniform(const char* name, int value);
 void SetUniform(const char* name, float value);
 void SetUniform(const char* name, float x, float y);
@@ -38,6 +113,8 @@ void SetUniform(const char* name, vmath::Matrix3 value);
 void SetUniform(const char* name, vmath::Vector3 value);
 void SetUniform(const char* name, vmath::Point3 value);
 void SetUniform(const char* name, vmath::Vector4 value);
+void SetUniform(const char* name, const float* values, int count);
+void SetUniform(const char* name, const vmath::Vector3* values, int count);
 TexturePod LoadTexture(const char* path);
 SurfacePod CreateSurface(int width, int height, int numComponents = 4);
 SurfacePod CreateVolume(int width, int height, int depth, int numComponents = 4);
@@ -45,17 +122,37 @@ GLuint CreatePointVbo(float x, float y, float z);
 GLuint CreateQuadVbo();
 void CreateObstacles(SurfacePod dest);
 SlabPod CreateSlab(GLsizei width, GLsizei height, GLsizei depth, int numComponents);
+void DestroySurface(SurfacePod surface);
+void DestroySlab(SlabPod slab);
+FluidPod CreateFluid(GLsizei width, GLsizei height, GLsizei depth);
+void DestroyFluid(FluidPod fluid);
+void ResetFluid(FluidPod* fluid);
+void StepFluid(FluidPod* fluid);
+void BoundFluid(FluidPod* fluid, bool bounded);
+float ActiveFraction(const FluidPod& fluid);
+void EnablePassTimings(bool enable);
+bool ReadPassTimings(float* milliseconds);
+size_t AllocatedTextureBytes();
+void BenchmarkLayers(int steps);
 void InitSlabOps();
+void InitMembers();
 void SwapSurfaces(SlabPod* slab);
 void ClearSurface(SurfacePod s, float v);
-void Advect(SurfacePod velocity, SurfacePod source, SurfacePod obstacles, SurfacePod dest, float dissipation);
+void Advect(SurfacePod velocity, SurfacePod source, SurfacePod obstacles, SurfacePod dest, float MemberParams::* dissipation);
 void Jacobi(SurfacePod pressure, SurfacePod divergence, SurfacePod obstacles, SurfacePod dest);
+void ComputeResidual(SurfacePod pressure, SurfacePod divergence, SurfacePod obstacles, SurfacePod dest);
 void SubtractGradient(SurfacePod velocity, SurfacePod pressure, SurfacePod obstacles, SurfacePod dest);
 void ComputeDivergence(SurfacePod velocity, SurfacePod obstacles, SurfacePod dest);
-void ApplyImpulse(SurfacePod dest, vmath::Vector3 position, float value);
+void InjectEmitters(SurfacePod density, SurfacePod temperature, SurfacePod velocity);
 void ApplyBuoyancy(SurfacePod velocity, SurfacePod temperature, SurfacePod density, SurfacePod dest);
 void WriteToFile(const char* filename, SurfacePod density);
 void ReadFromFile(const char* filename, SurfacePod density);
+void WriteFluidToFile(const char* filename, const FluidPod& fluid);
+void ReadFieldFromFile(const char* filename, const char* name, SurfacePod dest);
+void ReadCheckpoint(const char* filename, FluidPod* fluid);
+
+// Collects what a checkpoint needs besides the fields: the active boxes and the emitters.
+void SaveCheckpointState(const FluidPod& fluid, std::vector<unsigned char>* state);
 
 extern const float CellSize;
 extern const int ViewportWidth;
@@ -67,7 +164,7 @@ extern const float SplatRadius;
 extern const float AmbientTemperature;
 extern const float ImpulseTemperature;
 extern const float ImpulseDensity;
-extern const int NumJacobiIterations;
+extern int NumJacobiIterations;
 extern const float TimeStep;
 extern const float SmokeBuoyancy;
 extern const float SmokeWeight;
@@ -76,3 +173,6 @@ extern const float TemperatureDissipation;
 extern const float VelocityDissipation;
 extern const float DensityDissipation;
 extern const vmath::Vector3 ImpulsePosition;
+extern const char* SolverPassNames[PassCount];
+extern int EnsembleSize;
+extern MemberParams Members[MaxEnsembleSize];
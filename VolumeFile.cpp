@@ -0,0 +1,1032 @@
+#include "VolumeFile.h"
+#include <algorithm>
+#include <cmath>
+#include <condition_variable>
+#include <cstring>
+#include <ctime>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+static const char VolumeMagic[4] = { 'F', 'V', 'O', 'L' };
+
+// Older, shorter headers are read through this struct too; the bytes past them belong to
+// the padding before the first payload.
+static_assert(sizeof(VolumeHeader) <= VolumeAlignment, "The volume header must fit before the first payload.");
+
+static uint64_t AlignOffset(uint64_t offset)
+{
+    return (offset + VolumeAlignment - 1) & ~(VolumeAlignment - 1);
+}
+
+VolumeParams CurrentVolumeParams(double time, int member)
+{
+    const MemberParams& m = Members[member];
+    VolumeParams params;
+    memset(&params, 0, sizeof(params));
+    params.Time = float(time);
+    params.TimeStep = TimeStep;
+    params.CellSize = CellSize;
+    params.AmbientTemperature = AmbientTemperature;
+    params.SplatRadius = SplatRadius;
+    params.NumJacobiIterations = NumJacobiIterations;
+    params.ImpulsePosition[0] = m.ImpulsePosition.getX();
+    params.ImpulsePosition[1] = m.ImpulsePosition.getY();
+    params.ImpulsePosition[2] = m.ImpulsePosition.getZ();
+    params.ImpulseTemperature = m.ImpulseTemperature;
+    params.ImpulseDensity = m.ImpulseDensity;
+    params.SmokeBuoyancy = m.SmokeBuoyancy;
+    params.SmokeWeight = m.SmokeWeight;
+    params.TemperatureDissipation = m.TemperatureDissipation;
+    params.VelocityDissipation = m.VelocityDissipation;
+    params.DensityDissipation = m.DensityDissipation;
+    return params;
+}
+
+int ReadVolumeMembers(const VolumeHeader& header, MemberParams* members)
+{
+    int count = header.Version >= 5 ? int(header.MemberCount) : 1;
+    count = std::max(1, std::min(count, MaxEnsembleSize));
+    for (int member = 0; member < count; ++member) {
+        const VolumeParams& p = header.Version >= 5 ? header.Members[member] : header.Params;
+        MemberParams& m = members[member];
+        m.ImpulsePosition = vmath::Vector3(p.ImpulsePosition[0], p.ImpulsePosition[1], p.ImpulsePosition[2]);
+        m.ImpulseTemperature = p.ImpulseTemperature;
+        m.ImpulseDensity = p.ImpulseDensity;
+        m.SmokeBuoyancy = p.SmokeBuoyancy;
+        m.SmokeWeight = p.SmokeWeight;
+        m.TemperatureDissipation = p.TemperatureDissipation;
+        m.VelocityDissipation = p.VelocityDissipation;
+        m.DensityDissipation = p.DensityDissipation;
+    }
+    return count;
+}
+
+// Velocity and obstacles are the only vector fields; everything else is a scalar.
+int VolumeFieldChannels(const char* name)
+{
+    return strcmp(name, "velocity") && strcmp(name, "obstacles") ? 1 : 3;
+}
+
+static int ComponentSize(GLenum type)
+{
+    return type == GL_HALF_FLOAT ? 2 : type == GL_FLOAT ? 4 : 1;
+}
+
+size_t DecodedFieldSize(const VolumeHeader& header, const VolumeField& field)
+{
+    return size_t(header.Width) * header.Height * header.Depth * field.Channels * ComponentSize(field.Type);
+}
+
+static void XorInto(unsigned char* dest, const unsigned char* delta, size_t size)
+{
+    for (size_t i = 0; i < size; ++i) {
+        dest[i] ^= delta[i];
+    }
+}
+
+// Splits size bytes of shuffleSize-byte elements into byte planes.
+static void Shuffle(const unsigned char* data, size_t size, int shuffleSize, unsigned char* planes)
+{
+    size_t elements = size / shuffleSize;
+    for (size_t e = 0; e < elements; ++e) {
+        for (int b = 0; b < shuffleSize; ++b) {
+            planes[b * elements + e] = data[e * shuffleSize + b];
+        }
+    }
+}
+
+// Gathers bytes [first, first + count) of a chunk of size bytes that was stored as byte planes.
+static void Unshuffle(const unsigned char* planes, size_t size, int shuffleSize, size_t first, size_t count, unsigned char* dest)
+{
+    size_t elements = size / shuffleSize;
+    for (size_t e = first / shuffleSize; e < (first + count) / shuffleSize; ++e) {
+        for (int b = 0; b < shuffleSize; ++b) {
+            *dest++ = planes[b * elements + e];
+        }
+    }
+}
+
+// Encoded payloads are a header, then one offset per unit plus one, then the units themselves.
+typedef std::vector<std::vector<unsigned char> > EncodedUnits;
+
+static void AssemblePayload(const void* header, size_t headerSize, const EncodedUnits& units, std::vector<unsigned char>* payload)
+{
+    uint64_t offset = headerSize + (units.size() + 1) * sizeof(uint64_t);
+    payload->resize(size_t(offset));
+    memcpy(&(*payload)[0], header, headerSize);
+    for (size_t unit = 0; unit <= units.size(); ++unit) {
+        memcpy(&(*payload)[headerSize + unit * sizeof(uint64_t)], &offset, sizeof(offset));
+        if (unit < units.size()) {
+            offset += units[unit].size();
+        }
+    }
+    for (size_t unit = 0; unit < units.size(); ++unit) {
+        payload->insert(payload->end(), units[unit].begin(), units[unit].end());
+    }
+}
+
+static ChunkHeader MakeChunkHeader(int sliceCount, size_t sliceSize, int shuffleSize)
+{
+    pezCheck(sliceSize % shuffleSize == 0, "Slices must hold whole elements.");
+    ChunkHeader header;
+    memset(&header, 0, sizeof(header));
+    header.ChunkCount = (sliceCount + SlicesPerChunk - 1) / SlicesPerChunk;
+    header.SlicesPerChunk = SlicesPerChunk;
+    header.SliceCount = sliceCount;
+    header.ShuffleSize = shuffleSize;
+    header.SliceSize = sliceSize;
+    return header;
+}
+
+static void EncodeChunk(const unsigned char* source, const ChunkHeader& header, int chunk, std::vector<unsigned char>* out)
+{
+    int shuffleSize = int(header.ShuffleSize);
+    size_t sliceSize = size_t(header.SliceSize);
+    int slices = std::min(SlicesPerChunk, int(header.SliceCount) - chunk * SlicesPerChunk);
+    unsigned int rawSize = (unsigned int) (sliceSize * slices);
+    unsigned int packedSize = rawSize;
+    const unsigned char* raw = source + chunk * sliceSize * SlicesPerChunk;
+    std::vector<unsigned char> planes;
+    if (shuffleSize > 1) {
+        planes.resize(rawSize);
+        Shuffle(raw, rawSize, shuffleSize, &planes[0]);
+        raw = &planes[0];
+    }
+
+    // Incompressible chunks are stored as-is, which the reader detects by their size.
+    out->resize(rawSize);
+    if (lzfx_compress(raw, rawSize, &(*out)[0], &packedSize) < 0 || packedSize >= rawSize) {
+        memcpy(&(*out)[0], raw, rawSize);
+        packedSize = rawSize;
+    }
+    out->resize(packedSize);
+}
+
+void EncodeChunks(const void* data, int sliceCount, size_t sliceSize, std::vector<unsigned char>* payload, int shuffleSize)
+{
+    ChunkHeader header = MakeChunkHeader(sliceCount, sliceSize, shuffleSize);
+    EncodedUnits chunks(header.ChunkCount);
+    for (uint32_t chunk = 0; chunk < header.ChunkCount; ++chunk) {
+        EncodeChunk((const unsigned char*) data, header, chunk, &chunks[chunk]);
+    }
+    AssemblePayload(&header, sizeof(header), chunks, payload);
+}
+
+// Chunk i lives at chunks + offsets[i] - base, where base is the payload offset of the first chunk given.
+static void DecodeChunkRange(const ChunkHeader& header, const uint64_t* offsets, const unsigned char* chunks, uint64_t base,
+                             int firstSlice, int sliceCount, void* dest)
+{
+    size_t sliceSize = size_t(header.SliceSize);
+    int shuffleSize = std::max(1, int(header.ShuffleSize));
+    std::vector<unsigned char> scratch;
+    unsigned char* output = (unsigned char*) dest;
+
+    int endSlice = firstSlice + sliceCount;
+    for (int chunk = firstSlice / SlicesPerChunk; chunk * SlicesPerChunk < endSlice; ++chunk) {
+        int chunkFirst = chunk * int(header.SlicesPerChunk);
+        int chunkSlices = std::min(int(header.SlicesPerChunk), int(header.SliceCount) - chunkFirst);
+        int copyFirst = std::max(firstSlice, chunkFirst);
+        int copyEnd = std::min(endSlice, chunkFirst + chunkSlices);
+
+        const unsigned char* packed = chunks + (offsets[chunk] - base);
+        unsigned int packedSize = (unsigned int) (offsets[chunk + 1] - offsets[chunk]);
+        unsigned int rawSize = (unsigned int) (sliceSize * chunkSlices);
+
+        // Whole unshuffled chunks decode straight into the destination:
+        bool whole = copyFirst == chunkFirst && copyEnd == chunkFirst + chunkSlices && shuffleSize == 1;
+        unsigned char* target = output + (copyFirst - firstSlice) * sliceSize;
+        if (!whole) {
+            scratch.resize(rawSize);
+            target = &scratch[0];
+        }
+
+        if (packedSize == rawSize) {
+            memcpy(target, packed, rawSize);
+        } else {
+            unsigned int decodedSize = rawSize;
+            int result = lzfx_decompress(packed, packedSize, target, &decodedSize);
+            pezCheck(result >= 0 && decodedSize == rawSize, "Corrupt chunk %d in volume field.", chunk);
+        }
+
+        if (!whole) {
+            unsigned char* copyTarget = output + (copyFirst - firstSlice) * sliceSize;
+            size_t copyOffset = (copyFirst - chunkFirst) * sliceSize;
+            size_t copySize = (copyEnd - copyFirst) * sliceSize;
+            if (shuffleSize > 1) {
+                Unshuffle(&scratch[0], rawSize, shuffleSize, copyOffset, copySize, copyTarget);
+            } else {
+                memcpy(copyTarget, &scratch[copyOffset], copySize);
+            }
+        }
+    }
+}
+
+void DecodeChunks(const void* payload, int firstSlice, int sliceCount, void* dest)
+{
+    ChunkHeader header;
+    memcpy(&header, payload, sizeof(header));
+    pezCheck(firstSlice >= 0 && firstSlice + sliceCount <= int(header.SliceCount), "Slice range out of bounds.");
+    const uint64_t* offsets = (const uint64_t*) ((const unsigned char*) payload + sizeof(header));
+    DecodeChunkRange(header, offsets, (const unsigned char*) payload, 0, firstSlice, sliceCount, dest);
+}
+
+static float HalfToFloat(uint16_t half)
+{
+    uint32_t sign = uint32_t(half & 0x8000) << 16;
+    uint32_t exponent = (half >> 10) & 0x1f;
+    uint32_t mantissa = half & 0x3ff;
+    if (exponent == 0) {
+        float value = mantissa * (1.0f / 16777216.0f);
+        return sign ? -value : value;
+    }
+    uint32_t bits = sign | (exponent == 0x1f ? 0x7f800000 | (mantissa << 13) : ((exponent + 112) << 23) | (mantissa << 13));
+    float value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+// Rounds to the nearest half, with ties to even.
+static uint16_t FloatToHalf(float value)
+{
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    uint16_t sign = uint16_t((bits >> 16) & 0x8000);
+    uint32_t mantissa = bits & 0x7fffff;
+    int exponent = int((bits >> 23) & 0xff);
+    if (exponent == 0xff) {
+        return sign | 0x7c00 | (mantissa ? 0x200 : 0);
+    }
+    exponent -= 112;
+    if (exponent >= 31) {
+        return sign | 0x7c00;
+    }
+    int shift = 13;
+    if (exponent <= 0) {
+        if (exponent < -10) {
+            return sign;
+        }
+        mantissa |= 0x800000;
+        shift = 14 - exponent;
+        exponent = 0;
+    }
+    uint32_t half = (uint32_t(exponent) << 10) | (mantissa >> shift);
+    uint32_t rest = mantissa & ((1u << shift) - 1);
+    uint32_t midpoint = 1u << (shift - 1);
+    if (rest > midpoint || (rest == midpoint && (half & 1))) {
+        ++half;
+    }
+    return uint16_t(sign | half);
+}
+
+static void AppendBytes(std::vector<unsigned char>* out, const void* data, size_t size)
+{
+    out->insert(out->end(), (const unsigned char*) data, (const unsigned char*) data + size);
+}
+
+// Returns the position just past the brick channel.
+static const unsigned char* DecodeBrickChannel(const unsigned char* in, int count, uint16_t* values)
+{
+    BrickMode mode = BrickMode(*in++);
+    if (mode == BrickConstant || mode == BrickHalf) {
+        int stored = mode == BrickConstant ? 1 : count;
+        for (int i = 0; i < count; ++i) {
+            memcpy(&values[i], in + 2 * (i % stored), 2);
+        }
+        return in + 2 * stored;
+    }
+
+    float minimum, step;
+    memcpy(&minimum, in, sizeof(float));
+    memcpy(&step, in + sizeof(float), sizeof(float));
+    in += 2 * sizeof(float);
+    if (mode == Brick8) {
+        for (int i = 0; i < count; ++i) {
+            values[i] = FloatToHalf(minimum + in[i] * step);
+        }
+        return in + count;
+    }
+    for (int i = 0; i < count; ++i) {
+        const unsigned char* pair = in + (i / 2) * 3;
+        int code = i & 1 ? (pair[1] >> 4) | (pair[2] << 4) : pair[0] | ((pair[1] & 0xf) << 8);
+        values[i] = FloatToHalf(minimum + code * step);
+    }
+    return in + (count + 1) / 2 * 3;
+}
+
+static void EncodeBrickMode(const uint16_t* values, int count, BrickMode mode, std::vector<unsigned char>* out)
+{
+    out->push_back((unsigned char) mode);
+    if (mode == BrickHalf) {
+        AppendBytes(out, values, count * 2);
+        return;
+    }
+
+    float minimum = HalfToFloat(values[0]);
+    float maximum = minimum;
+    for (int i = 1; i < count; ++i) {
+        minimum = std::min(minimum, HalfToFloat(values[i]));
+        maximum = std::max(maximum, HalfToFloat(values[i]));
+    }
+    if (mode == BrickConstant) {
+        uint16_t middle = FloatToHalf(0.5f * (minimum + maximum));
+        AppendBytes(out, &middle, 2);
+        return;
+    }
+
+    int levels = mode == Brick8 ? 255 : 4095;
+    float step = (maximum - minimum) / levels;
+    float scale = step > 0 ? 1.0f / step : 0.0f;
+    AppendBytes(out, &minimum, sizeof(minimum));
+    AppendBytes(out, &step, sizeof(step));
+    size_t start = out->size();
+    out->resize(start + (mode == Brick8 ? count : (count + 1) / 2 * 3), 0);
+    unsigned char* codes = &(*out)[start];
+    for (int i = 0; i < count; ++i) {
+        int code = std::min(levels, std::max(0, int((HalfToFloat(values[i]) - minimum) * scale + 0.5f)));
+        if (mode == Brick8) {
+            codes[i] = (unsigned char) code;
+        } else if (i & 1) {
+            codes[(i / 2) * 3 + 1] |= (unsigned char) ((code & 0xf) << 4);
+            codes[(i / 2) * 3 + 2] = (unsigned char) (code >> 4);
+        } else {
+            codes[(i / 2) * 3] = (unsigned char) (code & 0xff);
+            codes[(i / 2) * 3 + 1] = (unsigned char) (code >> 8);
+        }
+    }
+}
+
+// Tries each mode from smallest to largest and keeps the first whose decoded halves are within errorBound.
+// NaNs and infinities never pass, so they always end up stored exactly.
+static void EncodeBrickChannel(const uint16_t* values, int count, float errorBound, std::vector<unsigned char>* out)
+{
+    std::vector<uint16_t> decoded(count);
+    size_t start = out->size();
+    for (int mode = BrickConstant; mode < BrickHalf; ++mode) {
+        EncodeBrickMode(values, count, BrickMode(mode), out);
+        DecodeBrickChannel(&(*out)[start], count, &decoded[0]);
+        bool within = true;
+        for (int i = 0; i < count && within; ++i) {
+            within = fabsf(HalfToFloat(decoded[i]) - HalfToFloat(values[i])) <= errorBound;
+        }
+        if (within) {
+            return;
+        }
+        out->resize(start);
+    }
+    EncodeBrickMode(values, count, BrickHalf, out);
+}
+
+static BrickHeader MakeBrickHeader(int width, int height, int depth, int channels, float errorBound)
+{
+    BrickHeader header;
+    memset(&header, 0, sizeof(header));
+    header.Width = width;
+    header.Height = height;
+    header.Depth = depth;
+    header.Channels = channels;
+    header.ErrorBound = errorBound;
+    return header;
+}
+
+static int BrickLayerCount(const BrickHeader& header)
+{
+    return (int(header.Depth) + BrickSize - 1) / BrickSize;
+}
+
+static void EncodeBrickLayer(const uint16_t* source, const BrickHeader& header, int layer, std::vector<unsigned char>* out)
+{
+    int width = header.Width, height = header.Height, channels = header.Channels;
+    std::vector<uint16_t> values(BrickSize * BrickSize * BrickSize);
+    int z0 = layer * BrickSize, z1 = std::min(int(header.Depth), z0 + BrickSize);
+    for (int y0 = 0; y0 < height; y0 += BrickSize) {
+        int y1 = std::min(height, y0 + BrickSize);
+        for (int x0 = 0; x0 < width; x0 += BrickSize) {
+            int x1 = std::min(width, x0 + BrickSize);
+            for (int c = 0; c < channels; ++c) {
+                int count = 0;
+                for (int z = z0; z < z1; ++z) {
+                    for (int y = y0; y < y1; ++y) {
+                        for (int x = x0; x < x1; ++x) {
+                            values[count++] = source[((size_t(z) * height + y) * width + x) * channels + c];
+                        }
+                    }
+                }
+                EncodeBrickChannel(&values[0], count, header.ErrorBound, out);
+            }
+        }
+    }
+}
+
+void EncodeBricks(const void* data, int width, int height, int depth, int channels, float errorBound,
+                  std::vector<unsigned char>* payload)
+{
+    BrickHeader header = MakeBrickHeader(width, height, depth, channels, errorBound);
+    EncodedUnits layers(BrickLayerCount(header));
+    for (size_t layer = 0; layer < layers.size(); ++layer) {
+        EncodeBrickLayer((const uint16_t*) data, header, int(layer), &layers[layer]);
+    }
+    AssemblePayload(&header, sizeof(header), layers, payload);
+}
+
+// Layer i lives at layers + offsets[i] - base, where base is the payload offset of the first layer given.
+static void DecodeBrickRange(const BrickHeader& header, const uint64_t* offsets, const unsigned char* layers, uint64_t base,
+                             int firstSlice, int sliceCount, void* dest)
+{
+    int width = header.Width, height = header.Height, channels = header.Channels;
+    size_t sliceTexels = size_t(width) * height * channels;
+    std::vector<uint16_t> scratch(sliceTexels * BrickSize);
+    std::vector<uint16_t> values(BrickSize * BrickSize * BrickSize);
+    uint16_t* output = (uint16_t*) dest;
+
+    int endSlice = firstSlice + sliceCount;
+    for (int layer = firstSlice / BrickSize; layer * BrickSize < endSlice; ++layer) {
+        const unsigned char* in = layers + (offsets[layer] - base);
+        int z0 = layer * BrickSize, z1 = std::min(int(header.Depth), z0 + BrickSize);
+        for (int y0 = 0; y0 < height; y0 += BrickSize) {
+            int y1 = std::min(height, y0 + BrickSize);
+            for (int x0 = 0; x0 < width; x0 += BrickSize) {
+                int x1 = std::min(width, x0 + BrickSize);
+                int count = (z1 - z0) * (y1 - y0) * (x1 - x0);
+                for (int c = 0; c < channels; ++c) {
+                    in = DecodeBrickChannel(in, count, &values[0]);
+                    const uint16_t* value = &values[0];
+                    for (int z = z0; z < z1; ++z) {
+                        for (int y = y0; y < y1; ++y) {
+                            for (int x = x0; x < x1; ++x) {
+                                scratch[((size_t(z - z0) * height + y) * width + x) * channels + c] = *value++;
+                            }
+                        }
+                    }
+                }
+            }
+        }
+        pezCheck(in == layers + (offsets[layer + 1] - base), "Corrupt brick layer %d in volume field.", layer);
+
+        int copyFirst = std::max(firstSlice, z0);
+        int copyEnd = std::min(endSlice, z1);
+        memcpy(output + (copyFirst - firstSlice) * sliceTexels, &scratch[(copyFirst - z0) * sliceTexels],
+               (copyEnd - copyFirst) * sliceTexels * sizeof(uint16_t));
+    }
+}
+
+void DecodeBricks(const void* payload, int firstSlice, int sliceCount, void* dest)
+{
+    BrickHeader header;
+    memcpy(&header, payload, sizeof(header));
+    pezCheck(firstSlice >= 0 && firstSlice + sliceCount <= int(header.Depth), "Slice range out of bounds.");
+    const uint64_t* offsets = (const uint64_t*) ((const unsigned char*) payload + sizeof(header));
+    DecodeBrickRange(header, offsets, (const unsigned char*) payload, 0, firstSlice, sliceCount, dest);
+}
+
+void DecodeMappedFrame(const unsigned char* map, const VolumeHeader& header, const std::vector<VolumeField>& frames,
+                       int frame, std::vector<unsigned char>* current, int* currentFrame)
+{
+    // Walk back to a keyframe, or to the frame just after the one already decoded:
+    int start = frame;
+    while (frames[start].Encoding == EncodingLzfxDelta && start - 1 != *currentFrame) {
+        --start;
+        pezCheck(start >= 0, "Frame %d has no keyframe.", frame);
+    }
+    pezCheck(start > 0 || frames[start].Encoding != EncodingLzfxDelta, "Frame %d has no keyframe.", frame);
+
+    size_t size = DecodedFieldSize(header, frames[frame]);
+    current->resize(size);
+    std::vector<unsigned char> delta;
+    for (int f = start; f <= frame; ++f) {
+        const VolumeField& field = frames[f];
+        const unsigned char* payload = map + field.Offset;
+        if (field.Encoding == EncodingRaw) {
+            memcpy(&(*current)[0], payload, size);
+        } else if (field.Encoding == EncodingLzfx) {
+            DecodeChunks(payload, 0, header.Depth, &(*current)[0]);
+        } else if (field.Encoding == EncodingBricks) {
+            DecodeBricks(payload, 0, header.Depth, &(*current)[0]);
+        } else {
+            delta.resize(size);
+            DecodeChunks(payload, 0, header.Depth, &delta[0]);
+            XorInto(&(*current)[0], &delta[0], size);
+        }
+    }
+    *currentFrame = frame;
+}
+
+static double GetSeconds()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Fields queued in a writer may hold at most this many source bytes before WriteVolumeField blocks.
+static const size_t MaxPendingBytes = size_t(256) << 20;
+
+struct EncodePipeline;
+
+// One field on its way through a writer: its units (chunks or layers of bricks) are
+// encoded on the shared worker threads, then the writer's own thread assembles and
+// writes it in order.
+struct PendingEncode {
+    EncodePipeline* Pipeline;
+    VolumeField Field;
+    std::vector<unsigned char> Source;
+    ChunkHeader Chunks;
+    BrickHeader Bricks;
+    EncodedUnits Units;
+    int Remaining;
+};
+
+struct EncodePipeline {
+    std::mutex Mutex;
+    std::condition_variable Progress;
+    std::deque<PendingEncode*> Fields;
+    std::thread Writer;
+    size_t PendingBytes;
+    bool Closing;
+    double OpenTime;
+    VolumeWriterStats Stats;
+};
+
+// Every writer shares one set of encoder threads, started by the first writer that needs
+// them and kept for the life of the process, so checkpoints and field writes that overlap
+// don't each bring up a thread per core.  It is never destroyed because its threads never
+// return.
+struct EncodePool {
+    std::mutex Mutex;
+    std::condition_variable Work;
+    std::deque<std::pair<PendingEncode*, int> > Units;
+    int Threads;
+};
+
+static EncodePool* SharedPool;
+static std::once_flag SharedPoolStarted;
+
+static void EncodeWorker(EncodePool* pool)
+{
+    while (true) {
+        std::unique_lock<std::mutex> lock(pool->Mutex);
+        while (pool->Units.empty()) {
+            pool->Work.wait(lock);
+        }
+        PendingEncode* pending = pool->Units.front().first;
+        int unit = pool->Units.front().second;
+        pool->Units.pop_front();
+        lock.unlock();
+
+        double start = GetSeconds();
+        if (pending->Field.Encoding == EncodingBricks) {
+            EncodeBrickLayer((const uint16_t*) &pending->Source[0], pending->Bricks, unit, &pending->Units[unit]);
+        } else {
+            EncodeChunk(&pending->Source[0], pending->Chunks, unit, &pending->Units[unit]);
+        }
+        double seconds = GetSeconds() - start;
+
+        EncodePipeline* pipeline = pending->Pipeline;
+        std::lock_guard<std::mutex> done(pipeline->Mutex);
+        pipeline->Stats.EncodeSeconds += seconds;
+        if (--pending->Remaining == 0) {
+            pipeline->Progress.notify_all();
+        }
+    }
+}
+
+static void StartSharedPool()
+{
+    SharedPool = new EncodePool;
+    SharedPool->Threads = std::max(1, int(std::thread::hardware_concurrency()));
+    for (int i = 0; i < SharedPool->Threads; ++i) {
+        std::thread(EncodeWorker, SharedPool).detach();
+    }
+}
+
+static void WritePending(VolumeWriter* writer, PendingEncode* pending)
+{
+    VolumeField& field = pending->Field;
+    const unsigned char* data = pending->Source.empty() ? 0 : &pending->Source[0];
+    size_t size = pending->Source.size();
+
+    std::vector<unsigned char> payload;
+    if (field.Encoding != EncodingRaw) {
+        if (field.Encoding == EncodingBricks) {
+            AssemblePayload(&pending->Bricks, sizeof(BrickHeader), pending->Units, &payload);
+        } else {
+            AssemblePayload(&pending->Chunks, sizeof(ChunkHeader), pending->Units, &payload);
+        }
+        data = &payload[0];
+        size = payload.size();
+    }
+    field.Size = size;
+
+    uint64_t end = ftell(writer->File);
+    field.Offset = AlignOffset(end);
+    static const char padding[VolumeAlignment] = {0};
+    fwrite(padding, 1, size_t(field.Offset - end), writer->File);
+
+    size_t bytesWritten = fwrite(data, 1, size, writer->File);
+    pezCheck(bytesWritten == size, "Unable to write the %s field.", field.Name);
+    writer->Fields.push_back(field);
+}
+
+// Writes finished fields in the order they were submitted.
+static void EncodeWriter(VolumeWriter* writer)
+{
+    EncodePipeline* pipeline = writer->Pipeline;
+    std::unique_lock<std::mutex> lock(pipeline->Mutex);
+    while (true) {
+        if (pipeline->Fields.empty() && pipeline->Closing) {
+            break;
+        }
+        if (pipeline->Fields.empty() || pipeline->Fields.front()->Remaining) {
+            pipeline->Progress.wait(lock);
+            continue;
+        }
+        PendingEncode* pending = pipeline->Fields.front();
+        pipeline->Fields.pop_front();
+        lock.unlock();
+
+        double start = GetSeconds();
+        WritePending(writer, pending);
+        double seconds = GetSeconds() - start;
+
+        lock.lock();
+        VolumeWriterStats& stats = pipeline->Stats;
+        stats.FieldCount++;
+        stats.RawBytes += double(DecodedFieldSize(writer->Header, pending->Field));
+        stats.EncodedBytes += double(pending->Field.Size);
+        stats.WriteSeconds += seconds;
+        pipeline->PendingBytes -= pending->Source.size();
+        delete pending;
+        pipeline->Progress.notify_all();
+    }
+}
+
+VolumeWriter* OpenVolumeWriter(const char* filename, int width, int height, int depth, VolumeParams params,
+                               VolumeEncoding encoding, int keyframeInterval, float errorBound)
+{
+    FILE* file = fopen(filename, "wb");
+    pezCheck(file != 0, "Unable to open %s for writing.", filename);
+
+    VolumeWriter* writer = new VolumeWriter;
+    writer->File = file;
+    writer->Encoding = encoding;
+    writer->KeyframeInterval = keyframeInterval;
+    writer->ErrorBound = errorBound;
+    memset(&writer->Header, 0, sizeof(writer->Header));
+    memcpy(writer->Header.Magic, VolumeMagic, sizeof(VolumeMagic));
+    writer->Header.Version = VolumeVersion;
+    writer->Header.Width = width;
+    writer->Header.Height = height;
+    writer->Header.Depth = depth;
+    writer->Header.Params = params;
+    writer->Header.MemberCount = EnsembleSize;
+    for (int member = 0; member < EnsembleSize; ++member) {
+        writer->Header.Members[member] = CurrentVolumeParams(params.Time, member);
+    }
+
+    // The header is rewritten with the table offset on close.
+    fwrite(&writer->Header, sizeof(writer->Header), 1, file);
+
+    EncodePipeline* pipeline = new EncodePipeline;
+    pipeline->PendingBytes = 0;
+    pipeline->Closing = false;
+    pipeline->OpenTime = GetSeconds();
+    memset(&pipeline->Stats, 0, sizeof(pipeline->Stats));
+    writer->Pipeline = pipeline;
+    pipeline->Stats.Threads = 0;
+    if (encoding != EncodingRaw) {
+        std::call_once(SharedPoolStarted, StartSharedPool);
+        pipeline->Stats.Threads = SharedPool->Threads;
+    }
+    pipeline->Writer = std::thread(EncodeWriter, writer);
+    return writer;
+}
+
+void WriteVolumeField(VolumeWriter* writer, const char* name, int frame, double time, GLenum type, int channels, const void* data, size_t size)
+{
+    PendingEncode* pending = new PendingEncode;
+    pending->Pipeline = writer->Pipeline;
+    VolumeField& field = pending->Field;
+    memset(&field, 0, sizeof(field));
+    strncpy(field.Name, name, sizeof(field.Name) - 1);
+    field.Frame = frame;
+    field.Type = type;
+    field.Channels = channels;
+    field.Encoding = writer->Encoding == EncodingLzfxDelta ? EncodingLzfx : writer->Encoding;
+    field.Time = time;
+
+    // Fields that follow the previous frame of the same name are stored as deltas between keyframes:
+    const unsigned char* bytes = (const unsigned char*) data;
+    pending->Source.assign(bytes, bytes + size);
+    if (writer->Encoding == EncodingLzfxDelta) {
+        std::map<std::string, DeltaBase>::iterator previous = writer->Previous.find(name);
+        bool keyframe = writer->KeyframeInterval <= 1 || frame % writer->KeyframeInterval == 0 ||
+            previous == writer->Previous.end() || previous->second.Frame != frame - 1 || previous->second.Data.size() != size;
+        DeltaBase& base = writer->Previous[name];
+        if (!keyframe) {
+            XorInto(&pending->Source[0], &base.Data[0], size);
+            field.Encoding = EncodingLzfxDelta;
+        }
+        base.Frame = frame;
+        base.Data.assign(bytes, bytes + size);
+    }
+
+    int unitCount = 0;
+    const VolumeHeader& header = writer->Header;
+    if (field.Encoding == EncodingBricks) {
+        pezCheck(type == GL_HALF_FLOAT, "Only half-float fields can be bricked.");
+        pending->Bricks = MakeBrickHeader(header.Width, header.Height, header.Depth, channels, writer->ErrorBound);
+        unitCount = BrickLayerCount(pending->Bricks);
+    } else if (field.Encoding != EncodingRaw) {
+        int shuffleSize = field.Encoding == EncodingLzfxDelta ? ComponentSize(type) : 1;
+        pending->Chunks = MakeChunkHeader(header.Depth, size / header.Depth, shuffleSize);
+        unitCount = int(pending->Chunks.ChunkCount);
+    }
+    pending->Units.resize(unitCount);
+    pending->Remaining = unitCount;
+
+    // Hold the caller while the queue is full, but always admit one field however large:
+    EncodePipeline* pipeline = writer->Pipeline;
+    {
+        std::unique_lock<std::mutex> lock(pipeline->Mutex);
+        while (pipeline->PendingBytes && pipeline->PendingBytes + size > MaxPendingBytes) {
+            pipeline->Progress.wait(lock);
+        }
+        pipeline->PendingBytes += size;
+        pipeline->Fields.push_back(pending);
+        pipeline->Progress.notify_all();
+    }
+    if (unitCount) {
+        std::lock_guard<std::mutex> lock(SharedPool->Mutex);
+        for (int unit = 0; unit < unitCount; ++unit) {
+            SharedPool->Units.push_back(std::make_pair(pending, unit));
+        }
+        SharedPool->Work.notify_all();
+    }
+}
+
+VolumeWriterStats CloseVolumeWriter(VolumeWriter* writer)
+{
+    EncodePipeline* pipeline = writer->Pipeline;
+    {
+        std::lock_guard<std::mutex> lock(pipeline->Mutex);
+        pipeline->Closing = true;
+        pipeline->Progress.notify_all();
+    }
+    pipeline->Writer.join();
+    VolumeWriterStats stats = pipeline->Stats;
+    stats.Seconds = GetSeconds() - pipeline->OpenTime;
+    delete pipeline;
+
+    FILE* file = writer->File;
+    if (!writer->State.empty()) {
+        uint64_t end = ftell(file);
+        static const char padding[VolumeAlignment] = {0};
+        writer->Header.StateOffset = AlignOffset(end);
+        writer->Header.StateSize = writer->State.size();
+        fwrite(padding, 1, size_t(writer->Header.StateOffset - end), file);
+        fwrite(&writer->State[0], 1, writer->State.size(), file);
+    }
+    writer->Header.FieldCount = uint32_t(writer->Fields.size());
+    writer->Header.TableOffset = ftell(file);
+    if (!writer->Fields.empty()) {
+        fwrite(&writer->Fields[0], sizeof(VolumeField), writer->Fields.size(), file);
+    }
+    fseek(file, 0, SEEK_SET);
+    fwrite(&writer->Header, sizeof(writer->Header), 1, file);
+    pezCheck(!ferror(file), "Unable to finish writing volume file.");
+    fclose(file);
+    delete writer;
+    return stats;
+}
+
+VolumeReader* OpenVolumeReader(const char* filename)
+{
+    FILE* file = fopen(filename, "rb");
+    pezCheck(file != 0, "Unable to open %s.", filename);
+
+    VolumeReader* reader = new VolumeReader;
+    reader->File = file;
+    size_t headerRead = fread(&reader->Header, sizeof(reader->Header), 1, file);
+    pezCheck(headerRead == 1 && !memcmp(reader->Header.Magic, VolumeMagic, sizeof(VolumeMagic)),
+             "%s is not a volume file.", filename);
+    pezCheck(reader->Header.Version <= VolumeVersion, "%s has unsupported version %d.",
+             filename, reader->Header.Version);
+
+    reader->Fields.resize(reader->Header.FieldCount);
+    if (reader->Header.FieldCount) {
+        fseek(file, long(reader->Header.TableOffset), SEEK_SET);
+        size_t fieldsRead = fread(&reader->Fields[0], sizeof(VolumeField), reader->Fields.size(), file);
+        pezCheck(fieldsRead == reader->Fields.size(), "Truncated field table in %s.", filename);
+    }
+    return reader;
+}
+
+const VolumeField* FindVolumeField(const VolumeReader* reader, const char* name, int frame)
+{
+    for (size_t i = 0; i < reader->Fields.size(); ++i) {
+        const VolumeField& field = reader->Fields[i];
+        if (int(field.Frame) == frame && !strncmp(field.Name, name, sizeof(field.Name))) {
+            return &field;
+        }
+    }
+    return 0;
+}
+
+void ReadVolumeField(const VolumeReader* reader, const VolumeField* field, void* dest)
+{
+    ReadVolumeSlices(reader, field, 0, reader->Header.Depth, dest);
+}
+
+// Reads the chunk table, then only the chunks that cover the requested slices.
+static void ReadChunkedSlices(const VolumeReader* reader, const VolumeField* field, int firstSlice, int sliceCount,
+                              size_t sliceSize, void* dest)
+{
+    ChunkHeader header;
+    fseek(reader->File, long(field->Offset), SEEK_SET);
+    size_t headerRead = fread(&header, sizeof(header), 1, reader->File);
+    pezCheck(headerRead == 1 && header.SliceSize == sliceSize, "Corrupt chunk table in the %s field.", field->Name);
+    std::vector<uint64_t> offsets(header.ChunkCount + 1);
+    size_t offsetsRead = fread(&offsets[0], sizeof(uint64_t), offsets.size(), reader->File);
+    pezCheck(offsetsRead == offsets.size(), "Corrupt chunk table in the %s field.", field->Name);
+
+    int firstChunk = firstSlice / SlicesPerChunk;
+    int lastChunk = (firstSlice + sliceCount - 1) / SlicesPerChunk;
+    uint64_t begin = offsets[firstChunk];
+    std::vector<unsigned char> chunks(size_t(offsets[lastChunk + 1] - begin));
+    fseek(reader->File, long(field->Offset + begin), SEEK_SET);
+    size_t bytesRead = fread(&chunks[0], 1, chunks.size(), reader->File);
+    pezCheck(bytesRead == chunks.size(), "Unable to read the %s field.", field->Name);
+    DecodeChunkRange(header, &offsets[0], &chunks[0], begin, firstSlice, sliceCount, dest);
+}
+
+// Reads the layer table, then only the layers of bricks that cover the requested slices.
+static void ReadBrickedSlices(const VolumeReader* reader, const VolumeField* field, int firstSlice, int sliceCount, void* dest)
+{
+    BrickHeader header;
+    fseek(reader->File, long(field->Offset), SEEK_SET);
+    size_t headerRead = fread(&header, sizeof(header), 1, reader->File);
+    pezCheck(headerRead == 1 && header.Depth == reader->Header.Depth && header.Channels == field->Channels,
+             "Corrupt brick table in the %s field.", field->Name);
+    std::vector<uint64_t> offsets((header.Depth + BrickSize - 1) / BrickSize + 1);
+    size_t offsetsRead = fread(&offsets[0], sizeof(uint64_t), offsets.size(), reader->File);
+    pezCheck(offsetsRead == offsets.size(), "Corrupt brick table in the %s field.", field->Name);
+
+    int firstLayer = firstSlice / BrickSize;
+    int lastLayer = (firstSlice + sliceCount - 1) / BrickSize;
+    uint64_t begin = offsets[firstLayer];
+    std::vector<unsigned char> layers(size_t(offsets[lastLayer + 1] - begin));
+    fseek(reader->File, long(field->Offset + begin), SEEK_SET);
+    size_t bytesRead = fread(&layers[0], 1, layers.size(), reader->File);
+    pezCheck(bytesRead == layers.size(), "Unable to read the %s field.", field->Name);
+    DecodeBrickRange(header, &offsets[0], &layers[0], begin, firstSlice, sliceCount, dest);
+}
+
+void ReadVolumeSlices(const VolumeReader* reader, const VolumeField* field, int firstSlice, int sliceCount, void* dest)
+{
+    size_t sliceSize = DecodedFieldSize(reader->Header, *field) / reader->Header.Depth;
+    pezCheck(firstSlice >= 0 && firstSlice + sliceCount <= int(reader->Header.Depth), "Slice range out of bounds.");
+
+    if (field->Encoding == EncodingRaw) {
+        fseek(reader->File, long(field->Offset + firstSlice * sliceSize), SEEK_SET);
+        size_t bytesRead = fread(dest, 1, sliceCount * sliceSize, reader->File);
+        pezCheck(bytesRead == sliceCount * sliceSize, "Unable to read the %s field.", field->Name);
+        return;
+    }
+
+    // Deltas rebuild the previous frame first, which recurses back to the nearest keyframe:
+    if (field->Encoding == EncodingLzfxDelta) {
+        const VolumeField* previous = FindVolumeField(reader, field->Name, int(field->Frame) - 1);
+        pezCheck(previous != 0, "Frame %d of the %s field has no keyframe.", int(field->Frame), field->Name);
+        ReadVolumeSlices(reader, previous, firstSlice, sliceCount, dest);
+        std::vector<unsigned char> delta(sliceCount * sliceSize);
+        ReadChunkedSlices(reader, field, firstSlice, sliceCount, sliceSize, &delta[0]);
+        XorInto((unsigned char*) dest, &delta[0], delta.size());
+        return;
+    }
+
+    if (field->Encoding == EncodingBricks) {
+        ReadBrickedSlices(reader, field, firstSlice, sliceCount, dest);
+        return;
+    }
+
+    pezCheck(field->Encoding == EncodingLzfx, "Unsupported encoding for the %s field.", field->Name);
+    ReadChunkedSlices(reader, field, firstSlice, sliceCount, sliceSize, dest);
+}
+
+void SetVolumeState(VolumeWriter* writer, const void* data, size_t size)
+{
+    const unsigned char* bytes = (const unsigned char*) data;
+    writer->State.assign(bytes, bytes + size);
+}
+
+bool ReadVolumeState(const VolumeReader* reader, std::vector<unsigned char>* state)
+{
+    const VolumeHeader& header = reader->Header;
+    if (header.Version < 6 || !header.StateSize) {
+        return false;
+    }
+    state->resize(size_t(header.StateSize));
+    fseek(reader->File, long(header.StateOffset), SEEK_SET);
+    size_t bytesRead = fread(&(*state)[0], 1, state->size(), reader->File);
+    pezCheck(bytesRead == state->size(), "Truncated state in volume file.");
+    return true;
+}
+
+void CloseVolumeReader(VolumeReader* reader)
+{
+    fclose(reader->File);
+    delete reader;
+}
+
+void BenchmarkVolumeFile(const char* filename)
+{
+    const int Repetitions = 5;
+    VolumeReader* reader = OpenVolumeReader(filename);
+    int depth = reader->Header.Depth;
+
+    // Totals are kept per field name so that density and velocity are reported separately.
+    // Deltas are measured against the previous frame of the same name, bricks at the default error bound.
+    struct Totals {
+        char Name[16];
+        double Raw, Packed, EncodeSeconds, DecodeSeconds, DeltaRaw, DeltaPacked, BrickPacked;
+        int Frame;
+        std::vector<unsigned char> Previous;
+    };
+    std::vector<Totals> totals;
+
+    for (size_t i = 0; i < reader->Fields.size(); ++i) {
+        const VolumeField& field = reader->Fields[i];
+        std::vector<unsigned char> raw(DecodedFieldSize(reader->Header, field));
+        std::vector<unsigned char> decoded(raw.size());
+        std::vector<unsigned char> payload;
+        ReadVolumeField(reader, &field, &raw[0]);
+
+        double start = GetSeconds();
+        for (int r = 0; r < Repetitions; ++r) {
+            EncodeChunks(&raw[0], depth, raw.size() / depth, &payload);
+        }
+        double encodeSeconds = (GetSeconds() - start) / Repetitions;
+
+        start = GetSeconds();
+        for (int r = 0; r < Repetitions; ++r) {
+            DecodeChunks(&payload[0], 0, depth, &decoded[0]);
+        }
+        double decodeSeconds = (GetSeconds() - start) / Repetitions;
+        pezCheck(decoded == raw, "Round trip of the %s field does not match.", field.Name);
+
+        size_t t = 0;
+        while (t < totals.size() && strncmp(totals[t].Name, field.Name, sizeof(field.Name))) {
+            ++t;
+        }
+        if (t == totals.size()) {
+            Totals entry = { "", 0, 0, 0, 0, 0, 0, 0, -1 };
+            memcpy(entry.Name, field.Name, sizeof(entry.Name));
+            totals.push_back(entry);
+        }
+        Totals& entry = totals[t];
+        entry.Raw += raw.size();
+        entry.Packed += payload.size();
+        entry.EncodeSeconds += encodeSeconds;
+        entry.DecodeSeconds += decodeSeconds;
+
+        if (field.Type == GL_HALF_FLOAT) {
+            const VolumeHeader& header = reader->Header;
+            EncodeBricks(&raw[0], header.Width, header.Height, depth, field.Channels, DefaultErrorBound, &payload);
+            entry.BrickPacked += payload.size();
+        }
+        if (entry.Frame == int(field.Frame) - 1 && entry.Previous.size() == raw.size()) {
+            std::vector<unsigned char> delta(raw);
+            XorInto(&delta[0], &entry.Previous[0], delta.size());
+            EncodeChunks(&delta[0], depth, delta.size() / depth, &payload, ComponentSize(field.Type));
+            entry.DeltaRaw += raw.size();
+            entry.DeltaPacked += payload.size();
+        }
+        entry.Frame = field.Frame;
+        entry.Previous.swap(raw);
+    }
+
+    // Push every field through a writer as well, to see what the threaded pipeline sustains without a disk.
+    // Fields are read one at a time, so the time includes decoding them; the writer copies each one it takes.
+    const VolumeHeader& header = reader->Header;
+    VolumeWriter* writer = OpenVolumeWriter("/dev/null", header.Width, header.Height, depth, header.Params, EncodingLzfxDelta);
+    std::vector<unsigned char> source;
+    for (size_t i = 0; i < reader->Fields.size(); ++i) {
+        const VolumeField& field = reader->Fields[i];
+        source.resize(DecodedFieldSize(header, field));
+        ReadVolumeField(reader, &field, &source[0]);
+        WriteVolumeField(writer, field.Name, field.Frame, field.Time, field.Type, field.Channels, &source[0], source.size());
+    }
+    VolumeWriterStats stats = CloseVolumeWriter(writer);
+    CloseVolumeReader(reader);
+
+    pezPrintString("%-12s %8s %12s %12s %12s %12s\n", "Field", "Ratio", "Encode GB/s", "Decode GB/s", "Delta ratio", "Brick ratio");
+    for (size_t t = 0; t < totals.size(); ++t) {
+        const Totals& f = totals[t];
+        pezPrintString("%-12.16s %8.2f %12.3f %12.3f %12.2f %12.2f\n", f.Name, f.Raw / f.Packed,
+                       f.Raw / f.EncodeSeconds * 1e-9, f.Raw / f.DecodeSeconds * 1e-9,
+                       f.DeltaPacked ? f.DeltaRaw / f.DeltaPacked : 0.0, f.BrickPacked ? f.Raw / f.BrickPacked : 0.0);
+    }
+    pezPrintString("Pipeline: %d fields on %d threads, %.3f GB/s sustained, %.3f GB/s per thread\n",
+                   stats.FieldCount, stats.Threads, stats.RawBytes / stats.Seconds * 1e-9,
+                   stats.RawBytes / stats.EncodeSeconds * 1e-9);
+}
@@ -0,0 +1,198 @@
+#pragma once
+#include "Utility.h"
+#include <stdint.h>
+#include <cstdio>
+#include <map>
+#include <string>
+
+// Volume files start with a VolumeHeader and end with a table of VolumeField entries.
+// The table is written last so that frames can be streamed; the header points to it.
+// Field payloads start on VolumeAlignment boundaries so that they can be mapped directly.
+// All values are little-endian.
+//
+// Encoded fields split their slices into chunks that are compressed independently.
+// Their payload begins with a ChunkHeader and ChunkCount + 1 offsets (relative to
+// the payload) so that any range of slices can be decoded without touching the rest.
+// A chunk whose stored size equals its decoded size is stored uncompressed.
+// Chunks with a ShuffleSize above 1 hold byte planes: byte 0 of every element, then byte 1, etc.
+//
+// Delta fields hold the XOR of their bits with the previous frame of the same field,
+// which is exact and leaves mostly zero high bytes for lzfx to collapse. A keyframe
+// (any field that is not a delta) is written every KeyframeInterval frames, so seeking
+// decodes at most that many fields.
+//
+// Bricked fields quantize every BrickSize^3 brick of every channel against its own range.
+// Their payload begins with a BrickHeader and one offset per layer of bricks, plus one.
+// Each brick channel starts with a BrickMode byte and is stored in the cheapest mode whose
+// decoded halves stay within ErrorBound of the originals, so constant bricks shrink to a
+// single value and noisy ones fall back to their exact halves.
+//
+// From version 5 the header also holds the params of every ensemble member, whose
+// layers are stacked along Z in member order.  Params repeats those of member 0.
+//
+// From version 6 a writer can also store a block of state that isn't a volume, such as
+// a checkpoint's emitters.  It sits between the last field and the table.
+
+const uint32_t VolumeVersion = 6;
+const uint64_t VolumeAlignment = 4096;
+const int SlicesPerChunk = 4;
+const int DefaultKeyframeInterval = 16;
+const int BrickSize = 8;
+const float DefaultErrorBound = 1.0f / 1024.0f;
+
+enum VolumeEncoding {
+    EncodingRaw,
+    EncodingLzfx,
+    EncodingLzfxDelta,
+    EncodingBricks,
+};
+
+enum BrickMode {
+    BrickConstant,  // One half.
+    Brick8,         // Float minimum and step, then 8-bit codes.
+    Brick12,        // Float minimum and step, then 12-bit codes packed in pairs.
+    BrickHalf,      // The original halves.
+};
+
+struct ChunkHeader {
+    uint32_t ChunkCount;
+    uint32_t SlicesPerChunk;
+    uint32_t SliceCount;
+    uint32_t ShuffleSize;
+    uint64_t SliceSize;
+};
+
+struct BrickHeader {
+    uint32_t Width;
+    uint32_t Height;
+    uint32_t Depth;
+    uint32_t Channels;
+    float ErrorBound;
+    uint32_t Reserved;
+};
+
+struct VolumeParams {
+    float Time;
+    float TimeStep;
+    float CellSize;
+    float AmbientTemperature;
+    float SplatRadius;
+    int32_t NumJacobiIterations;
+    float ImpulsePosition[3];
+    float ImpulseTemperature;
+    float ImpulseDensity;
+    float SmokeBuoyancy;
+    float SmokeWeight;
+    float TemperatureDissipation;
+    float VelocityDissipation;
+    float DensityDissipation;
+};
+
+struct VolumeHeader {
+    char Magic[4];
+    uint32_t Version;
+    uint32_t Width;
+    uint32_t Height;
+    uint32_t Depth;
+    uint32_t FieldCount;
+    uint64_t TableOffset;
+    VolumeParams Params;
+    uint32_t MemberCount;
+    uint32_t Reserved;
+    VolumeParams Members[MaxEnsembleSize];
+    uint64_t StateOffset;
+    uint64_t StateSize;
+};
+
+struct VolumeField {
+    char Name[16];
+    uint32_t Frame;
+    uint32_t Type;
+    uint32_t Channels;
+    uint32_t Encoding;
+    double Time;
+    uint64_t Offset;
+    uint64_t Size;
+};
+
+// The last frame written for each field name, which the next delta is taken against.
+struct DeltaBase {
+    int Frame;
+    std::vector<unsigned char> Data;
+};
+
+struct VolumeWriterStats {
+    int FieldCount;
+    int Threads;           // Encoder threads.
+    double RawBytes;       // Decoded size of every field written.
+    double EncodedBytes;   // Payload bytes, without alignment padding.
+    double Seconds;        // From open to close.
+    double EncodeSeconds;  // Summed over the encoder threads.
+    double WriteSeconds;
+};
+
+// Writers encode on a pool of threads shared by every writer and write on one of their
+// own, so WriteVolumeField only copies the field (and takes its delta) unless too much
+// is already queued.
+struct EncodePipeline;
+
+struct VolumeWriter {
+    FILE* File;
+    VolumeEncoding Encoding;
+    int KeyframeInterval;
+    float ErrorBound;
+    VolumeHeader Header;
+    std::vector<VolumeField> Fields;
+    std::map<std::string, DeltaBase> Previous;
+    std::vector<unsigned char> State;
+    EncodePipeline* Pipeline;
+};
+
+struct VolumeReader {
+    FILE* File;
+    VolumeHeader Header;
+    std::vector<VolumeField> Fields;
+};
+
+VolumeParams CurrentVolumeParams(double time, int member = 0);
+
+// Converts the params of every member recorded in a header, and returns how many there are.
+int ReadVolumeMembers(const VolumeHeader& header, MemberParams* members);
+
+// The header records the params of every current ensemble member, along with the given params.
+VolumeWriter* OpenVolumeWriter(const char* filename, int width, int height, int depth, VolumeParams params,
+                               VolumeEncoding encoding = EncodingRaw, int keyframeInterval = DefaultKeyframeInterval,
+                               float errorBound = DefaultErrorBound);
+void WriteVolumeField(VolumeWriter* writer, const char* name, int frame, double time, GLenum type, int channels, const void* data, size_t size);
+VolumeWriterStats CloseVolumeWriter(VolumeWriter* writer);
+
+// Replaces the state block that the writer stores on close.  ReadVolumeState returns
+// false if the file has none.
+void SetVolumeState(VolumeWriter* writer, const void* data, size_t size);
+bool ReadVolumeState(const VolumeReader* reader, std::vector<unsigned char>* state);
+
+VolumeReader* OpenVolumeReader(const char* filename);
+const VolumeField* FindVolumeField(const VolumeReader* reader, const char* name, int frame = 0);
+void ReadVolumeField(const VolumeReader* reader, const VolumeField* field, void* dest);
+void ReadVolumeSlices(const VolumeReader* reader, const VolumeField* field, int firstSlice, int sliceCount, void* dest);
+void CloseVolumeReader(VolumeReader* reader);
+int VolumeFieldChannels(const char* name);
+
+// Encodes slices of sliceSize bytes into a chunked payload, or decodes a range of them.
+void EncodeChunks(const void* data, int sliceCount, size_t sliceSize, std::vector<unsigned char>* payload, int shuffleSize = 1);
+void DecodeChunks(const void* payload, int firstSlice, int sliceCount, void* dest);
+
+// Quantizes a half-float volume into bricks, or decodes a range of its slices back to halves.
+void EncodeBricks(const void* data, int width, int height, int depth, int channels, float errorBound,
+                  std::vector<unsigned char>* payload);
+void DecodeBricks(const void* payload, int firstSlice, int sliceCount, void* dest);
+size_t DecodedFieldSize(const VolumeHeader& header, const VolumeField& field);
+
+// Decodes frames[frame] of a mapped volume file into current, which holds frames[*currentFrame] on entry.
+// Delta frames continue from current when it holds the previous frame, and otherwise replay from the nearest keyframe.
+void DecodeMappedFrame(const unsigned char* map, const VolumeHeader& header, const std::vector<VolumeField>& frames,
+                       int frame, std::vector<unsigned char>* current, int* currentFrame);
+
+// Reports the compression ratio and encode/decode throughput on every field of a volume file,
+// along with the ratios that deltas against the previous frame and default-bound bricks would achieve.
+void BenchmarkVolumeFile(const char* filename);
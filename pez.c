@@ -4,6 +4,14 @@
 #include "bstrlib.h"
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <unistd.h>
+#include <fcntl.h>
+#endif
 
 ///////////////////////////////////////////////////////////////////////////////
 // PRIVATE TYPES
@@ -15,14 +23,52 @@ typedef struct pezListRec
     struct pezListRec* Next;
 } pezList;
 
+// Parsed section sources live in a chain of large blocks that are freed all at once.
+typedef struct pezArenaRec
+{
+    struct pezArenaRec* Next;
+    size_t Used;
+    size_t Capacity;
+} pezArena;
+
+typedef struct pezHashEntryRec
+{
+    const char* Key;
+    const char* Value;
+    size_t KeyLength;
+    unsigned int Hash;
+} pezHashEntry;
+
+// Open-addressed table with linear probing; Capacity is always a power of two.
+typedef struct pezHashRec
+{
+    pezHashEntry* Entries;
+    size_t Capacity;
+    size_t Count;
+} pezHash;
+
+// One node per loaded effect file; Descriptor is the inotify watch on its folder.
+typedef struct pezWatchRec
+{
+    int Descriptor;
+    bstring FileName;
+    bstring EffectName;
+    struct pezWatchRec* Next;
+} pezWatch;
+
 typedef struct pezContextRec
 {
     bstring ErrorMessage;
     bstring KeyPrefix;
     pezList* TokenMap;
-    pezList* ShaderMap;
-    pezList* LoadedEffects;
     pezList* PathList;
+    pezHash ShaderMap;
+    pezHash LoadedEffects;
+    pezArena* Arena;
+    int WatchFd;
+    pezWatch* Watches;
+    pezList* ChangedEffects;
+    bstring ChangedEffect;
 } pezContext;
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -30,6 +76,8 @@ typedef struct pezContextRec
 
 static pezContext* __pez__Context = 0;
 
+static const size_t __pez__ArenaBlockSize = 64 * 1024;
+
 ///////////////////////////////////////////////////////////////////////////////
 // PRIVATE FUNCTIONS
 
@@ -54,11 +102,396 @@ static void __pez__FreeList(pezList* pNode)
     }
 }
 
+static char* __pez__ArenaAlloc(pezContext* gc, size_t size)
+{
+    pezArena* block = gc->Arena;
+    char* p;
+
+    if (!block || block->Capacity - block->Used < size)
+    {
+        size_t capacity = size > __pez__ArenaBlockSize ? size : __pez__ArenaBlockSize;
+        block = (pezArena*) malloc(sizeof(pezArena) + capacity);
+        block->Next = gc->Arena;
+        block->Used = 0;
+        block->Capacity = capacity;
+        gc->Arena = block;
+    }
+
+    p = (char*) (block + 1) + block->Used;
+    block->Used += size;
+    return p;
+}
+
+static void __pez__FreeArena(pezArena* block)
+{
+    while (block)
+    {
+        pezArena* pNext = block->Next;
+        free(block);
+        block = pNext;
+    }
+}
+
+// FNV-1a
+static unsigned int __pez__Hash(const char* key, size_t length)
+{
+    unsigned int hash = 2166136261u;
+    size_t i;
+    for (i = 0; i < length; i++)
+    {
+        hash ^= (unsigned char) key[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static pezHashEntry* __pez__HashProbe(pezHash* table, const char* key, size_t length, unsigned int hash)
+{
+    size_t mask = table->Capacity - 1;
+    size_t slot = hash & mask;
+
+    while (table->Entries[slot].Key)
+    {
+        pezHashEntry* entry = &table->Entries[slot];
+        if (entry->Hash == hash && entry->KeyLength == length && 0 == memcmp(entry->Key, key, length))
+        {
+            break;
+        }
+        slot = (slot + 1) & mask;
+    }
+
+    return &table->Entries[slot];
+}
+
+static const char* __pez__HashFind(pezHash* table, const char* key, size_t length)
+{
+    if (!table->Count)
+    {
+        return 0;
+    }
+
+    return __pez__HashProbe(table, key, length, __pez__Hash(key, length))->Value;
+}
+
+// The key must outlive the table (it normally lives in the arena).
+// Inserting an existing key replaces its value, so later sections win.
+static void __pez__HashInsert(pezHash* table, const char* key, size_t length, const char* value)
+{
+    unsigned int hash = __pez__Hash(key, length);
+    pezHashEntry* entry;
+
+    if ((table->Count + 1) * 4 > table->Capacity * 3)
+    {
+        pezHashEntry* oldEntries = table->Entries;
+        size_t oldCapacity = table->Capacity;
+        size_t i;
+
+        table->Capacity = oldCapacity ? oldCapacity * 2 : 64;
+        table->Entries = (pezHashEntry*) calloc(table->Capacity, sizeof(pezHashEntry));
+        for (i = 0; i < oldCapacity; i++)
+        {
+            if (oldEntries[i].Key)
+            {
+                *__pez__HashProbe(table, oldEntries[i].Key, oldEntries[i].KeyLength, oldEntries[i].Hash) = oldEntries[i];
+            }
+        }
+        free(oldEntries);
+    }
+
+    entry = __pez__HashProbe(table, key, length, hash);
+    if (!entry->Key)
+    {
+        entry->Key = key;
+        entry->KeyLength = length;
+        entry->Hash = hash;
+        table->Count++;
+    }
+    entry->Value = value;
+}
+
+static void __pez__FreeHash(pezHash* table)
+{
+    free(table->Entries);
+    table->Entries = 0;
+    table->Capacity = table->Count = 0;
+}
+
+// Open addressing has no cheap removal, so the table is rebuilt without the given effect's
+// keys.  Their arena storage stays put until shutdown; reloads are rare.
+static void __pez__HashRemoveEffect(pezHash* table, bstring effectName)
+{
+    pezHash rebuilt = { 0, 0, 0 };
+    size_t nameLength = blength(effectName);
+    size_t i;
+
+    for (i = 0; i < table->Capacity; i++)
+    {
+        const pezHashEntry* entry = &table->Entries[i];
+        if (entry->Key &&
+            !(entry->KeyLength >= nameLength && 0 == memcmp(entry->Key, effectName->data, nameLength) &&
+              (entry->KeyLength == nameLength || entry->Key[nameLength] == '.')))
+        {
+            __pez__HashInsert(&rebuilt, entry->Key, entry->KeyLength, entry->Value);
+        }
+    }
+
+    __pez__FreeHash(table);
+    *table = rebuilt;
+}
+
+static void __pez__FreeWatches(pezWatch* pNode)
+{
+    while (pNode)
+    {
+        pezWatch* pNext = pNode->Next;
+        bdestroy(pNode->FileName);
+        bdestroy(pNode->EffectName);
+        free(pNode);
+        pNode = pNext;
+    }
+}
+
+// Watches the folder rather than the file, since editors often save by renaming
+// a new file over the old one.
+static void __pez__WatchEffect(pezContext* gc, bstring effectName, bstring effectFile)
+{
+#ifdef __linux__
+    int slash = bstrrchr(effectFile, '/');
+    bstring folder = slash == BSTR_ERR ? bfromcstr(".") : bmidstr(effectFile, 0, slash + 1);
+    pezWatch* watch;
+    int descriptor;
+
+    if (gc->WatchFd < 0)
+    {
+        bdestroy(folder);
+        return;
+    }
+
+    descriptor = inotify_add_watch(gc->WatchFd, (const char*) folder->data, IN_CLOSE_WRITE | IN_MOVED_TO);
+    bdestroy(folder);
+    if (descriptor < 0)
+    {
+        return;
+    }
+
+    watch = (pezWatch*) calloc(sizeof(pezWatch), 1);
+    watch->Descriptor = descriptor;
+    watch->FileName = bmidstr(effectFile, slash == BSTR_ERR ? 0 : slash + 1, blength(effectFile));
+    watch->EffectName = bstrcpy(effectName);
+    watch->Next = gc->Watches;
+    gc->Watches = watch;
+#endif
+}
+
+// Drains pending inotify events into gc->ChangedEffects, once per effect.
+static void __pez__ReadWatchEvents(pezContext* gc)
+{
+#ifdef __linux__
+    char buffer[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    ssize_t length;
+
+    if (gc->WatchFd < 0)
+    {
+        return;
+    }
+
+    while ((length = read(gc->WatchFd, buffer, sizeof(buffer))) > 0)
+    {
+        char* p = buffer;
+        while (p < buffer + length)
+        {
+            const struct inotify_event* event = (const struct inotify_event*) p;
+            pezWatch* watch;
+            p += sizeof(struct inotify_event) + event->len;
+
+            for (watch = gc->Watches; watch && event->len; watch = watch->Next)
+            {
+                pezList* pChanged;
+                if (watch->Descriptor != event->wd || 0 != strcmp((const char*) watch->FileName->data, event->name))
+                {
+                    continue;
+                }
+
+                for (pChanged = gc->ChangedEffects; pChanged; pChanged = pChanged->Next)
+                {
+                    if (1 == biseq(pChanged->Key, watch->EffectName))
+                    {
+                        break;
+                    }
+                }
+
+                if (!pChanged)
+                {
+                    pChanged = (pezList*) calloc(sizeof(pezList), 1);
+                    pChanged->Key = bstrcpy(watch->EffectName);
+                    pChanged->Next = gc->ChangedEffects;
+                    gc->ChangedEffects = pChanged;
+                }
+            }
+        }
+    }
+#endif
+}
+
+static int __pez__MatchesToken(bstring key, const char* token, size_t length)
+{
+    return (size_t) blength(key) == length && 0 == memcmp(key->data, token, length);
+}
+
+// Copies one section of an effect file into the arena, prefixed with its directives and
+// a #line, and registers it under "Effect.Section".
+static void __pez__AddSection(pezContext* gc, bstring effectName, const char* name, size_t nameLength,
+                              int lineNo, const char* body, const char* bodyEnd)
+{
+    const pezList* directives[64];
+    int directiveCount = 0;
+    char lineDirective[32];
+    size_t keyLength = blength(effectName) + 1 + nameLength;
+    size_t bodyLength = bodyEnd - body;
+    size_t valueLength;
+    const pezList* pTokenMapping;
+    char* key;
+    char* value;
+    char* p;
+    int i;
+
+    // Gather the matching directives; TokenMap is newest-first, but they are emitted in the
+    // order they were added.
+    for (pTokenMapping = gc->TokenMap; pTokenMapping && directiveCount < 64; pTokenMapping = pTokenMapping->Next)
+    {
+        // An empty key in the token mapping means "always prepend this directive".
+        // The effect name itself is also checked against the token mapping.
+        int matched =
+            0 == blength(pTokenMapping->Key) ||
+            (1 == blength(pTokenMapping->Key) && '*' == bchar(pTokenMapping->Key, 0)) ||
+            1 == biseq(pTokenMapping->Key, effectName);
+
+        // Check all tokens in the current section divider for a mapped token.
+        const char* token = name;
+        while (!matched && token <= name + nameLength)
+        {
+            const char* tokenEnd = (const char*) memchr(token, '.', name + nameLength - token);
+            if (!tokenEnd)
+            {
+                tokenEnd = name + nameLength;
+            }
+            matched = __pez__MatchesToken(pTokenMapping->Key, token, tokenEnd - token);
+            token = tokenEnd + 1;
+        }
+
+        if (matched)
+        {
+            directives[directiveCount++] = pTokenMapping;
+        }
+    }
+
+    sprintf(lineDirective, "#line %d\n", lineNo);
+
+    valueLength = strlen(lineDirective) + bodyLength + 1;
+    for (i = 0; i < directiveCount; i++)
+    {
+        valueLength += blength(directives[i]->Value);
+    }
+
+    key = __pez__ArenaAlloc(gc, keyLength + 1 + valueLength + 1);
+    memcpy(key, effectName->data, blength(effectName));
+    key[blength(effectName)] = '.';
+    memcpy(key + blength(effectName) + 1, name, nameLength);
+    key[keyLength] = 0;
+
+    value = p = key + keyLength + 1;
+    for (i = directiveCount - 1; i >= 0; i--)
+    {
+        memcpy(p, directives[i]->Value->data, blength(directives[i]->Value));
+        p += blength(directives[i]->Value);
+    }
+    memcpy(p, lineDirective, strlen(lineDirective));
+    p += strlen(lineDirective);
+    memcpy(p, body, bodyLength);
+    p += bodyLength;
+    if (bodyLength && body[bodyLength - 1] != '\n')
+    {
+        *p++ = '\n';
+    }
+    *p = 0;
+
+    __pez__HashInsert(&gc->ShaderMap, key, keyLength, value);
+}
+
+// Splits an effect file into sections by scanning the file buffer in place.
+static void __pez__ParseEffect(pezContext* gc, bstring effectName, bstring effectContents)
+{
+    const char* data = (const char*) effectContents->data;
+    const char* end = data + blength(effectContents);
+    const char* line = data;
+    const char* sectionName = 0;
+    const char* sectionBody = 0;
+    size_t sectionNameLength = 0;
+    int sectionLine = 0;
+    int lineNo;
+
+    for (lineNo = 0; line < end; lineNo++)
+    {
+        const char* lineEnd = (const char*) memchr(line, '\n', end - line);
+        const char* next;
+        if (!lineEnd)
+        {
+            lineEnd = end;
+        }
+        next = lineEnd < end ? lineEnd + 1 : end;
+
+        // If the line starts with "--", then it marks a new section
+        if (lineEnd - line >= 2 && line[0] == '-' && line[1] == '-')
+        {
+            // Find the first character in [A-Za-z0-9_].
+            const char* col = line + 2;
+            while (col < lineEnd && !__pez__Alphanumeric(*col))
+            {
+                col++;
+            }
+
+            if (sectionName)
+            {
+                __pez__AddSection(gc, effectName, sectionName, sectionNameLength, sectionLine, sectionBody, line);
+            }
+
+            // If there's no alphanumeric character,
+            // then this marks the start of a new comment block.
+            if (col >= lineEnd)
+            {
+                sectionName = 0;
+            }
+            else
+            {
+                // Keep reading until a non-alphanumeric character is found.
+                const char* endCol = col;
+                while (endCol < lineEnd && __pez__Alphanumeric(*endCol))
+                {
+                    endCol++;
+                }
+
+                sectionName = col;
+                sectionNameLength = endCol - col;
+                sectionLine = lineNo;
+                sectionBody = next;
+            }
+        }
+
+        line = next;
+    }
+
+    if (sectionName)
+    {
+        __pez__AddSection(gc, effectName, sectionName, sectionNameLength, sectionLine, sectionBody, end);
+    }
+}
+
 static bstring __pez__LoadEffectContents(pezContext* gc, bstring effectName)
 {
     FILE* fp = 0;
     bstring effectFile, effectContents;
     pezList* pPathList = gc->PathList;
+    char* loadedName;
     
     while (pPathList)
     {
@@ -73,23 +506,22 @@ static bstring __pez__LoadEffectContents(pezContext* gc, bstring effectName)
         }
             
         pPathList = pPathList->Next;
+        bdestroy(effectFile);
+        effectFile = 0;
     }
 
     if (!fp)
     {
         bdestroy(gc->ErrorMessage);
-        gc->ErrorMessage = bformat("Unable to open effect file '%s'.", effectFile->data);
-        bdestroy(effectFile);
+        gc->ErrorMessage = bformat("Unable to open effect file '%s'.", effectName->data);
         return 0;
     }
     
-    // Add a new entry to the front of gc->LoadedEffects
-    {
-        pezList* temp = gc->LoadedEffects;
-        gc->LoadedEffects = (pezList*) calloc(sizeof(pezList), 1);
-        gc->LoadedEffects->Key = bstrcpy(effectName);
-        gc->LoadedEffects->Next = temp;
-    }
+    // Remember that this effect has been loaded
+    loadedName = __pez__ArenaAlloc(gc, blength(effectName) + 1);
+    memcpy(loadedName, effectName->data, blength(effectName) + 1);
+    __pez__HashInsert(&gc->LoadedEffects, loadedName, blength(effectName), loadedName);
+    __pez__WatchEffect(gc, effectName, effectFile);
     
     // Read in the effect file
     effectContents = bread((bNread) fread, fp);
@@ -112,6 +544,11 @@ int pezSwInit(const char* keyPrefix)
 
     __pez__Context = (pezContext*) calloc(sizeof(pezContext), 1);
     __pez__Context->KeyPrefix = bfromcstr(keyPrefix);
+#ifdef __linux__
+    __pez__Context->WatchFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+#else
+    __pez__Context->WatchFd = -1;
+#endif
     
     pezSwAddPath("", "");
 
@@ -131,9 +568,20 @@ int pezSwShutdown()
     bdestroy(gc->KeyPrefix);
 
     __pez__FreeList(gc->TokenMap);
-    __pez__FreeList(gc->ShaderMap);
-    __pez__FreeList(gc->LoadedEffects);
     __pez__FreeList(gc->PathList);
+    __pez__FreeHash(&gc->ShaderMap);
+    __pez__FreeHash(&gc->LoadedEffects);
+    __pez__FreeArena(gc->Arena);
+    __pez__FreeWatches(gc->Watches);
+    __pez__FreeList(gc->ChangedEffects);
+    bdestroy(gc->ChangedEffect);
+
+#ifdef __linux__
+    if (gc->WatchFd >= 0)
+    {
+        close(gc->WatchFd);
+    }
+#endif
 
     free(gc);
     __pez__Context = 0;
@@ -164,12 +612,10 @@ const char* pezGetShader(const char* pEffectKey)
 {
     pezContext* gc = __pez__Context;
     bstring effectKey;
-    pezList* closestMatch = 0;
-    struct bstrList* tokens;
-    bstring effectName;
-    pezList* pLoadedEffect;
-    pezList* pShaderEntry;
-    bstring shaderKey = 0;
+    int nameLength;
+    const char* closestMatch = 0;
+    const char* key;
+    int keyLength;
 
     if (!gc)
     {
@@ -179,159 +625,46 @@ const char* pezGetShader(const char* pEffectKey)
     // Extract the effect name from the effect key
     effectKey = bfromcstr(pEffectKey);
     binsert(effectKey, 0, gc->KeyPrefix, '?');
-    tokens = bsplit(effectKey, '.');
-    if (!tokens || !tokens->qty)
+    nameLength = bstrchr(effectKey, '.');
+    if (nameLength == BSTR_ERR)
+    {
+        nameLength = blength(effectKey);
+    }
+    if (!nameLength)
     {
         bdestroy(gc->ErrorMessage);
         gc->ErrorMessage = bformat("Malformed effect key key '%s'.", pEffectKey);
-        bstrListDestroy(tokens);
         bdestroy(effectKey);
         return 0;
     }
-    effectName = tokens->entry[0];
-
-    // Check if we already loaded this effect file
-    pLoadedEffect = gc->LoadedEffects;
-    while (pLoadedEffect)
-    {
-        if (1 == biseq(pLoadedEffect->Key, effectName))
-        {
-            break;
-        }
-        pLoadedEffect = pLoadedEffect->Next;
-    }
 
     // If we haven't loaded this file yet, load it in
-    if (!pLoadedEffect)
+    key = (const char*) effectKey->data;
+    if (!__pez__HashFind(&gc->LoadedEffects, key, nameLength))
     {
+        bstring effectName = bmidstr(effectKey, 0, nameLength);
         bstring effectContents = __pez__LoadEffectContents(gc, effectName);
-        struct bstrList* lines = bsplit(effectContents, '\n');
-        int lineNo;
-
-        bdestroy(effectContents);
-        effectContents = 0;
 
-        for (lineNo = 0; lines && lineNo < lines->qty; lineNo++)
+        if (effectContents)
         {
-            bstring line = lines->entry[lineNo];
-
-            // If the line starts with "--", then it marks a new section
-            if (blength(line) >= 2 && line->data[0] == '-' && line->data[1] == '-')
-            {
-                // Find the first character in [A-Za-z0-9_].
-                int colNo;
-                for (colNo = 2; colNo < blength(line); colNo++)
-                {
-                    char c = line->data[colNo];
-                    if (__pez__Alphanumeric(c))
-                    {
-                        break;
-                    }
-                }
-
-                // If there's no alphanumeric character,
-                // then this marks the start of a new comment block.
-                if (colNo >= blength(line))
-                {
-                    bdestroy(shaderKey);
-                    shaderKey = 0;
-                }
-                else
-                {
-                    // Keep reading until a non-alphanumeric character is found.
-                    int endCol;
-                    for (endCol = colNo; endCol < blength(line); endCol++)
-                    {
-                        char c = line->data[endCol];
-                        if (!__pez__Alphanumeric(c))
-                        {
-                            break;
-                        }
-                    }
-
-                    bdestroy(shaderKey);
-                    shaderKey = bmidstr(line, colNo, endCol - colNo);
-
-                    // Add a new entry to the shader map.
-                    {
-                        pezList* temp = gc->ShaderMap;
-                        gc->ShaderMap = (pezList*) calloc(sizeof(pezList), 1);
-                        gc->ShaderMap->Key = bstrcpy(shaderKey);
-                        gc->ShaderMap->Next = temp;
-                        gc->ShaderMap->Value = bformat("#line %d\n", lineNo);
-
-                        binsertch(gc->ShaderMap->Key, 0, 1, '.');
-                        binsert(gc->ShaderMap->Key, 0, effectName, '?');
-                    }
-
-                    // Check for a version mapping.
-                    if (gc->TokenMap)
-                    {
-                        struct bstrList* tokens = bsplit(shaderKey, '.');
-                        pezList* pTokenMapping = gc->TokenMap;
-
-                        while (pTokenMapping)
-                        {
-                            bstring directive = 0;
-                            int tokenIndex;
-
-                            // An empty key in the token mapping means "always prepend this directive".
-                            // The effect name itself is also checked against the token mapping.
-                            if (0 == blength(pTokenMapping->Key) ||
-                                (1 == blength(pTokenMapping->Key) && '*' == bchar(pTokenMapping->Key, 0)) ||
-                                1 == biseq(pTokenMapping->Key, effectName))
-                            {
-                                directive = pTokenMapping->Value;
-                                binsert(gc->ShaderMap->Value, 0, directive, '?');
-                            }
-
-                            // Check all tokens in the current section divider for a mapped token.
-                            for (tokenIndex = 0; tokenIndex < tokens->qty && !directive; tokenIndex++)
-                            {
-                                bstring token = tokens->entry[tokenIndex];
-                                if (1 == biseq(pTokenMapping->Key, token))
-                                {
-                                    directive = pTokenMapping->Value;
-                                    binsert(gc->ShaderMap->Value, 0, directive, '?');
-                                }
-                            }
-
-                            pTokenMapping = pTokenMapping->Next;
-                        }
-
-                        bstrListDestroy(tokens);
-                    }
-                }
-
-                continue;
-            }
-            if (shaderKey)
-            {
-                bconcat(gc->ShaderMap->Value, line);
-                bconchar(gc->ShaderMap->Value, '\n');
-            }
+            __pez__ParseEffect(gc, effectName, effectContents);
         }
 
-        // Cleanup
-        bstrListDestroy(lines);
-        bdestroy(shaderKey);
+        bdestroy(effectContents);
+        bdestroy(effectName);
     }
 
-    // Find the longest matching shader key
-    pShaderEntry = gc->ShaderMap;
-
-    while (pShaderEntry)
+    // Find the longest section key that prefixes the effect key, trimming
+    // one dot-separated token at a time.
+    keyLength = blength(effectKey);
+    while (keyLength > nameLength && !closestMatch)
     {
-        if (binstr(effectKey, 0, pShaderEntry->Key) == 0 &&
-            (!closestMatch || blength(pShaderEntry->Key) > blength(closestMatch->Key)))
+        closestMatch = __pez__HashFind(&gc->ShaderMap, key, keyLength);
+        while (keyLength > nameLength && key[--keyLength] != '.')
         {
-            closestMatch = pShaderEntry;
         }
-
-        pShaderEntry = pShaderEntry->Next;
     }
 
-    bstrListDestroy(tokens);
     bdestroy(effectKey);
 
     if (!closestMatch)
@@ -341,7 +674,52 @@ const char* pezGetShader(const char* pEffectKey)
         return 0;
     }
 
-    return (const char*) closestMatch->Value->data;
+    return closestMatch;
+}
+
+const char* pezPollShaderChange()
+{
+    pezContext* gc = __pez__Context;
+    pezList* pChanged;
+    pezWatch** ppWatch;
+
+    if (!gc)
+    {
+        return 0;
+    }
+
+    __pez__ReadWatchEvents(gc);
+    pChanged = gc->ChangedEffects;
+    if (!pChanged)
+    {
+        return 0;
+    }
+    gc->ChangedEffects = pChanged->Next;
+
+    // Forget the effect so that the next pezGetShader re-reads it; that load re-adds the watch.
+    __pez__HashRemoveEffect(&gc->ShaderMap, pChanged->Key);
+    __pez__HashRemoveEffect(&gc->LoadedEffects, pChanged->Key);
+    ppWatch = &gc->Watches;
+    while (*ppWatch)
+    {
+        pezWatch* watch = *ppWatch;
+        if (1 == biseq(watch->EffectName, pChanged->Key))
+        {
+            *ppWatch = watch->Next;
+            watch->Next = 0;
+            __pez__FreeWatches(watch);
+        }
+        else
+        {
+            ppWatch = &watch->Next;
+        }
+    }
+
+    bdestroy(gc->ChangedEffect);
+    gc->ChangedEffect = pChanged->Key;
+    pChanged->Key = 0;
+    __pez__FreeList(pChanged);
+    return (const char*) gc->ChangedEffect->data;
 }
 
 const char* pezSwGetError()
@@ -376,6 +754,149 @@ int pezSwAddDirective(const char* token, const char* directive)
 
     return 1;
 }
+
+///////////////////////////////////////////////////////////////////////////////
+// TIMING STATISTICS
+
+#define PEZ_TIMING_WINDOW 512
+
+// Bucket 0 holds everything under a microsecond; after that every octave up to ~4 seconds
+// is split into eight buckets, so percentiles are accurate to about 6%.
+#define PEZ_TIMING_BUCKETS (1 + 23 * 8)
+
+typedef struct pezTimingChannelRec
+{
+    unsigned long long Samples[PEZ_TIMING_WINDOW];
+    int Buckets[PEZ_TIMING_BUCKETS];
+    unsigned long long Sum;
+    int Count;
+    int Next;
+} pezTimingChannel;
+
+static pezTimingChannel __pez__Timings[PEZ_TIME_CHANNELS];
+static pthread_mutex_t __pez__TimingLock = PTHREAD_MUTEX_INITIALIZER;
+
+static int __pez__TimingBucket(unsigned long long nanoseconds)
+{
+    int octave = 0;
+    if (nanoseconds < 1024)
+    {
+        return 0;
+    }
+    while ((nanoseconds >> (octave + 11)) != 0)
+    {
+        octave++;
+    }
+    if (octave > 22)
+    {
+        return PEZ_TIMING_BUCKETS - 1;
+    }
+    return 1 + octave * 8 + (int) ((nanoseconds >> (octave + 7)) & 7);
+}
+
+// Returns the middle of a bucket, in milliseconds.
+static double __pez__TimingBucketCenter(int bucket)
+{
+    int octave, step;
+    double width;
+    if (bucket == 0)
+    {
+        return 0.0005;
+    }
+    octave = (bucket - 1) / 8;
+    step = (bucket - 1) % 8;
+    width = ldexp(1.0, octave + 7);
+    return (ldexp(1.0, octave + 10) + (step + 0.5) * width) * 1e-6;
+}
+
+void pezRecordTiming(int channel, unsigned long long nanoseconds)
+{
+    pezTimingChannel* timing = &__pez__Timings[channel];
+
+    pthread_mutex_lock(&__pez__TimingLock);
+    if (timing->Count == PEZ_TIMING_WINDOW)
+    {
+        unsigned long long evicted = timing->Samples[timing->Next];
+        timing->Buckets[__pez__TimingBucket(evicted)]--;
+        timing->Sum -= evicted;
+    }
+    else
+    {
+        timing->Count++;
+    }
+    timing->Samples[timing->Next] = nanoseconds;
+    timing->Buckets[__pez__TimingBucket(nanoseconds)]++;
+    timing->Sum += nanoseconds;
+    timing->Next = (timing->Next + 1) % PEZ_TIMING_WINDOW;
+    pthread_mutex_unlock(&__pez__TimingLock);
+}
+
+PezTimingStats pezGetTimingStats(int channel)
+{
+    const pezTimingChannel* timing = &__pez__Timings[channel];
+    PezTimingStats stats;
+    double* percentiles[3];
+    double fractions[3] = { 0.50, 0.95, 0.99 };
+    unsigned long long longest = 0;
+    int bucket, cumulative, i;
+
+    memset(&stats, 0, sizeof(stats));
+    percentiles[0] = &stats.P50;
+    percentiles[1] = &stats.P95;
+    percentiles[2] = &stats.P99;
+
+    pthread_mutex_lock(&__pez__TimingLock);
+    stats.Count = timing->Count;
+    if (timing->Count)
+    {
+        stats.Mean = timing->Sum * 1e-6 / timing->Count;
+        for (i = 0; i < timing->Count; i++)
+        {
+            longest = timing->Samples[i] > longest ? timing->Samples[i] : longest;
+        }
+        stats.Max = longest * 1e-6;
+
+        for (i = 0, bucket = 0, cumulative = 0; i < 3; i++)
+        {
+            int rank = (int) ceil(fractions[i] * timing->Count);
+            while (cumulative + timing->Buckets[bucket] < rank)
+            {
+                cumulative += timing->Buckets[bucket++];
+            }
+            *percentiles[i] = __pez__TimingBucketCenter(bucket);
+            if (*percentiles[i] > stats.Max)
+            {
+                *percentiles[i] = stats.Max;
+            }
+        }
+    }
+    pthread_mutex_unlock(&__pez__TimingLock);
+
+    return stats;
+}
+
+void pezLogTimings()
+{
+    static const char* names[PEZ_TIME_CHANNELS] = { "frame", "update", "render", "simulate" };
+    char line[512];
+    int length = 0;
+    int channel;
+
+    for (channel = 0; channel < PEZ_TIME_CHANNELS; channel++)
+    {
+        PezTimingStats stats = pezGetTimingStats(channel);
+        if (stats.Count)
+        {
+            length += snprintf(line + length, sizeof(line) - length, "%s%s %.2f/%.2f/%.2f",
+                               length ? ", " : "", names[channel], stats.P50, stats.P95, stats.P99);
+        }
+    }
+
+    if (length)
+    {
+        pezPrintString("Timings in ms (p50/p95/p99): %s\n", line);
+    }
+}
 /*
  * Copyright (c) 2009 Andrew Collette <andrew.collette at gmail.com>
  * http://lzfx.googlecode.com
@@ -876,6 +1397,78 @@ void pezFreePixels(PezPixels pixels)
     free(pixels.RawHeader);
 }
 
+// Printable ASCII in a 5x7 font; each glyph is five columns with the top row in bit 0.
+static const unsigned char __pez__Font[95][5] = {
+    {0x00, 0x00, 0x00, 0x00, 0x00}, {0x00, 0x00, 0x5f, 0x00, 0x00}, {0x00, 0x07, 0x00, 0x07, 0x00}, {0x14, 0x7f, 0x14, 0x7f, 0x14},
+    {0x24, 0x2a, 0x7f, 0x2a, 0x12}, {0x23, 0x13, 0x08, 0x64, 0x62}, {0x36, 0x49, 0x55, 0x22, 0x50}, {0x00, 0x05, 0x03, 0x00, 0x00},
+    {0x00, 0x1c, 0x22, 0x41, 0x00}, {0x00, 0x41, 0x22, 0x1c, 0x00}, {0x08, 0x2a, 0x1c, 0x2a, 0x08}, {0x08, 0x08, 0x3e, 0x08, 0x08},
+    {0x00, 0x50, 0x30, 0x00, 0x00}, {0x08, 0x08, 0x08, 0x08, 0x08}, {0x00, 0x60, 0x60, 0x00, 0x00}, {0x20, 0x10, 0x08, 0x04, 0x02},
+    {0x3e, 0x51, 0x49, 0x45, 0x3e}, {0x00, 0x42, 0x7f, 0x40, 0x00}, {0x42, 0x61, 0x51, 0x49, 0x46}, {0x21, 0x41, 0x45, 0x4b, 0x31},
+    {0x18, 0x14, 0x12, 0x7f, 0x10}, {0x27, 0x45, 0x45, 0x45, 0x39}, {0x3c, 0x4a, 0x49, 0x49, 0x30}, {0x01, 0x71, 0x09, 0x05, 0x03},
+    {0x36, 0x49, 0x49, 0x49, 0x36}, {0x06, 0x49, 0x49, 0x29, 0x1e}, {0x00, 0x36, 0x36, 0x00, 0x00}, {0x00, 0x56, 0x36, 0x00, 0x00},
+    {0x08, 0x14, 0x22, 0x41, 0x00}, {0x14, 0x14, 0x14, 0x14, 0x14}, {0x00, 0x41, 0x22, 0x14, 0x08}, {0x02, 0x01, 0x51, 0x09, 0x06},
+    {0x32, 0x49, 0x79, 0x41, 0x3e}, {0x7e, 0x11, 0x11, 0x11, 0x7e}, {0x7f, 0x49, 0x49, 0x49, 0x36}, {0x3e, 0x41, 0x41, 0x41, 0x22},
+    {0x7f, 0x41, 0x41, 0x22, 0x1c}, {0x7f, 0x49, 0x49, 0x49, 0x41}, {0x7f, 0x09, 0x09, 0x01, 0x01}, {0x3e, 0x41, 0x41, 0x51, 0x32},
+    {0x7f, 0x08, 0x08, 0x08, 0x7f}, {0x00, 0x41, 0x7f, 0x41, 0x00}, {0x20, 0x40, 0x41, 0x3f, 0x01}, {0x7f, 0x08, 0x14, 0x22, 0x41},
+    {0x7f, 0x40, 0x40, 0x40, 0x40}, {0x7f, 0x02, 0x04, 0x02, 0x7f}, {0x7f, 0x04, 0x08, 0x10, 0x7f}, {0x3e, 0x41, 0x41, 0x41, 0x3e},
+    {0x7f, 0x09, 0x09, 0x09, 0x06}, {0x3e, 0x41, 0x51, 0x21, 0x5e}, {0x7f, 0x09, 0x19, 0x29, 0x46}, {0x46, 0x49, 0x49, 0x49, 0x31},
+    {0x01, 0x01, 0x7f, 0x01, 0x01}, {0x3f, 0x40, 0x40, 0x40, 0x3f}, {0x1f, 0x20, 0x40, 0x20, 0x1f}, {0x7f, 0x20, 0x18, 0x20, 0x7f},
+    {0x63, 0x14, 0x08, 0x14, 0x63}, {0x03, 0x04, 0x78, 0x04, 0x03}, {0x61, 0x51, 0x49, 0x45, 0x43}, {0x00, 0x7f, 0x41, 0x41, 0x00},
+    {0x02, 0x04, 0x08, 0x10, 0x20}, {0x00, 0x41, 0x41, 0x7f, 0x00}, {0x04, 0x02, 0x01, 0x02, 0x04}, {0x40, 0x40, 0x40, 0x40, 0x40},
+    {0x00, 0x01, 0x02, 0x04, 0x00}, {0x20, 0x54, 0x54, 0x54, 0x78}, {0x7f, 0x48, 0x44, 0x44, 0x38}, {0x38, 0x44, 0x44, 0x44, 0x20},
+    {0x38, 0x44, 0x44, 0x48, 0x7f}, {0x38, 0x54, 0x54, 0x54, 0x18}, {0x08, 0x7e, 0x09, 0x01, 0x02}, {0x0c, 0x52, 0x52, 0x52, 0x3e},
+    {0x7f, 0x08, 0x04, 0x04, 0x78}, {0x00, 0x44, 0x7d, 0x40, 0x00}, {0x20, 0x40, 0x44, 0x3d, 0x00}, {0x00, 0x7f, 0x10, 0x28, 0x44},
+    {0x00, 0x41, 0x7f, 0x40, 0x00}, {0x7c, 0x04, 0x18, 0x04, 0x78}, {0x7c, 0x08, 0x04, 0x04, 0x78}, {0x38, 0x44, 0x44, 0x44, 0x38},
+    {0x7c, 0x14, 0x14, 0x14, 0x08}, {0x08, 0x14, 0x14, 0x18, 0x7c}, {0x7c, 0x08, 0x04, 0x04, 0x08}, {0x48, 0x54, 0x54, 0x54, 0x20},
+    {0x04, 0x3f, 0x44, 0x40, 0x20}, {0x3c, 0x40, 0x40, 0x20, 0x7c}, {0x1c, 0x20, 0x40, 0x20, 0x1c}, {0x3c, 0x40, 0x30, 0x40, 0x3c},
+    {0x44, 0x28, 0x10, 0x28, 0x44}, {0x0c, 0x50, 0x50, 0x50, 0x3c}, {0x44, 0x64, 0x54, 0x4c, 0x44}, {0x00, 0x08, 0x36, 0x41, 0x00},
+    {0x00, 0x00, 0x7f, 0x00, 0x00}, {0x00, 0x41, 0x36, 0x08, 0x00}, {0x08, 0x04, 0x08, 0x10, 0x08},
+};
+
+void pezRenderText(PezPixels pixels, const char* message)
+{
+    int channels, line = 0, column = 0;
+    unsigned char* frame = (unsigned char*) pixels.Frames;
+
+    switch (pixels.Format) {
+        case GL_RED: channels = 1; break;
+        case GL_RG: channels = 2; break;
+        case GL_RGB: channels = 3; break;
+        default: channels = 4; break;
+    }
+    pezCheck(pixels.Type == GL_UNSIGNED_BYTE, "pezRenderText needs 8-bit pixels");
+
+    // Glyphs occupy 6x8 cells starting at the top left; rows run bottom-up as in GL.
+    for (; *message; message++) {
+        int glyph = *message - ' ';
+        int x, y;
+        if (*message == '\n') {
+            line++;
+            column = 0;
+            continue;
+        }
+        if (glyph < 0 || glyph >= 95) {
+            glyph = '?' - ' ';
+        }
+        for (x = 0; x < 5; x++) {
+            int px = column * 6 + x;
+            if (px >= pixels.Width) {
+                break;
+            }
+            for (y = 0; y < 7; y++) {
+                int py = pixels.Height - 1 - (line * 8 + y);
+                if (py < 0) {
+                    break;
+                }
+                if (__pez__Font[glyph][x] & (1 << y)) {
+                    memset(frame + (py * pixels.Width + px) * channels, 255, channels);
+                }
+            }
+        }
+        column++;
+    }
+}
+
 void pezFreeVerts(PezVerts verts)
 {
     free(verts.RawHeader);
@@ -7,6 +7,8 @@ extern "C" {
 #define PEZ_MAINLOOP 1
 #define PEZ_MOUSE_HANDLER 1
 #define PEZ_DROP_HANDLER 1
+#define PEZ_HEADLESS_HANDLER 1
+#define PEZ_SIMULATION_HANDLER 1
 #define GL3_PROTOTYPES
 
 #include "gl3.h"
@@ -14,6 +16,14 @@ extern "C" {
 
 #define PEZ_FORWARD_COMPATIBLE_GL 1
 
+// Debug builds create debug contexts and report GL errors through a debug-output
+// callback.  Release builds (NDEBUG) never poll glGetError, since it can stall the driver.
+#ifdef NDEBUG
+#define PEZ_GL_DEBUG 0
+#else
+#define PEZ_GL_DEBUG 1
+#endif
+
 typedef struct PezConfigRec
 {
     const char* Title;
@@ -29,6 +39,10 @@ void PezInitialize();
 void PezRender();
 void PezUpdate(float seconds);
 
+// Runs once the window closes, after the simulation thread has stopped, while the
+// window's context is still current.
+void PezShutdown();
+
 #ifdef PEZ_MOUSE_HANDLER
 void PezHandleMouse(int x, int y, int action);
 #endif
@@ -39,6 +53,23 @@ void PezHandleKey(char c);
 void PezReceiveDrop(const char* filename);
 #endif
 
+#ifdef PEZ_HEADLESS_HANDLER
+// Invoked with the arguments that follow "--headless" on the command line,
+// after an offscreen context has been made current.  Returns the exit code.
+int PezRunHeadless(int argc, char** argv);
+#endif
+
+#ifdef PEZ_SIMULATION_HANDLER
+// Invoked on a second thread whose context shares objects with the window's context.
+// PezInitializeSimulation runs once after PezInitialize, PezSimulate then runs in a
+// loop with the seconds since its previous call, and PezShutdownSimulation runs when
+// the window closes.  Containers such as VAOs and FBOs are not shared between the
+// contexts, so the simulation creates its own.
+void PezInitializeSimulation();
+void PezSimulate(float seconds);
+void PezShutdownSimulation();
+#endif
+
 #else
 void pezSwapBuffers();
 #endif
@@ -58,6 +89,36 @@ const char* pezOpenFileDialog();
 const char* pezGetDesktopFolder();
 const char* pezGetShader(const char* effectKey);
 
+// Turns debug output on or off for the current context; a no-op in release builds.
+void pezSetDebugOutput(int enable);
+
+// Monotonic clock with nanosecond resolution.
+unsigned long long pezGetNanoseconds();
+
+// Timings are kept per channel over a rolling window of recent samples and summarized
+// from a log-scale histogram.  The main loop records the first three channels and
+// the simulation thread the last; a summary is logged every PEZ_TIMING_LOG_SECONDS.
+enum {PEZ_TIME_FRAME, PEZ_TIME_UPDATE, PEZ_TIME_RENDER, PEZ_TIME_SIMULATE, PEZ_TIME_CHANNELS};
+#define PEZ_TIMING_LOG_SECONDS 10
+
+// All times are in milliseconds; Count is the number of samples in the window.
+typedef struct PezTimingStatsRec {
+    int Count;
+    double Mean;
+    double P50;
+    double P95;
+    double P99;
+    double Max;
+} PezTimingStats;
+
+void pezRecordTiming(int channel, unsigned long long nanoseconds);
+PezTimingStats pezGetTimingStats(int channel);
+void pezLogTimings();
+
+// Returns the name of an effect whose file changed on disk since it was loaded, or 0
+// if there are none.  The effect is re-read by the next pezGetShader that needs it.
+const char* pezPollShaderChange();
+
 typedef struct PezAttribRec {
     const GLchar* Name;
     GLint Size;
@@ -103,6 +164,10 @@ void pezSavePixels(PezPixels pixels, const char* filename);
 void pezRenderText(PezPixels pixels, const char* message);
 PezPixels pezGenNoise(PezPixels desc, float alpha, float beta, int n);
 
+// The bundled LZF-compatible codec; see pez.c for the details.
+int lzfx_compress(const void* ibuf, unsigned int ilen, void* obuf, unsigned int *olen);
+int lzfx_decompress(const void* ibuf, unsigned int ilen, void* obuf, unsigned int *olen);
+
 // For internal use, to support pezGetShader:
 int pezSwInit(const char* keyPrefix);
 int pezSwShutdown();
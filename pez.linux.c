@@ -4,12 +4,14 @@
 
 #include "pez.h"
 #include "bstrlib.h"
-#include <sys/time.h>
+#include <time.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdarg.h>
 #include <signal.h>
 #include <wchar.h>
+#include <string.h>
+#include <pthread.h>
 #include <Xm/MwmUtil.h>
 
 #include <X11/Xlib.h>
@@ -22,15 +24,198 @@ typedef struct PlatformContextRec
     Window MainWindow;
 } PlatformContext;
 
-unsigned int GetMicroseconds()
+unsigned long long pezGetNanoseconds()
 {
-    struct timeval tp;
-    gettimeofday(&tp, NULL);
-    return tp.tv_sec * 1000000 + tp.tv_usec;
+    struct timespec tp;
+    clock_gettime(CLOCK_MONOTONIC, &tp);
+    return tp.tv_sec * 1000000000ull + tp.tv_nsec;
 }
 
+static GLXContext CreateForwardCompatibleContext(Display* display, GLXFBConfig config, GLXContext shareContext)
+{
+    PFNGLXCREATECONTEXTATTRIBSARBPROC glXCreateContextAttribs = (PFNGLXCREATECONTEXTATTRIBSARBPROC)glXGetProcAddress((GLubyte*)"glXCreateContextAttribsARB");
+    if (!glXCreateContextAttribs) {
+        pezFatal("Your platform does not support OpenGL 4.0.\n"
+                 "Try changing PEZ_FORWARD_COMPATIBLE_GL to 0.\n");
+    }
+    int flags = GLX_CONTEXT_FORWARD_COMPATIBLE_BIT_ARB;
+    if (PEZ_GL_DEBUG)
+        flags |= GLX_CONTEXT_DEBUG_BIT_ARB;
+    int attribs[] = {
+        GLX_CONTEXT_MAJOR_VERSION_ARB, 4,
+        GLX_CONTEXT_MINOR_VERSION_ARB, 0,
+        GLX_CONTEXT_FLAGS_ARB, flags,
+        0
+    };
+    return glXCreateContextAttribs(display, config, shareContext, True, attribs);
+}
+
+#if PEZ_GL_DEBUG
+// Errors are fatal, like the glGetError checks this replaces; with synchronous output
+// the offending call is still on the stack.
+static void APIENTRY DebugOutputCallback(GLenum source, GLenum type, GLuint id, GLenum severity,
+                                         GLsizei length, const GLchar* message, GLvoid* userParam)
+{
+    if (type == GL_DEBUG_TYPE_ERROR_ARB)
+        pezFatal("OpenGL error: %s\n", message);
+    if (severity == GL_DEBUG_SEVERITY_HIGH_ARB || severity == GL_DEBUG_SEVERITY_MEDIUM_ARB)
+        pezPrintString("OpenGL: %s\n", message);
+}
+#endif
+
+void pezSetDebugOutput(int enable)
+{
+#if PEZ_GL_DEBUG
+    PFNGLDEBUGMESSAGECALLBACKARBPROC glDebugMessageCallback =
+        (PFNGLDEBUGMESSAGECALLBACKARBPROC) glXGetProcAddress((GLubyte*)"glDebugMessageCallbackARB");
+    if (!glDebugMessageCallback)
+        return;
+
+    // A null callback sends messages to the driver's log instead, which nobody reads.
+    glDebugMessageCallback(enable ? (GLDEBUGPROCARB) DebugOutputCallback : 0, 0);
+    if (enable)
+        glEnable(GL_DEBUG_OUTPUT_SYNCHRONOUS_ARB);
+    else
+        glDisable(GL_DEBUG_OUTPUT_SYNCHRONOUS_ARB);
+#endif
+}
+
+static void InitShaderWrangler()
+{
+    pezSwInit("");
+    pezSwAddPath("./", ".glsl");
+    pezSwAddPath("../", ".glsl");
+    char qualifiedPath[128];
+    strcpy(qualifiedPath, pezResourcePath());
+    strcat(qualifiedPath, "/");
+    pezSwAddPath(qualifiedPath, ".glsl");
+    pezSwAddDirective("*", "#version 400");
+}
+
+// Creates a 1x1 pbuffer for contexts that never draw to a window.  The caller frees *configs.
+static GLXPbuffer CreateTinyPbuffer(Display* display, GLXFBConfig** configs)
+{
+    int attrib[] = {
+        GLX_RENDER_TYPE, GLX_RGBA_BIT,
+        GLX_DRAWABLE_TYPE, GLX_PBUFFER_BIT,
+        GLX_RED_SIZE, 8,
+        GLX_GREEN_SIZE, 8,
+        GLX_BLUE_SIZE, 8,
+        GLX_ALPHA_SIZE, 8,
+        None
+    };
+    int pbufferAttrib[] = {
+        GLX_PBUFFER_WIDTH, 1,
+        GLX_PBUFFER_HEIGHT, 1,
+        None
+    };
+
+    int fbcount;
+    GLXFBConfig *fbc = glXChooseFBConfig(display, DefaultScreen(display), attrib, &fbcount);
+    if (!fbc || !fbcount)
+        pezFatal("Failed to retrieve a pbuffer config\n");
+
+    *configs = fbc;
+    return glXCreatePbuffer(display, fbc[0], pbufferAttrib);
+}
+
+#ifdef PEZ_SIMULATION_HANDLER
+typedef struct SimulationThreadRec
+{
+    Display* MainDisplay;
+    GLXContext Context;
+    GLXPbuffer Pbuffer;
+    GLXFBConfig* Configs;
+    pthread_t Thread;
+    int Done;
+} SimulationThread;
+
+static void* RunSimulation(void* arg)
+{
+    SimulationThread* sim = (SimulationThread*) arg;
+    glXMakeContextCurrent(sim->MainDisplay, sim->Pbuffer, sim->Pbuffer, sim->Context);
+    glGetError();
+    pezSetDebugOutput(1);
+
+    PezInitializeSimulation();
+    unsigned long long previousTime = pezGetNanoseconds();
+    while (!__atomic_load_n(&sim->Done, __ATOMIC_ACQUIRE)) {
+        unsigned long long currentTime = pezGetNanoseconds();
+        unsigned long long deltaTime = currentTime - previousTime;
+        previousTime = currentTime;
+        PezSimulate((float) (deltaTime * 1e-9));
+        pezRecordTiming(PEZ_TIME_SIMULATE, pezGetNanoseconds() - currentTime);
+    }
+    PezShutdownSimulation();
+
+    glXMakeContextCurrent(sim->MainDisplay, None, None, NULL);
+    return 0;
+}
+
+// The simulation context shares objects with the window's context and renders into its own pbuffer.
+static void StartSimulation(SimulationThread* sim, Display* display, GLXContext shareContext)
+{
+    sim->MainDisplay = display;
+    sim->Pbuffer = CreateTinyPbuffer(display, &sim->Configs);
+    sim->Context = CreateForwardCompatibleContext(display, sim->Configs[0], shareContext);
+    if (!sim->Context)
+        pezFatal("Unable to create the simulation context\n");
+    sim->Done = 0;
+    if (pthread_create(&sim->Thread, NULL, RunSimulation, sim))
+        pezFatal("Unable to start the simulation thread\n");
+}
+
+static void StopSimulation(SimulationThread* sim)
+{
+    __atomic_store_n(&sim->Done, 1, __ATOMIC_RELEASE);
+    pthread_join(sim->Thread, NULL);
+    glXDestroyContext(sim->MainDisplay, sim->Context);
+    glXDestroyPbuffer(sim->MainDisplay, sim->Pbuffer);
+    XFree(sim->Configs);
+}
+#endif
+
+#ifdef PEZ_HEADLESS_HANDLER
+// Renders into a tiny pbuffer so that batch jobs never map a window.
+static int RunHeadless(int argc, char** argv)
+{
+    Display* display = XOpenDisplay(NULL);
+    if (!display)
+        pezFatal("Unable to open the X display\n");
+
+    GLXFBConfig* fbc;
+    GLXPbuffer pbuffer = CreateTinyPbuffer(display, &fbc);
+    GLXContext glcontext = CreateForwardCompatibleContext(display, fbc[0], NULL);
+    glXMakeContextCurrent(display, pbuffer, pbuffer, glcontext);
+    glGetError();
+    pezSetDebugOutput(1);
+
+    InitShaderWrangler();
+    pezPrintString("OpenGL Version: %s\n", glGetString(GL_VERSION));
+    int result = PezRunHeadless(argc, argv);
+    pezSwShutdown();
+
+    glXMakeContextCurrent(display, None, None, NULL);
+    glXDestroyContext(display, glcontext);
+    glXDestroyPbuffer(display, pbuffer);
+    XFree(fbc);
+    XCloseDisplay(display);
+    return result;
+}
+#endif
+
 int main(int argc, char** argv)
 {
+#ifdef PEZ_HEADLESS_HANDLER
+    if (argc > 1 && !strcmp(argv[1], "--headless"))
+        return RunHeadless(argc - 2, argv + 2);
+#endif
+
+#ifdef PEZ_SIMULATION_HANDLER
+    // The simulation thread makes its context current on the same display connection.
+    XInitThreads();
+#endif
+
     int attrib[] = {
         GLX_RENDER_TYPE, GLX_RGBA_BIT,
         GLX_DRAWABLE_TYPE, GLX_WINDOW_BIT,
@@ -130,18 +315,7 @@ int main(int argc, char** argv)
 
     GLXContext glcontext = 0;
     if (PEZ_FORWARD_COMPATIBLE_GL) {
-        PFNGLXCREATECONTEXTATTRIBSARBPROC glXCreateContextAttribs = (PFNGLXCREATECONTEXTATTRIBSARBPROC)glXGetProcAddress((GLubyte*)"glXCreateContextAttribsARB");
-        if (!glXCreateContextAttribs) {
-            pezFatal("Your platform does not support OpenGL 4.0.\n"
-                     "Try changing PEZ_FORWARD_COMPATIBLE_GL to 0.\n");
-        }
-        int attribs[] = {
-            GLX_CONTEXT_MAJOR_VERSION_ARB, 4,
-            GLX_CONTEXT_MINOR_VERSION_ARB, 0,
-            GLX_CONTEXT_FLAGS_ARB, GLX_CONTEXT_FORWARD_COMPATIBLE_BIT_ARB,
-            0
-        };
-        glcontext = glXCreateContextAttribs(context.MainDisplay, fbc[0], NULL, True, attribs);
+        glcontext = CreateForwardCompatibleContext(context.MainDisplay, fbc[0], NULL);
     } else {
         glcontext = glXCreateContext(context.MainDisplay, visinfo, NULL, True);
     }
@@ -154,19 +328,11 @@ int main(int argc, char** argv)
 
     // Reset OpenGL error state:
     glGetError();
+    pezSetDebugOutput(1);
 
     // Lop off the trailing .c
     bstring name = bfromcstr(PezGetConfig().Title);
-    pezSwInit("");
-
-    // Set up the Shader Wrangler
-    pezSwAddPath("./", ".glsl");
-    pezSwAddPath("../", ".glsl");
-    char qualifiedPath[128];
-    strcpy(qualifiedPath, pezResourcePath());
-    strcat(qualifiedPath, "/");
-    pezSwAddPath(qualifiedPath, ".glsl");
-    pezSwAddDirective("*", "#version 400");
+    InitShaderWrangler();
 
     // Perform user-specified intialization
     pezPrintString("OpenGL Version: %s\n", glGetString(GL_VERSION));
@@ -175,18 +341,21 @@ int main(int argc, char** argv)
     XStoreName(context.MainDisplay, context.MainWindow, bdata(windowTitle));
     bdestroy(windowTitle);
     bdestroy(name);
+
+#ifdef PEZ_SIMULATION_HANDLER
+    SimulationThread simulation;
+    StartSimulation(&simulation, context.MainDisplay, glcontext);
+#endif
     
     // -------------------
     // Start the Game Loop
     // -------------------
 
-    unsigned int previousTime = GetMicroseconds();
+    unsigned long long previousTime = pezGetNanoseconds();
+    unsigned long long previousLog = previousTime;
     int done = 0;
     while (!done) {
         
-        if (glGetError() != GL_NO_ERROR)
-            pezFatal("OpenGL error.\n");
-
         while (XPending(context.MainDisplay)) {
             XEvent event;
     
@@ -235,16 +404,29 @@ int main(int argc, char** argv)
             }
         }
 
-        unsigned int currentTime = GetMicroseconds();
-        unsigned int deltaTime = currentTime - previousTime;
+        unsigned long long currentTime = pezGetNanoseconds();
+        unsigned long long deltaTime = currentTime - previousTime;
         previousTime = currentTime;
+        pezRecordTiming(PEZ_TIME_FRAME, deltaTime);
         
-        PezUpdate((float) deltaTime / 1000000.0f);
+        PezUpdate((float) (deltaTime * 1e-9));
+        unsigned long long updatedTime = pezGetNanoseconds();
+        pezRecordTiming(PEZ_TIME_UPDATE, updatedTime - currentTime);
 
         PezRender();
+        pezRecordTiming(PEZ_TIME_RENDER, pezGetNanoseconds() - updatedTime);
         glXSwapBuffers(context.MainDisplay, context.MainWindow);
+
+        if (currentTime - previousLog >= PEZ_TIMING_LOG_SECONDS * 1000000000ull) {
+            pezLogTimings();
+            previousLog = currentTime;
+        }
     }
 
+#ifdef PEZ_SIMULATION_HANDLER
+    StopSimulation(&simulation);
+#endif
+    PezShutdown();
     pezSwShutdown();
 
     return 0;